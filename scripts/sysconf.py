@@ -10,6 +10,7 @@ class Sysconf:
         with open(path, 'r') as infile:
             data = safe_load(infile.read())
             self.address = data["address"]
+            self.clock_address = data["clock_address"]
 
             for v in data["vars"]:
                 sys_vars.append(Sysconf.Var(v["name"], v["section"], v["type"]))
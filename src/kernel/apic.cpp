@@ -1,10 +1,12 @@
 #include "apic.h"
 #include "kassert.h"
 #include "clock.h"
+#include "cpu.h"
 #include "interrupts.h"
 #include "io.h"
 #include "logger.h"
 #include "memory.h"
+#include "msr.h"
 
 uint64_t lapic::s_ticks_per_us = 0;
 
@@ -23,6 +25,9 @@ static constexpr uint16_t lapic_timer_init = 0x0380;
 static constexpr uint16_t lapic_timer_cur  = 0x0390;
 static constexpr uint16_t lapic_timer_div  = 0x03e0;
 
+static constexpr uint64_t max_timer_count  = 0xffffffffull;
+static constexpr uint32_t max_divisor      = 128;
+
 static uint32_t
 apic_read(uint32_t volatile *apic, uint16_t offset)
 {
@@ -58,7 +63,9 @@ apic::apic(uintptr_t base) :
 
 lapic::lapic(uintptr_t base) :
     apic(base),
-    m_divisor(0)
+    m_divisor(0),
+    m_tsc_deadline(false),
+    m_deadline(0)
 {
     apic_write(m_base, lapic_lvt_error, static_cast<uint32_t>(isr::isrAPICError));
     apic_write(m_base, lapic_spurious, static_cast<uint32_t>(isr::isrSpurious));
@@ -154,8 +161,13 @@ lapic::set_divisor(uint8_t divisor)
 void
 lapic::enable_timer(isr vector, bool repeat)
 {
+    m_tsc_deadline = !repeat && clock::get().is_tsc() &&
+        current_cpu().features[cpu::feature::tsc_deadline];
+
     uint32_t lvte = static_cast<uint8_t>(vector);
-    if (repeat)
+    if (m_tsc_deadline)
+        lvte |= 0x40000;
+    else if (repeat)
         lvte |= 0x20000;
     apic_write(m_base, lapic_lvt_timer, lvte);
 
@@ -165,11 +177,26 @@ lapic::enable_timer(isr vector, bool repeat)
 uint32_t
 lapic::reset_timer(uint64_t interval)
 {
-    uint64_t remaining = ticks_to_us(apic_read(m_base, lapic_timer_cur));
+    if (interval > max_interval())
+        interval = max_interval();
+
+    if (m_tsc_deadline) {
+        // In TSC-deadline mode, the timer is armed with an absolute
+        // TSC value, and writing 0 disarms it
+        const clock &clk = clock::get();
+        uint64_t now = clk.ticks();
+        uint64_t remaining = m_deadline > now ? clk.to_us(m_deadline - now) : 0;
+
+        m_deadline = interval ? now + clk.to_ticks(interval) : 0;
+        wrmsr(msr::ia32_tsc_deadline, m_deadline);
+        return remaining;
+    }
+
+    uint64_t remaining = ticks_to_us(apic_read(m_base, lapic_timer_cur) * uint64_t(m_divisor));
     uint64_t ticks = us_to_ticks(interval);
 
-    int divisor = 1;
-    while (ticks > 0xffffffffull) {
+    uint32_t divisor = 1;
+    while (ticks > max_timer_count && divisor < max_divisor) {
         ticks >>= 1;
         divisor <<= 1;
     }
@@ -181,6 +208,14 @@ lapic::reset_timer(uint64_t interval)
     return remaining;
 }
 
+uint64_t
+lapic::max_interval()
+{
+    // Also keep within the 32 bits reset_timer() reports back
+    uint64_t us = ticks_to_us(max_timer_count * max_divisor);
+    return us < max_timer_count ? us : max_timer_count;
+}
+
 void
 lapic::enable_lint(uint8_t num, isr vector, bool nmi, uint16_t flags)
 {
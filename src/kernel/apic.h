@@ -62,7 +62,9 @@ public:
     /// before sending another IPI with send_ipi().
     void ipi_wait();
 
-    /// Enable interrupts for the LAPIC timer.
+    /// Enable interrupts for the LAPIC timer. One-off timers use
+    /// TSC-deadline mode if the CPU supports it and the master clock
+    /// is the TSC.
     /// \arg vector   Interrupt vector the timer should use
     /// \arg repeat   If false, this timer is one-off, otherwise repeating
     void enable_timer(isr vector, bool repeat = true);
@@ -76,6 +78,11 @@ public:
     /// \returns  The interval in us remaining before an interrupt was to happen
     inline uint32_t stop_timer() { return reset_timer(0); }
 
+    /// Get the longest interval the timer can be armed with. Longer
+    /// intervals passed to reset_timer() are shortened to this.
+    /// \returns  The maximum interval in us
+    static uint64_t max_interval();
+
     /// Enable interrupts for the LAPIC LINT0 pin.
     /// \arg num      Local interrupt number (0 or 1)
     /// \arg vector   Interrupt vector LINT0 should use
@@ -97,6 +104,8 @@ private:
     void set_repeat(bool repeat);
 
     uint32_t m_divisor;
+    bool m_tsc_deadline;
+    uint64_t m_deadline;
     static uint64_t s_ticks_per_us;
 };
 
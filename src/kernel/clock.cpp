@@ -1,16 +1,91 @@
+#include <j6/clock.h>
+
 #include "clock.h"
+#include "kassert.h"
 
 clock * clock::s_instance = nullptr;
 
-clock::clock(uint64_t rate, clock::source source_func, void *data) :
-    m_rate(rate),
-    m_data(data),
-    m_source(source_func)
+static constexpr uint64_t us_per_second = 1000000;
+static constexpr uint64_t ns_per_second = 1000000000;
+
+/// Find a multiplier and shift such that `(x * mult) >> shift` is
+/// approximately `x * to / from`, with as much precision as possible
+/// while keeping `mult` within 63 bits.
+static void
+find_mult_shift(uint64_t from, uint64_t to, uint64_t &mult, uint8_t &shift)
+{
+    using u128 = unsigned __int128;
+    constexpr u128 max_mult = 1ull << 63;
+
+    shift = 64;
+    while (shift && (static_cast<u128>(to) << shift) / from >= max_mult)
+        --shift;
+
+    mult = (static_cast<u128>(to) << shift) / from;
+}
+
+clock::clock(uint64_t frequency, clock::source source_func, void *data) :
+    m_page(nullptr)
 {
+    set_source(frequency, source_func, data);
+
     // TODO: make this atomic
     if (s_instance == nullptr)
         s_instance = this;
+}
+
+void
+clock::set_source(uint64_t frequency, clock::source source_func, void *data)
+{
+    kassert(frequency, "Clock source with zero frequency");
+
+    m_frequency = frequency;
+    m_data = data;
+    m_source = source_func;
+
+    find_mult_shift(frequency, us_per_second, m_us_mult, m_us_shift);
+    find_mult_shift(us_per_second, frequency, m_ticks_mult, m_ticks_shift);
+
     update();
+    update_page();
+}
+
+void
+clock::publish(j6_clock_page *page)
+{
+    m_page = page;
+    update_page();
+}
+
+void
+clock::update_page()
+{
+    if (!m_page)
+        return;
+
+    j6_clock_page &page = *m_page;
+
+    // Odd sequence values tell readers an update is in progress
+    uint32_t seq = page.seq;
+    __atomic_store_n(&page.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // Only the TSC can be read from userspace
+    if (is_tsc()) {
+        uint64_t mult;
+        uint8_t shift;
+        find_mult_shift(m_frequency, ns_per_second, mult, shift);
+
+        page.mult = mult;
+        page.shift = shift;
+        page.base_ticks = ticks();
+        page.base_ns = value() * 1000;
+        page.frequency = m_frequency;
+    } else {
+        page.frequency = 0;
+    }
+
+    __atomic_store_n(&page.seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 void
@@ -19,4 +94,3 @@ clock::spinwait(uint64_t us) const
     uint64_t when = value() + us;
     while (value() < when) asm ("pause");
 }
-
@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 
+struct j6_clock_page;
+
 class clock
 {
 public:
@@ -12,21 +14,56 @@ public:
     using source = uint64_t (*)(void*);
 
     /// Constructor.
-    /// \arg rate   Number of source ticks per us
-    /// \arg source Function for the clock source
-    /// \arg data   Data to pass to the source function
-    clock(uint64_t rate, source source_func, void *data);
+    /// \arg frequency    Number of source ticks per second
+    /// \arg source_func  Function for the clock source, or null to
+    ///                   read the CPU's TSC directly
+    /// \arg data         Data to pass to the source function
+    clock(uint64_t frequency, source source_func, void *data);
+
+    /// Change the source of this clock. This should only be done
+    /// before anything has started keeping time with the clock.
+    /// \arg frequency    Number of source ticks per second
+    /// \arg source_func  Function for the clock source, or null to
+    ///                   read the CPU's TSC directly
+    /// \arg data         Data to pass to the source function
+    void set_source(uint64_t frequency, source source_func, void *data);
+
+    /// Get the current raw value of the clock source.
+    /// \returns Current value of the source, in source ticks
+    inline uint64_t ticks() const {
+        return m_source ? m_source(m_data) : __builtin_ia32_rdtsc();
+    }
 
     /// Get the current value of the clock.
     /// \returns Current value of the source, in us
-    /// TODO: optimize divison by finding a multiply and
-    /// shift value instead
-    inline uint64_t value() const { return m_source(m_data) / m_rate; }
+    inline uint64_t value() const { return to_us(ticks()); }
+
+    /// Convert a number of source ticks to us.
+    inline uint64_t to_us(uint64_t ticks) const {
+        return (static_cast<unsigned __int128>(ticks) * m_us_mult) >> m_us_shift;
+    }
+
+    /// Convert a number of us to source ticks.
+    inline uint64_t to_ticks(uint64_t us) const {
+        return (static_cast<unsigned __int128>(us) * m_ticks_mult) >> m_ticks_shift;
+    }
+
+    /// Get the frequency of the clock source, in ticks per second
+    inline uint64_t frequency() const { return m_frequency; }
+
+    /// Check if the clock source is the CPU's TSC
+    inline bool is_tsc() const { return m_source == nullptr; }
 
     /// Update the internal state via the source
     /// \returns Current value of the clock
     inline void update() { m_current = value(); }
 
+    /// Set the user-visible clock page, and publish this clock's
+    /// parameters to it. The page is updated again whenever the
+    /// clock's source changes.
+    /// \arg page  The kernel address of the clock page
+    void publish(j6_clock_page *page);
+
     /// Wait in a tight loop
     /// \arg interval  Time to wait, in us
     void spinwait(uint64_t us) const;
@@ -36,9 +73,20 @@ public:
 
 private:
     uint64_t m_current; ///< current us count
-    uint64_t m_rate; ///< source ticks per us
+    uint64_t m_frequency; ///< source ticks per second
+
+    // Multiply/shift pairs for converting to and from us,
+    // so that reading the clock needs no division
+    uint64_t m_us_mult;
+    uint64_t m_ticks_mult;
+    uint8_t m_us_shift;
+    uint8_t m_ticks_shift;
+
     void *m_data;
     source m_source;
+    j6_clock_page *m_page;
+
+    void update_page();
 
     static clock *s_instance;
 };
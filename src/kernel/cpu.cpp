@@ -6,6 +6,7 @@
 #include "kassert.h"
 #include "cpu.h"
 #include "device_manager.h"
+#include "frame_allocator.h"
 #include "gdt.h"
 #include "idt.h"
 #include "logger.h"
@@ -97,12 +98,13 @@ cpu_early_init(cpu_data *cpu)
         .set(cr4::OSXMMEXCPT)
         .set(cr4::OSXSAVE);
 
-    // TODO: On KVM setting PCIDE generates a #GP even though
-    // the feature is listed as available in CPUID.
-    /*
-    if (cpu->features[cpu::feature::pcid])
+    // Setting PCIDE generates a #GP unless the PCID bits of
+    // CR3 are clear, which the loaded CR3 need not guarantee.
+    if (cpu->features[cpu::feature::pcid]) {
+        if (cr3_val & 0xfff)
+            asm volatile ( "mov %0, %%cr3" :: "r" (cr3_val & ~0xfffull) );
         cr4_val.set(cr4::PCIDE);
-    */
+    }
     asm volatile ( "mov %0, %%cr4" :: "r" (cr4_val) );
 
     // Enable SYSCALL and NX bit
@@ -220,6 +222,8 @@ cpu_init(cpu_data *cpu, bool bsp)
     cpu->thread = idle;
     cpu->tcb = idle->tcb();
 
+    frame_allocator::get().create_cache(*cpu);
+
     // Set up the syscall MSRs
     syscall_enable();
 
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <cpu/cpu_id.h>
 
+struct frame_cache;
+struct free_page_header;
 class GDT;
 class IDT;
 class lapic;
@@ -109,6 +111,16 @@ struct panic_data
 extern unsigned g_num_cpus;
 extern panic_data *g_panic_data_p;
 
+/// Number of PCIDs each CPU uses to keep address spaces' TLB entries
+constexpr unsigned cpu_pcid_slots = 8;
+
+/// The address space a CPU has given one of its PCIDs to
+struct pcid_slot
+{
+    uint64_t space; ///< TLB id of the vm_space, or 0 for none
+    uint64_t gen;   ///< The vm_space's TLB generation the entries are from
+};
+
 /// Per-cpu state data. If you change this, remember to update the assembly
 /// version in 'tasking.inc'
 struct cpu_data
@@ -132,6 +144,14 @@ struct cpu_data
     lapic *apic;
     panic_data *panic;
     cpu::features features;
+    frame_cache *frames;
+    free_page_header *table_pages; // Free page table pages cached on this CPU
+    uint32_t table_page_count;
+    uint64_t timer_interrupts;
+    uint32_t tlb_shootdown;
+    uint16_t pcid;      // The PCID in CR3, or 0 if not using PCIDs
+    uint16_t pcid_next; // The index of the next PCID slot to recycle
+    pcid_slot pcids[cpu_pcid_slots];
 };
 
 extern "C" {
@@ -7,6 +7,7 @@
 #include "kassert.h"
 #include "apic.h"
 #include "clock.h"
+#include "cpu.h"
 #include "device_manager.h"
 #include "interrupts.h"
 #include "logger.h"
@@ -247,12 +248,42 @@ device_manager::load_hpet(const acpi::table_header *header)
         reinterpret_cast<uint64_t*>(hpet->base_address.address + mem::linear_offset));
 }
 
+/// Measure the TSC frequency against the current master clock.
+/// \returns  The TSC frequency in ticks per second
 static uint64_t
-tsc_clock_source(void*)
+calibrate_tsc(const clock &ref)
 {
-    uint32_t lo = 0, hi = 0;
-    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
-    return ((uint64_t)hi << 32) | lo;
+    constexpr uint64_t calibrate_us = 10000;
+    const uint64_t ref_ticks = ref.to_ticks(calibrate_us);
+
+    uint64_t ref_start = ref.ticks();
+    uint64_t tsc_start = __builtin_ia32_rdtsc();
+
+    uint64_t ref_end = ref_start;
+    while (ref_end - ref_start < ref_ticks)
+        ref_end = ref.ticks();
+
+    uint64_t tsc_end = __builtin_ia32_rdtsc();
+
+    using u128 = unsigned __int128;
+    return static_cast<u128>(tsc_end - tsc_start) * ref.frequency() / (ref_end - ref_start);
+}
+
+/// Measure the average cost of reading the clock.
+/// \returns  The cost of one clock::value() call, in TSC cycles
+static uint64_t
+measure_clock_cost(const clock &c)
+{
+    constexpr unsigned iterations = 1000;
+    volatile uint64_t sink = 0;
+
+    uint64_t start = __builtin_ia32_rdtsc();
+    for (unsigned i = 0; i < iterations; ++i)
+        sink = c.value();
+    uint64_t end = __builtin_ia32_rdtsc();
+
+    (void)sink;
+    return (end - start) / iterations;
 }
 
 void
@@ -273,17 +304,33 @@ device_manager::init_drivers()
         ahcid.register_device(&device);
     }
     */
+    const bool invariant_tsc = current_cpu().features[cpu::feature::invtsc];
+
     clock *master_clock = nullptr;
     if (m_hpets.count() > 0) {
         hpet &h = m_hpets[0];
         h.enable();
 
         // becomes the singleton
-        master_clock = new clock(h.rate(), hpet_clock_source, &h);
-        log::info(logs::timer, "Created master clock using HPET 0: Rate %d", h.rate());
+        master_clock = new clock(h.frequency(), hpet_clock_source, &h);
+        log::info(logs::timer, "Created master clock using HPET 0: Rate %lld Hz", h.frequency());
+
+        // The TSC is much cheaper to read than the HPET, so use it
+        // instead if it runs at a constant rate
+        if (invariant_tsc) {
+            uint64_t hpet_cost = measure_clock_cost(*master_clock);
+            uint64_t tsc_freq = calibrate_tsc(*master_clock);
+            master_clock->set_source(tsc_freq, nullptr, nullptr);
+            uint64_t tsc_cost = measure_clock_cost(*master_clock);
+
+            log::info(logs::timer, "Switched master clock to invariant TSC: Rate %lld Hz", tsc_freq);
+            log::info(logs::timer, "    clock::value() cost: HPET %lld cycles, TSC %lld cycles",
+                    hpet_cost, tsc_cost);
+        }
     } else {
         //TODO: Other clocks, APIC clock?
-        master_clock = new clock(5000, tsc_clock_source, nullptr);
+        master_clock = new clock(5000000000ull, nullptr, nullptr);
+        log::warn(logs::timer, "No HPET, using uncalibrated TSC as master clock");
     }
 
     kassert(master_clock, "Failed to allocate master clock");
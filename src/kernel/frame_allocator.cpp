@@ -1,6 +1,7 @@
 #include <bootproto/kernel.h>
 
 #include "kassert.h"
+#include "cpu.h"
 #include "debugcon.h"
 #include "frame_allocator.h"
 #include "logger.h"
@@ -29,11 +30,191 @@ bsf(uint64_t v)
     return v;
 }
 
+/// Get a mask of bits [lo, hi) of a 64-bit word, where 0 <= lo < hi <= 64
+inline uint64_t
+range_mask(unsigned lo, unsigned hi)
+{
+    uint64_t top = hi == 64 ? ~0ull : ((1ull << hi) - 1);
+    return top & ~((1ull << lo) - 1);
+}
+
+/// Mark the frames [start, start + count) of a block as free, a
+/// bitmap word at a time.
+static void
+mark_free(bootproto::frame_block &block, size_t start, size_t count)
+{
+    size_t end = start + count;
+    size_t frame = start;
+    while (frame < end) {
+        size_t word = frame >> 6;
+        unsigned lo = frame & 0x3f;
+        unsigned hi = (end - (word << 6)) < 64 ? (end - (word << 6)) : 64;
+
+        unsigned o1 = word >> 6;
+        unsigned o2 = word & 0x3f;
+        block.bitmap[word] |= range_mask(lo, hi);
+        block.map2[o1] |= (1ull << o2);
+        block.map1 |= (1ull << o1);
+
+        frame = (word + 1) << 6;
+    }
+}
+
+/// Find the first used frame in the range [start, end) of a block.
+/// \returns  The index of the first used frame, or `end` if all are free
+static size_t
+find_used(const bootproto::frame_block &block, size_t start, size_t end)
+{
+    size_t frame = start;
+    while (frame < end) {
+        size_t word = frame >> 6;
+        unsigned lo = frame & 0x3f;
+        unsigned hi = (end - (word << 6)) < 64 ? (end - (word << 6)) : 64;
+
+        // Groups with no free frames have their map2 bit cleared,
+        // so skip reading the bitmap for them
+        unsigned o1 = word >> 6;
+        unsigned o2 = word & 0x3f;
+        if (!(block.map2[o1] & (1ull << o2)))
+            return frame;
+
+        uint64_t used = ~block.bitmap[word] & range_mask(lo, hi);
+        if (used)
+            return (word << 6) + bsf(used);
+
+        frame = (word + 1) << 6;
+    }
+    return end;
+}
+
+/// Find the first free frame in the range [start, end) of a block.
+/// \returns  The index of the first free frame, or `end` if all are used
+static size_t
+find_free(const bootproto::frame_block &block, size_t start, size_t end)
+{
+    size_t frame = start;
+    while (frame < end) {
+        size_t word = frame >> 6;
+        unsigned lo = frame & 0x3f;
+        unsigned hi = (end - (word << 6)) < 64 ? (end - (word << 6)) : 64;
+
+        unsigned o1 = word >> 6;
+        unsigned o2 = word & 0x3f;
+        if (block.map2[o1] & (1ull << o2)) {
+            uint64_t free = block.bitmap[word] & range_mask(lo, hi);
+            if (free)
+                return (word << 6) + bsf(free);
+        }
+
+        frame = (word + 1) << 6;
+    }
+    return end;
+}
+
+/// Mark the frames [start, start + count) of a block as used, a
+/// bitmap word at a time.
+static void
+mark_used(bootproto::frame_block &block, size_t start, size_t count)
+{
+    size_t end = start + count;
+    size_t frame = start;
+    while (frame < end) {
+        size_t word = frame >> 6;
+        unsigned lo = frame & 0x3f;
+        unsigned hi = (end - (word << 6)) < 64 ? (end - (word << 6)) : 64;
+
+        uint64_t &bits = block.bitmap[word];
+        bits &= ~range_mask(lo, hi);
+        if (!bits) {
+            unsigned o1 = word >> 6;
+            unsigned o2 = word & 0x3f;
+            block.map2[o1] &= ~(1ull << o2);
+            if (!block.map2[o1])
+                block.map1 &= ~(1ull << o1);
+        }
+
+        frame = (word + 1) << 6;
+    }
+}
+
+// Disable interrupts while using the current CPU's frame cache, so the
+// current thread can't be preempted or migrated in the middle of it
+inline uint64_t
+cache_lock()
+{
+    uint64_t rflags;
+    asm volatile ("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+inline void
+cache_unlock(uint64_t rflags)
+{
+    if (rflags & 0x200)
+        asm volatile ("sti" ::: "memory");
+}
+
+void
+frame_allocator::create_cache(cpu_data &cpu)
+{
+    frame_cache *cache = new frame_cache;
+    cache->count = 0;
+    cpu.frames = cache;
+}
+
+void
+frame_allocator::refill(frame_cache &cache)
+{
+    util::scoped_lock lock {m_lock};
+
+    while (cache.count < frame_cache::batch) {
+        uintptr_t phys = 0;
+        size_t n = take_frames(frame_cache::batch - cache.count, &phys);
+        if (!n)
+            break;
+
+        for (size_t i = 0; i < n; ++i)
+            cache.frames[cache.count++] = phys + i * frame_size;
+    }
+}
+
+void
+frame_allocator::drain(frame_cache &cache, size_t count)
+{
+    util::scoped_lock lock {m_lock};
+
+    while (count-- && cache.count)
+        free_frames(cache.frames[--cache.count], 1);
+}
+
 size_t
 frame_allocator::allocate(size_t count, uintptr_t *address)
 {
+    if (count == 1) {
+        uint64_t rflags = cache_lock();
+        frame_cache *cache = current_cpu().frames;
+        if (cache) {
+            if (!cache->count)
+                refill(*cache);
+
+            if (cache->count) {
+                *address = cache->frames[--cache->count];
+                cache_unlock(rflags);
+                return 1;
+            }
+        }
+        cache_unlock(rflags);
+    }
+
     util::scoped_lock lock {m_lock};
+    size_t n = take_frames(count, address);
+    kassert(n, "frame_allocator ran out of free frames!");
+    return n;
+}
 
+size_t
+frame_allocator::take_frames(size_t count, uintptr_t *address)
+{
     for (long i = m_count - 1; i >= 0; --i) {
         frame_block &block = m_blocks[i];
 
@@ -76,22 +257,75 @@ frame_allocator::allocate(size_t count, uintptr_t *address)
         return n;
     }
 
-    kassert(false, "frame_allocator ran out of free frames!");
     return 0;
 }
 
-void
-frame_allocator::free(uintptr_t address, size_t count)
+bool
+frame_allocator::allocate_contiguous(size_t count, size_t align, uintptr_t *address)
 {
+    kassert(count, "Allocating zero contiguous frames");
+    kassert(align && (align & (align - 1)) == 0, "Frame alignment must be a power of two");
+
     util::scoped_lock lock {m_lock};
 
+    for (long i = m_count - 1; i >= 0; --i) {
+        frame_block &block = m_blocks[i];
+        if (!block.map1 || block.count < count)
+            continue;
+
+        // Candidate frames are those whose physical address is aligned,
+        // which may not be aligned relative to the block's base
+        const size_t base_frame = block.base / frame_size;
+        const size_t mask = align - 1;
+        size_t frame = (align - (base_frame & mask)) & mask;
+
+        while (frame + count <= block.count) {
+            size_t used = find_used(block, frame, frame + count);
+            if (used == frame + count) {
+                mark_used(block, frame, count);
+                *address = block.base + frame * frame_size;
+                return true;
+            }
+
+            // Skip to the next aligned candidate at or past the next
+            // free frame after the used one
+            frame = find_free(block, used + 1, block.count);
+            frame = ((base_frame + frame + mask) & ~mask) - base_frame;
+        }
+    }
+
+    return false;
+}
+
+void
+frame_allocator::free(uintptr_t address, size_t count)
+{
     kassert(address % frame_size == 0, "Trying to free a non page-aligned frame!");
 
     if (!count)
         return;
 
-    //debugcon::write("Freeing   %2d frames at %016lx - %016lx", count, address, address + count * frame_size);
+    if (count == 1) {
+        uint64_t rflags = cache_lock();
+        frame_cache *cache = current_cpu().frames;
+        if (cache) {
+            if (cache->count == frame_cache::capacity)
+                drain(*cache, frame_cache::batch);
+
+            cache->frames[cache->count++] = address;
+            cache_unlock(rflags);
+            return;
+        }
+        cache_unlock(rflags);
+    }
 
+    util::scoped_lock lock {m_lock};
+    free_frames(address, count);
+}
+
+frame_allocator::frame_block *
+frame_allocator::find_block(uintptr_t address, size_t &first, size_t &count)
+{
     for (long i = 0; i < m_count; ++i) {
         frame_block &block = m_blocks[i];
         uintptr_t end = block.base + block.count * frame_size;
@@ -99,25 +333,24 @@ frame_allocator::free(uintptr_t address, size_t count)
         if (address < block.base || address >= end)
             continue;
 
-        uint64_t frame = (address - block.base) >> 12;
-        unsigned o1 = (frame >> 12) & 0x3f;
-        unsigned o2 = (frame >> 6) & 0x3f;
-        unsigned o3 = frame & 0x3f;
-
-        while (count--) {
-            block.map1 |= (1ull << o1);
-            block.map2[o1] |= (1ull << o2);
-            block.bitmap[o2] |= (1ull << o3);
-            if (++o3 == 64) {
-                o3 = 0;
-                if (++o2 == 64) {
-                    o2 = 0;
-                    ++o1;
-                    kassert(o1 < 64, "Tried to free pages past the end of a block");
-                }
-            }
-        }
+        // Ranges past the end of the block are clipped to it
+        first = (address - block.base) / frame_size;
+        if (count > block.count - first)
+            count = block.count - first;
+        return &block;
     }
+    return nullptr;
+}
+
+void
+frame_allocator::free_frames(uintptr_t address, size_t count)
+{
+    //debugcon::write("Freeing   %2d frames at %016lx - %016lx", count, address, address + count * frame_size);
+
+    size_t first = 0;
+    frame_block *block = find_block(address, first, count);
+    if (block)
+        mark_free(*block, first, count);
 }
 
 void
@@ -130,37 +363,9 @@ frame_allocator::used(uintptr_t address, size_t count)
     if (!count)
         return;
 
-    for (long i = 0; i < m_count; ++i) {
-        frame_block &block = m_blocks[i];
-        uintptr_t end = block.base + block.count * frame_size;
-
-        if (address < block.base || address >= end)
-            continue;
-
-        uint64_t frame = (address - block.base) >> 12;
-        unsigned o1 = (frame >> 12) & 0x3f;
-        unsigned o2 = (frame >> 6) & 0x3f;
-        unsigned o3 = frame & 0x3f;
-
-        while (count--) {
-            block.bitmap[o2] &= ~(1ull << o3);
-            if (!block.bitmap[o2]) {
-                block.map2[o1] &= ~(1ull << o2);
-
-                if (!block.map2[o1]) {
-                    block.map1 &= ~(1ull << o1);
-                }
-            }
-
-            if (++o3 == 64) {
-                o3 = 0;
-                if (++o2 == 64) {
-                    o2 = 0;
-                    ++o1;
-                    kassert(o1 < 64, "Tried to mark pages past the end of a block");
-                }
-            }
-        }
-    }
+    size_t first = 0;
+    frame_block *block = find_block(address, first, count);
+    if (block)
+        mark_used(*block, first, count);
 }
 
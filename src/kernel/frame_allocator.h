@@ -10,6 +10,23 @@ namespace bootproto {
     struct frame_block;
 }
 
+struct cpu_data;
+
+/// A per-CPU cache of free frames. Single frames are allocated from and
+/// freed to the cache without taking the frame_allocator lock, and the
+/// cache is refilled from or drained to the frame blocks in batches.
+struct frame_cache
+{
+    /// Maximum number of frames held in the cache
+    static constexpr size_t capacity = 64;
+
+    /// Number of frames moved to or from the frame blocks at once
+    static constexpr size_t batch = capacity / 2;
+
+    size_t count;
+    uintptr_t frames[capacity];
+};
+
 /// Allocator for physical memory frames
 class frame_allocator
 {
@@ -29,20 +46,57 @@ public:
     /// \returns      The number of frames retrieved
     size_t allocate(size_t count, uintptr_t *address);
 
+    /// Get a run of contiguous free frames, starting at a physical
+    /// address with the given alignment. Runs never cross frame
+    /// blocks, so at most one block's worth of frames can be returned.
+    /// \arg count    The number of frames to get
+    /// \arg align    The alignment of the first frame, in frames. Must be
+    ///               a power of two.
+    /// \arg address  [out] The physical address of the first frame
+    /// \returns      True if the frames were allocated
+    bool allocate_contiguous(size_t count, size_t align, uintptr_t *address);
+
     /// Free previously allocated frames.
     /// \arg address  The physical address of the first frame to free
     /// \arg count    The number of frames to be freed
     void free(uintptr_t address, size_t count);
 
-    /// Mark frames as used
+    /// Mark frames as used. Frames held in a CPU's frame_cache are
+    /// already marked used, so this should only be called on frames
+    /// that were never allocated.
     /// \arg address  The physical address of the first frame to free
     /// \arg count    The number of frames to be freed
     void used(uintptr_t address, size_t count);
 
+    /// Create the frame cache for a CPU. Until this is called, single
+    /// frames on that CPU are allocated directly from the frame blocks.
+    /// \arg cpu  The CPU to create the cache for
+    void create_cache(cpu_data &cpu);
+
     /// Get the global frame allocator
     static frame_allocator & get();
 
 private:
+    /// Find and mark used frames from the frame blocks. Must be called
+    /// with m_lock held.
+    /// \returns  The number of frames retrieved, or 0 if none are free
+    size_t take_frames(size_t count, uintptr_t *address);
+
+    /// Mark frames as free in the frame blocks. Must be called with
+    /// m_lock held.
+    void free_frames(uintptr_t address, size_t count);
+
+    /// Find the block containing the start of a range of frames.
+    /// \arg address  The physical address of the first frame
+    /// \arg first    [out] The index of the first frame in the block
+    /// \arg count    [inout] The number of frames in the range, clipped
+    ///               to the end of the block
+    /// \returns      The block, or null if no block contains the address
+    frame_block * find_block(uintptr_t address, size_t &first, size_t &count);
+
+    void refill(frame_cache &cache);
+    void drain(frame_cache &cache, size_t count);
+
     frame_block *m_blocks;
     size_t m_count;
 
@@ -108,6 +108,10 @@ heap_allocator::free(void *p)
 
         size_t offset = reinterpret_cast<uintptr_t>(p) - mem::heap_offset;
         size_t pages = mem::bytes_to_pages(size);
+
+        // Locking pages shoots down TLB entries on other CPUs, which
+        // must not be done while holding the heap lock
+        lock.release();
         vm_space::kernel_space().lock(g_kernel_heap_area, offset, pages);
         return;
     }
@@ -11,6 +11,7 @@
 #include "memory.h"
 #include "objects/process.h"
 #include "scheduler.h"
+#include "tlb.h"
 #include "vm_space.h"
 
 static const uint16_t PIC1 = 0x20;
@@ -176,6 +177,7 @@ isr_handler(cpu_state *regs)
         return;
 
     case isr::isrTimer:
+        ++current_cpu().timer_interrupts;
         scheduler::get().schedule();
         break;
 
@@ -187,6 +189,10 @@ isr_handler(cpu_state *regs)
         scheduler::get().schedule();
         break;
 
+    case isr::ipiShootdown:
+        tlb_shootdown_service();
+        break;
+
     default:
         util::format({message, sizeof(message)}, "Unknown interrupt 0x%lx", regs->interrupt);
         kassert(false, message, regs);
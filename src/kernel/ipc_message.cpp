@@ -2,48 +2,55 @@
 #include <util/basic_types.h>
 
 #include "ipc_message.h"
+#include "memory.h"
+#include "vm_space.h"
 
 namespace ipc {
 
-message::message() : tag {0}, data {nullptr, 0}, handles {nullptr, 0} {}
+namespace {
+
+// Clamp a user buffer so that it ends below kernel space
+size_t
+user_length(const void *p, size_t len)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    if (addr >= mem::kernel_offset)
+        return 0;
+
+    size_t avail = mem::kernel_offset - addr;
+    return len > avail ? avail : len;
+}
+
+} // namespace
 
 message::message(
     uint64_t in_tag,
     const util::buffer &in_data,
+    size_t capacity,
     const util::counted<j6_handle_t> &in_handles) :
-        tag {in_tag}, data {nullptr, in_data.count}, handles {nullptr, in_handles.count}
+        tag {in_tag},
+        data {in_data.pointer, user_length(in_data.pointer, in_data.count)},
+        capacity {user_length(in_data.pointer, capacity)},
+        handle_count {in_handles.count}
 {
-    if (data.count) {
-        data.pointer = new uint8_t [data.count];
-        memcpy(data.pointer, in_data.pointer, data.count);
-    }
-
-    if (handles.count) {
-        handles.pointer = new j6_handle_t [handles.count];
-        memcpy(handles.pointer, in_handles.pointer, handles.count * sizeof(j6_handle_t));
-    }
-}
+    if (handle_count > max_handles)
+        handle_count = max_handles;
 
-message::message(message &&other) { *this = util::move(other); }
-
-message::~message()
-{
-    delete [] reinterpret_cast<uint8_t*>(data.pointer);
-    delete [] handles.pointer;
+    if (handle_count)
+        memcpy(handles, in_handles.pointer, handle_count * sizeof(j6_handle_t));
 }
 
-message &
-message::operator=(message &&other)
+void
+copy(const message &from, vm_space &source, message &to, vm_space &dest)
 {
-    tag = other.tag;
-    other.tag = 0;
+    to.tag = from.tag;
 
-    data = other.data;
-    other.data = {nullptr, 0};
+    size_t len = from.data.count > to.capacity ? to.capacity : from.data.count;
+    to.data.count = len ?
+        vm_space::copy(source, dest, from.data.pointer, to.data.pointer, len) : 0;
 
-    handles = other.handles;
-    other.handles = {nullptr, 0};
-    return *this;
+    to.handle_count = from.handle_count;
+    memcpy(to.handles, from.handles, from.handle_count * sizeof(j6_handle_t));
 }
 
-} // namespace ipc
\ No newline at end of file
+} // namespace ipc
@@ -6,20 +6,48 @@
 #include <j6/types.h>
 #include <util/counted.h>
 
+class vm_space;
+
 namespace ipc {
 
+/// A message as described by the thread sending or receiving it. The
+/// data is not copied into the kernel, but left in the thread's own
+/// address space until it is copied directly to its receiver.
 struct message
 {
-    uint64_t tag;
-    util::buffer data;
-    util::counted<j6_handle_t> handles;
+    /// Max message handle count
+    static constexpr size_t max_handles = 5;
+
+    uint64_t tag = 0;
+
+    /// The message data in the owning thread's address space, and the
+    /// number of bytes of it that are valid
+    util::buffer data = {nullptr, 0};
 
-    message();
-    message(uint64_t in_tag, const util::buffer &in_data, const util::counted<j6_handle_t> &in_handles);
-    message(message &&other);
-    ~message();
+    /// The size of the buffer at data.pointer, for receiving messages
+    size_t capacity = 0;
 
-    message & operator=(message &&other);
+    size_t handle_count = 0;
+    j6_handle_t handles[max_handles];
+
+    message() = default;
+
+    /// Constructor.
+    /// \arg in_tag      The message tag
+    /// \arg in_data     The message buffer, and the number of bytes of input in it
+    /// \arg capacity    The full size of the message buffer
+    /// \arg in_handles  Handles to send, at most max_handles of them
+    message(uint64_t in_tag, const util::buffer &in_data, size_t capacity,
+            const util::counted<j6_handle_t> &in_handles);
 };
 
-} // namespace ipc
\ No newline at end of file
+/// Copy a message from one thread's buffers into another's, moving the
+/// data directly from one address space to the other. The data and
+/// handle counts in `to` are set to the amounts copied.
+/// \arg from    The message to copy
+/// \arg source  The address space holding the data of `from`
+/// \arg to      The message to fill, whose capacity limits the data copied
+/// \arg dest    The address space holding the buffer of `to`
+void copy(const message &from, vm_space &source, message &to, vm_space &dest);
+
+} // namespace ipc
@@ -21,6 +21,7 @@
 #include "smp.h"
 #include "syscall.h"
 #include "sysconf.h"
+#include "zero_pool.h"
 
 extern "C" {
     void kernel_main(bootproto::args *args);
@@ -71,6 +72,8 @@ kernel_main(bootproto::args *args)
     scheduler *sched = new scheduler {g_num_cpus};
     smp::ready();
 
+    zero_pool::start();
+
     // Initialize the debug console logger (does nothing if not built
     // in debug mode)
     debugcon::init_logger();
@@ -110,5 +113,5 @@ load_init_server(bootproto::program &program, uintptr_t modules_address)
 
     obj::thread *main = p->create_thread();
     main->add_thunk_user(program.entrypoint, modules_address, 0, 0, iopl);
-    main->set_state(obj::thread::state::ready);
+    main->wake_only();
 }
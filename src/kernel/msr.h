@@ -27,6 +27,7 @@ enum class msr : uint32_t
     ia32_mtrrfix4k_f8000   = 0x0000026F,
 
     ia32_pat               = 0x00000277,
+    ia32_tsc_deadline      = 0x000006e0,
     ia32_efer              = 0xc0000080,
     ia32_star              = 0xc0000081,
     ia32_lstar             = 0xc0000082,
@@ -1,23 +1,48 @@
+#include <stddef.h>
+
 #include <util/basic_types.h>
 #include <util/counted.h>
 #include <j6/memutils.h>
 
 #include "logger.h"
 #include "objects/mailbox.h"
+#include "objects/process.h"
 #include "objects/thread.h"
+#include "objects/vm_area.h"
+#include "vm_space.h"
 
 namespace obj {
 
+static_assert(mailbox::max_pending <= 64,
+        "mailbox::m_free_slots is too small for max_pending");
+
 mailbox::mailbox() :
     kobject(kobject::type::mailbox),
-    m_closed {false},
-    m_next_reply_tag {0}
+    m_free_slots {~0ull >> (64 - max_pending)},
+    m_slots {},
+    m_ring_pending {0},
+    m_closed {false}
 {
+    static_assert(max_pending == 1 << slot_bits,
+            "mailbox::slot_bits does not match max_pending");
 }
 
 mailbox::~mailbox()
 {
     close();
+
+    // Processes keep their mailboxes alive while they have rings
+    // attached, so normally there are none left here
+    util::vector<process*> owners;
+    util::scoped_lock lock {m_ring_lock};
+    while (m_rings.count()) {
+        process *owner = detach_ring(m_rings[0]);
+        if (owner) owners.append(owner);
+    }
+    lock.release();
+
+    for (process *owner : owners)
+        owner->handle_release();
 }
 
 void
@@ -32,9 +57,70 @@ mailbox::close()
     m_callers.clear(j6_status_closed);
     m_responders.clear(j6_status_closed);
 
-    util::scoped_lock lock {m_reply_lock};
-    for (auto &waiting : m_reply_map)
-        waiting.thread->wake(j6_status_closed);
+    for (reply_slot &slot : m_slots) {
+        reply_tag_t tag = __atomic_load_n(&slot.tag, __ATOMIC_ACQUIRE);
+        if (!tag) continue;
+
+        thread *caller = discard_slot(tag);
+        if (caller)
+            caller->wake(j6_status_closed);
+    }
+
+    util::scoped_lock lock {m_ring_lock};
+    for (ring_client *ring : m_rings)
+        ring->waiters.clear(j6_status_closed);
+}
+
+unsigned
+mailbox::claim_slot()
+{
+    uint64_t free = __atomic_load_n(&m_free_slots, __ATOMIC_ACQUIRE);
+    while (free) {
+        unsigned index = __builtin_ctzll(free);
+        if (__atomic_compare_exchange_n(&m_free_slots, &free, free & ~(1ull << index),
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return index;
+    }
+    return max_pending;
+}
+
+void
+mailbox::release_slot(unsigned index)
+{
+    __atomic_or_fetch(&m_free_slots, 1ull << index, __ATOMIC_ACQ_REL);
+}
+
+bool
+mailbox::take_slot(reply_tag_t reply_tag, reply_slot &taken)
+{
+    reply_slot &slot = m_slots[reply_tag & slot_mask];
+    if (!reply_tag || __atomic_load_n(&slot.tag, __ATOMIC_ACQUIRE) != reply_tag)
+        return false;
+
+    // The contents must be read before the tag is cleared, since the
+    // slot may be reused as soon as it is released. They can't change
+    // before then, and if the tag has already been cleared, this
+    // compare-exchange fails.
+    taken = slot;
+    reply_tag_t expected = reply_tag;
+    if (!__atomic_compare_exchange_n(&slot.tag, &expected, 0,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+
+    release_slot(reply_tag & slot_mask);
+    return true;
+}
+
+thread *
+mailbox::discard_slot(reply_tag_t reply_tag)
+{
+    reply_slot taken;
+    if (!take_slot(reply_tag, taken))
+        return nullptr;
+
+    if (taken.ring)
+        release_ring_unlocked(taken.ring);
+    return taken.caller;
 }
 
 j6_status_t
@@ -48,79 +134,511 @@ mailbox::call()
 
     thread *responder = m_responders.pop_next();
     if (responder) {
-        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() waking thread[%2x]...",
+        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() switching to thread[%2x]...",
             current.obj_id(), obj_id(), responder->obj_id());
-        responder->wake(j6_status_ok);
-    } else {
-        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() found no responder yet.",
-            current.obj_id(), obj_id());
+        return current.handoff(*responder, j6_status_ok);
     }
 
+    log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() found no responder yet.",
+        current.obj_id(), obj_id());
     return current.block();
 }
 
 j6_status_t
-mailbox::receive(ipc::message &data, reply_tag_t &reply_tag, bool block)
+mailbox::receive(ipc::message &data, reply_tag_t &reply_tag, bool block, thread *replied)
 {
-    if (closed())
-        return j6_status_closed;
-
     thread &current = thread::current();
     thread *caller = nullptr;
+    unsigned index = max_pending;
+    j6_status_t status = j6_status_would_block;
 
-
+    // A reply slot is only claimed once there is a message to take, so
+    // responders waiting here don't hold slots while nothing is pending
     while (true) {
+        if (closed()) {
+            status = j6_status_closed;
+            break;
+        }
+
+        status = receive_ring(data, index);
+        if (status != j6_status_would_block)
+            break;
+
         caller = m_callers.pop_next();
-        if (caller)
+        if (caller) {
+            index = claim_slot();
+            if (index < max_pending) {
+                status = j6_status_ok;
+                break;
+            }
+
+            // Leave the caller for a responder once a reply frees a slot
+            m_callers.push_front(caller);
+            if (closed())
+                m_callers.clear(j6_status_closed);
+            caller = nullptr;
+            status = j6_err_insufficient;
             break;
+        }
 
         if (!block)
-            return j6_status_would_block;
+            break;
 
         log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] receive() blocking waiting for a caller",
             current.obj_id(), obj_id());
 
         m_responders.add_thread(&current);
-        j6_status_t s = current.block();
+
+        // Switch straight back to the caller just replied to, which is
+        // likely to call again
+        j6_status_t s = replied ?
+            current.handoff(*replied, j6_status_ok) :
+            current.block();
+        replied = nullptr;
+
         if (s != j6_status_ok)
             return s;
     }
 
+    if (replied)
+        replied->wake(j6_status_ok);
 
-    util::scoped_lock lock {m_reply_lock};
-    reply_tag = ++m_next_reply_tag;
-    m_reply_map.insert({ reply_tag, caller });
-    lock.release();
+    if (status != j6_status_ok)
+        return status;
+
+    reply_slot &slot = m_slots[index];
+    slot.generation += 1;
+    reply_tag = (slot.generation << slot_bits) | index;
+    if (caller) {
+        slot.caller = caller;
+        slot.ring = nullptr;
+    }
+    __atomic_store_n(&slot.tag, reply_tag, __ATOMIC_SEQ_CST);
+
+    // If the mailbox was closed before the tag was visible, close()
+    // may have missed this slot, so wake the caller here instead
+    if (closed()) {
+        thread *closed_caller = discard_slot(reply_tag);
+        if (closed_caller)
+            closed_caller->wake(j6_status_closed);
+        return j6_status_closed;
+    }
+
+    if (!caller) {
+        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] receive() took a ring submission, rt = %x",
+            current.obj_id(), obj_id(), reply_tag);
+        return j6_status_ok;
+    }
 
     log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] receive() found caller thread[%2x], rt = %x",
         current.obj_id(), obj_id(), caller->obj_id(), reply_tag);
 
-    data = caller->get_message_data();
+    ipc::copy(caller->message(), caller->parent().space(),
+        data, current.parent().space());
     return j6_status_ok;
 }
 
 j6_status_t
-mailbox::reply(reply_tag_t reply_tag, ipc::message &&data)
+mailbox::reply(reply_tag_t reply_tag, const ipc::message &data, thread **woken)
+{
+    reply_slot taken;
+    if (!take_slot(reply_tag, taken))
+        return closed() ? j6_status_closed : j6_err_invalid_arg;
+
+    thread *caller = taken.caller;
+    if (closed()) {
+        if (caller)
+            caller->wake(j6_status_closed);
+        if (taken.ring)
+            release_ring_unlocked(taken.ring);
+        return j6_status_closed;
+    }
+
+    if (taken.ring) {
+        complete(*taken.ring, taken.id, data);
+        return j6_status_ok;
+    }
+
+    thread &current = thread::current();
+    log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] reply() to caller thread[%2x], rt = %x",
+        current.obj_id(), obj_id(), caller->obj_id(), reply_tag);
+
+    ipc::copy(data, current.parent().space(),
+        caller->message(), caller->parent().space());
+
+    if (woken)
+        *woken = caller;
+    else
+        caller->wake(j6_status_ok);
+    return j6_status_ok;
+}
+
+j6_mailbox_ring_entry *
+mailbox::ring_client::submission(uint32_t index) const
+{
+    uintptr_t queue = address + sizeof(j6_mailbox_ring);
+    return reinterpret_cast<j6_mailbox_ring_entry*>(queue) + (index & (entries - 1));
+}
+
+j6_mailbox_ring_entry *
+mailbox::ring_client::completion(uint32_t index) const
+{
+    uintptr_t queue = address + sizeof(j6_mailbox_ring) + entries * sizeof(j6_mailbox_ring_entry);
+    return reinterpret_cast<j6_mailbox_ring_entry*>(queue) + (index & (entries - 1));
+}
+
+mailbox::ring_client *
+mailbox::find_ring(process &owner, uintptr_t address)
+{
+    for (ring_client *ring : m_rings)
+        if (ring->owner == &owner && ring->address == address)
+            return ring;
+    return nullptr;
+}
+
+process *
+mailbox::detach_ring(ring_client *ring)
+{
+    m_rings.remove_swap(ring);
+
+    // Nothing more is taken from the ring, and it never sees the
+    // completions for what was
+    uint32_t unreceived = ring->accepted - ring->received;
+    __atomic_sub_fetch(&m_ring_pending, unreceived, __ATOMIC_ACQ_REL);
+    ring->received = ring->accepted;
+    ring->detached = true;
+
+    ring->waiters.clear(j6_status_closed);
+    return release_ring(ring);
+}
+
+process *
+mailbox::release_ring(ring_client *ring)
+{
+    if (--ring->refs)
+        return nullptr;
+
+    process *owner = ring->owner;
+    delete ring;
+    return owner;
+}
+
+void
+mailbox::release_ring_unlocked(ring_client *ring)
+{
+    util::scoped_lock lock {m_ring_lock};
+    process *owner = release_ring(ring);
+    lock.release();
+
+    if (owner)
+        owner->handle_release();
+}
+
+j6_status_t
+mailbox::ring_attach(uintptr_t address, uint32_t entries)
 {
     if (closed())
         return j6_status_closed;
 
-    util::scoped_lock lock {m_reply_lock};
-    reply_to *rt = m_reply_map.find(reply_tag);
-    if (!rt)
+    if (!entries || (entries & (entries - 1)) || entries > max_ring_entries)
+        return j6_err_invalid_arg;
+
+    size_t size = sizeof(j6_mailbox_ring) + 2 * entries * sizeof(j6_mailbox_ring_entry);
+    if ((address & (alignof(j6_mailbox_ring_entry) - 1)) ||
+        address >= mem::kernel_offset ||
+        mem::kernel_offset - address < size)
         return j6_err_invalid_arg;
 
-    thread *caller = rt->thread;
-    m_reply_map.erase(reply_tag);
+    // The whole ring must be in one area, so that unmapping that area
+    // detaches it
+    process &owner = process::current();
+    uintptr_t base = 0;
+    vm_area *area = owner.space().get(address, &base);
+    if (!area || base + area->size() - address < size)
+        return j6_err_invalid_arg;
+
+    // The header is set up here in the client's own address space. It
+    // is never read from another, so every later access to it is in
+    // ring_enter(), too.
+    j6_mailbox_ring *header = reinterpret_cast<j6_mailbox_ring*>(address);
+    memset(header, 0, sizeof(j6_mailbox_ring));
+    header->entries = entries;
+
+    if (!owner.add_ring(this))
+        return j6_status_closed;
+
+    ring_client *ring = new ring_client;
+    ring->owner = &owner;
+    ring->area = area;
+    ring->address = address;
+    ring->entries = entries;
+
+    util::scoped_lock lock {m_ring_lock};
+    if (find_ring(owner, address)) {
+        lock.release();
+        delete ring;
+        owner.remove_rings(this);
+        return j6_status_exists;
+    }
+
+    owner.handle_retain();
+    m_rings.append(ring);
+
+    // If the process exited before the ring was listed, its exit may
+    // have already detached its rings from this mailbox
+    if (owner.exited()) {
+        process *last = detach_ring(ring);
+        lock.release();
+        if (last)
+            last->handle_release();
+        owner.remove_rings(this);
+        return j6_status_closed;
+    }
+
+    return j6_status_ok;
+}
+
+j6_status_t
+mailbox::ring_detach(uintptr_t address)
+{
+    process &owner = process::current();
+
+    util::scoped_lock lock {m_ring_lock};
+    ring_client *ring = find_ring(owner, address);
+    if (!ring)
+        return j6_err_invalid_arg;
+
+    process *last = detach_ring(ring);
     lock.release();
+    if (last)
+        last->handle_release();
+
+    owner.remove_rings(this);
+    return j6_status_ok;
+}
+
+size_t
+mailbox::detach_rings(process &owner, const vm_area *area)
+{
+    util::scoped_lock lock {m_ring_lock};
+
+    size_t count = 0;
+    size_t released = 0;
+    for (size_t i = 0; i < m_rings.count();) {
+        ring_client *ring = m_rings[i];
+        if (ring->owner != &owner || (area && ring->area != area)) {
+            ++i;
+            continue;
+        }
+
+        if (detach_ring(ring))
+            ++released;
+        ++count;
+    }
+    lock.release();
+
+    // The caller still holds the owner, so this never destroys it
+    while (released--)
+        owner.handle_release();
+    return count;
+}
+
+j6_status_t
+mailbox::ring_enter(uintptr_t address, size_t wait_count, size_t &submitted)
+{
+    submitted = 0;
+    if (closed())
+        return j6_status_closed;
 
     thread &current = thread::current();
-    log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] reply() to caller thread[%2x], rt = %x",
-        current.obj_id(), obj_id(), caller->obj_id(), reply_tag);
+    j6_mailbox_ring *header = reinterpret_cast<j6_mailbox_ring*>(address);
+
+    // The client's side of the header may fault, so it is only touched
+    // without the lock held
+    util::scoped_lock lock {m_ring_lock};
+    ring_client *ring = find_ring(current.parent(), address);
+    if (!ring)
+        return j6_err_invalid_arg;
+
+    // Keep the ring while the lock is dropped, even if it's detached
+    ++ring->refs;
+    lock.release();
+
+    const uint32_t sq_tail = __atomic_load_n(&header->sq_tail, __ATOMIC_ACQUIRE);
+    const uint32_t cq_head = __atomic_load_n(&header->cq_head, __ATOMIC_ACQUIRE);
+
+    lock.reacquire();
+    if (ring->detached) {
+        process *last = release_ring(ring);
+        lock.release();
+        if (last)
+            last->handle_release();
+        return j6_status_closed;
+    }
+
+    // Only accept as many submissions as there will be room for their
+    // completions before the client reads any more
+    uint32_t unread = ring->accepted - cq_head;
+    uint32_t room = unread < ring->entries ? ring->entries - unread : 0;
+    uint32_t fresh = sq_tail - ring->accepted;
+    if (fresh > room)
+        fresh = room;
 
-    caller->set_message_data(util::move(data));
-    caller->wake(j6_status_ok);
+    ring->accepted += fresh;
+    __atomic_add_fetch(&m_ring_pending, fresh, __ATOMIC_ACQ_REL);
+    submitted = fresh;
+
+    lock.release();
+
+    for (uint32_t i = 0; i < fresh; ++i) {
+        thread *responder = m_responders.pop_next();
+        if (!responder) break;
+        responder->wake(j6_status_ok);
+    }
+
+    lock.reacquire();
+
+    uint32_t outstanding = ring->accepted - cq_head;
+    if (wait_count > outstanding)
+        wait_count = outstanding;
+
+    j6_status_t status = j6_status_ok;
+    while (ring->cq_tail - cq_head < wait_count) {
+        if (closed() || ring->detached) {
+            status = j6_status_closed;
+            break;
+        }
+
+        ring->waiters.add_thread(&current);
+        current.block(lock);
+        lock.reacquire();
+    }
+
+    // A detached ring's memory may have been unmapped
+    const bool detached = ring->detached;
+    const uint32_t sq_head = ring->sq_head;
+    const uint32_t cq_tail = ring->cq_tail;
+    process *last = release_ring(ring);
+    lock.release();
+    if (last)
+        last->handle_release();
+
+    if (detached)
+        return j6_status_closed;
+
+    __atomic_store_n(&header->sq_head, sq_head, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->cq_tail, cq_tail, __ATOMIC_RELEASE);
+    return status;
+}
+
+j6_status_t
+mailbox::receive_ring(ipc::message &data, unsigned &slot_index)
+{
+    if (!__atomic_load_n(&m_ring_pending, __ATOMIC_ACQUIRE))
+        return j6_status_would_block;
+
+    ring_client *ring = nullptr;
+    uint32_t index = 0;
+    {
+        util::scoped_lock lock {m_ring_lock};
+        for (ring_client *r : m_rings) {
+            if (r->accepted != r->received) {
+                ring = r;
+                break;
+            }
+        }
+
+        if (!ring)
+            return j6_status_would_block;
+
+        // Without a slot, the submission stays pending for later
+        slot_index = claim_slot();
+        if (slot_index == max_pending)
+            return j6_err_insufficient;
+
+        ++ring->refs;
+        index = ring->received++;
+        ++ring->copying;
+        __atomic_sub_fetch(&m_ring_pending, 1, __ATOMIC_ACQ_REL);
+    }
+
+    // Read the entry's header into the kernel, but copy its data
+    // directly from the client to the receiver
+    j6_mailbox_ring_entry *entry = ring->submission(index);
+    vm_space &source = ring->owner->space();
+
+    j6_mailbox_ring_entry header {};
+    constexpr size_t header_size = offsetof(j6_mailbox_ring_entry, data);
+    if (vm_space::copy(source, vm_space::kernel_space(), entry, &header, header_size) != header_size)
+        header = {};
+
+    size_t length = header.data_len;
+    if (length > j6_mailbox_ring_data_size)
+        length = j6_mailbox_ring_data_size;
+
+    util::buffer buffer {entry->data, length};
+    util::counted<j6_handle_t> no_handles {nullptr, 0};
+    ipc::message message {header.tag, buffer, 0, no_handles};
+    ipc::copy(message, source, data, thread::current().parent().space());
+
+    reply_slot &slot = m_slots[slot_index];
+    slot.caller = nullptr;
+    slot.ring = ring;
+    slot.id = header.id;
+
+    // Entries may be reused once every one before them is copied, which
+    // is only known for sure when no copies are in progress
+    util::scoped_lock lock {m_ring_lock};
+    if (--ring->copying == 0)
+        ring->sq_head = ring->received;
     return j6_status_ok;
 }
 
+void
+mailbox::complete(ring_client &ring, uint64_t id, const ipc::message &reply)
+{
+    uint32_t index = 0;
+    {
+        util::scoped_lock lock {m_ring_lock};
+        if (ring.detached) {
+            lock.release();
+            release_ring_unlocked(&ring);
+            return;
+        }
+
+        index = ring.posted++;
+        ++ring.posting;
+    }
+
+    j6_mailbox_ring_entry *entry = ring.completion(index);
+    vm_space &dest = ring.owner->space();
+
+    ipc::message to;
+    to.data = {entry->data, 0};
+    to.capacity = j6_mailbox_ring_data_size;
+    ipc::copy(reply, thread::current().parent().space(), to, dest);
+
+    j6_mailbox_ring_entry header {};
+    header.id = id;
+    header.tag = reply.tag;
+    header.status = j6_status_ok;
+    header.data_len = to.data.count;
+
+    constexpr size_t header_size = offsetof(j6_mailbox_ring_entry, data);
+    vm_space::copy(vm_space::kernel_space(), dest, &header, entry, header_size);
+
+    // As with submissions, completions are only published once no
+    // copies into the queue are in progress
+    util::scoped_lock lock {m_ring_lock};
+    if (--ring.posting == 0 && !ring.detached) {
+        ring.cq_tail = ring.posted;
+        ring.waiters.clear(j6_status_ok);
+    }
+    process *owner = release_ring(&ring);
+    lock.release();
+
+    if (owner)
+        owner->handle_release();
+}
+
 } // namespace obj
@@ -3,11 +3,11 @@
 /// Definition of mailbox kobject types
 
 #include <j6/cap_flags.h>
+#include <j6/types.h>
 #include <util/counted.h>
-#include <util/node_map.h>
 #include <util/spinlock.h>
+#include <util/vector.h>
 
-#include "heap_allocator.h"
 #include "ipc_message.h"
 #include "memory.h"
 #include "objects/kobject.h"
@@ -15,9 +15,12 @@
 
 namespace obj {
 
+class process;
 class thread;
+class vm_area;
 
-/// mailboxs are objects that enable synchronous message-passing IPC
+/// mailboxs are objects that enable synchronous message-passing IPC, and
+/// asynchronous sends through rings attached by their clients
 class mailbox :
     public kobject
 {
@@ -30,7 +33,13 @@ public:
     static constexpr kobject::type type = kobject::type::mailbox;
 
     /// Max message handle count
-    constexpr static size_t max_handle_count = 5;
+    constexpr static size_t max_handle_count = ipc::message::max_handles;
+
+    /// Max number of received messages awaiting a reply at once
+    constexpr static size_t max_pending = 64;
+
+    /// Max number of entries in each queue of an attached ring
+    constexpr static size_t max_ring_entries = 1024;
 
     mailbox();
     virtual ~mailbox();
@@ -42,42 +51,182 @@ public:
     inline bool closed() const { return __atomic_load_n(&m_closed, __ATOMIC_ACQUIRE); }
 
     /// Send a message to a thread waiting to receive on this mailbox, and block the
-    /// current thread awaiting a response. The message contents should be in the calling
-    /// thread's message data.
+    /// current thread awaiting a response. A waiting receiver is switched to directly. The message is described by the calling
+    /// thread's message, and its data stays in the caller's address space until a
+    /// receiver copies it out. Any reply is copied directly back into that message.
     /// \returns      j6_status_ok if a reply was received
     j6_status_t call();
 
     /// Receive the next available message, optionally blocking if no messages are available.
-    /// \arg data         [out] an ipc::message structure to fill
+    /// The message data is copied directly from the caller's address space.
+    /// \arg data         [inout] the message to fill, with its buffer in the current
+    ///                   thread's address space
     /// \arg reply_tag    [out] the reply_tag to use when replying to this message
     /// \arg block        True if this call should block when no messages are available.
-    /// \returns          j6_status_ok if a message was received
-    j6_status_t receive(ipc::message &data, reply_tag_t &reply_tag, bool block);
-
-    /// Find a given pending message to be responded to. Returns a replyer object, which will
-    /// wake the calling read upon destruction.
+    /// \arg replied      A caller that was sent a reply by reply() but not yet woken.
+    ///                   If this call blocks, it switches directly to that caller,
+    ///                   otherwise the caller is woken normally.
+    /// \returns          j6_status_ok if a message was received, or
+    ///                   j6_err_insufficient if one was waiting but
+    ///                   max_pending messages are already awaiting replies
+    j6_status_t receive(ipc::message &data, reply_tag_t &reply_tag, bool block,
+            thread *replied = nullptr);
+
+    /// Reply to a pending message, copying the reply directly into the caller's
+    /// address space and waking the caller.
     /// \arg reply_tag  The reply tag in the original message
-    /// \arg data       Message data to pass on to the caller
+    /// \arg data       The reply message, with its data in the current thread's
+    ///                 address space
+    /// \arg woken      [out] If not null, the caller is not woken, but returned here
+    ///                 to be passed to receive()
     /// \returns        j6_status_ok if the reply was successfully sent
-    j6_status_t reply(reply_tag_t reply_tag, ipc::message &&data);
+    j6_status_t reply(reply_tag_t reply_tag, const ipc::message &data,
+            thread **woken = nullptr);
+
+    /// Attach a submission and completion ring in the current process's
+    /// address space, for sending messages without blocking.
+    /// \arg address  The address of the ring's j6_mailbox_ring header
+    /// \arg entries  The number of entries in each queue, a power of two
+    /// \returns      j6_status_ok if the ring was attached
+    j6_status_t ring_attach(uintptr_t address, uint32_t entries);
+
+    /// Accept new submissions on a ring attached by the current process,
+    /// wait for completions, and update the ring's sq_head and cq_tail.
+    /// \arg address     The address the ring was attached at
+    /// \arg wait_count  Block until at least this many completions are unread,
+    ///                  or as many as are outstanding if that is fewer
+    /// \arg submitted   [out] The number of new submissions accepted
+    /// \returns         j6_status_ok if the ring was updated
+    j6_status_t ring_enter(uintptr_t address, size_t wait_count, size_t &submitted);
+
+    /// Detach a ring attached by the current process. Submissions not yet
+    /// received are dropped, and later replies to received ones are
+    /// discarded.
+    /// \arg address  The address the ring was attached at
+    /// \returns      j6_status_ok if the ring was detached
+    j6_status_t ring_detach(uintptr_t address);
+
+    /// Detach the rings attached by a process. Used when the process
+    /// exits or unmaps the memory they are in.
+    /// \arg owner  The process that attached the rings
+    /// \arg area   Only detach rings in this area of the process's
+    ///             address space, or all of its rings if null
+    /// \returns    The number of rings detached
+    size_t detach_rings(process &owner, const vm_area *area = nullptr);
 
 private:
+    /// Kernel state of an attached ring. The counters are only changed
+    /// under m_ring_lock, and run freely, to be masked into indices.
+    struct ring_client
+    {
+        process *owner = nullptr;
+        const vm_area *area = nullptr;
+        uintptr_t address = 0;
+        uint32_t entries = 0;
+
+        /// The attachment, plus each received submission still holding
+        /// a reply slot. The ring is deleted when the last one goes.
+        uint32_t refs = 1;
+        bool detached = false;
+
+        uint32_t accepted = 0;  ///< Submissions taken from the client
+        uint32_t received = 0;  ///< Submissions taken by responders
+        uint32_t copying = 0;   ///< Submissions still being copied to responders
+        uint32_t sq_head = 0;   ///< Submissions whose entries may be reused
+
+        uint32_t posted = 0;    ///< Completions started by responders
+        uint32_t posting = 0;   ///< Completions still being copied to the client
+        uint32_t cq_tail = 0;   ///< Completions the client may read
+
+        wait_queue waiters;
+
+        j6_mailbox_ring_entry * submission(uint32_t index) const;
+        j6_mailbox_ring_entry * completion(uint32_t index) const;
+    };
+
+    /// A caller waiting for a reply, or a ring submission awaiting its
+    /// completion. The slot is free while its bit is set in m_free_slots.
+    /// The responder that claimed it fills it in, then publishes the tag;
+    /// whoever clears the tag owns the slot's contents.
+    struct reply_slot
+    {
+        reply_tag_t tag;
+        uint64_t generation;
+        thread *caller;
+        ring_client *ring;
+        uint64_t id;
+    };
+
+    /// Claim a free reply slot.
+    /// \returns  The index of the claimed slot, or max_pending if none are free
+    unsigned claim_slot();
+
+    /// Return a reply slot to the free set.
+    /// \arg index  The index of the slot
+    void release_slot(unsigned index);
+
+    /// Take the contents of a reply slot, if the slot still holds the
+    /// given reply tag. Only one taker can succeed for each tag.
+    /// \arg reply_tag  The reply tag naming the slot
+    /// \arg taken      [out] The slot's caller or ring submission
+    /// \returns        False if the tag is stale
+    bool take_slot(reply_tag_t reply_tag, reply_slot &taken);
+
+    /// Find a ring attached by the given process. m_ring_lock must be held.
+    ring_client * find_ring(process &owner, uintptr_t address);
+
+    /// Stop using a ring, and drop its unreceived submissions.
+    /// m_ring_lock must be held.
+    /// \returns  The ring's owner, if it must be released, as for release_ring()
+    process * detach_ring(ring_client *ring);
+
+    /// Drop a reference to a ring, deleting it if that was the last.
+    /// m_ring_lock must be held.
+    /// \returns  The ring's owner if the ring was deleted, or null. The
+    ///           caller must release the owner's handle once m_ring_lock
+    ///           is released, since that may destroy the process.
+    static process * release_ring(ring_client *ring);
+
+    /// Drop a reference to a ring, as release_ring(), taking m_ring_lock
+    /// itself and releasing the owner after it is dropped.
+    void release_ring_unlocked(ring_client *ring);
+
+    /// Take a reply slot's contents, and let go of any ring it refers to.
+    /// \returns  The caller waiting in the slot, if any
+    thread * discard_slot(reply_tag_t reply_tag);
+
+    /// Take the next pending ring submission, if any, and copy it
+    /// directly from the client's ring to the current thread.
+    /// \arg data        [inout] the message to fill, as for receive()
+    /// \arg slot_index  [out] the reply slot claimed for the submission
+    /// \returns         j6_status_ok if a submission was received,
+    ///                  j6_status_would_block if none are pending, or
+    ///                  j6_err_insufficient if no reply slot is free
+    j6_status_t receive_ring(ipc::message &data, unsigned &slot_index);
+
+    /// Post a reply to a ring submission to the client's completion
+    /// queue, copying it directly from the current thread.
+    /// \arg ring   The ring the submission came from
+    /// \arg id     The submission's id
+    /// \arg reply  The reply, with its data in the current thread's address space
+    void complete(ring_client &ring, uint64_t id, const ipc::message &reply);
+
+    /// Reply tags hold a slot index in their low bits, and the slot's
+    /// generation above that, so stale tags never match a reused slot.
+    static constexpr unsigned slot_bits = 6;
+    static constexpr reply_tag_t slot_mask = (1ull << slot_bits) - 1;
+
     wait_queue m_callers;
     wait_queue m_responders;
 
-    struct reply_to { reply_tag_t reply_tag; thread *thread; };
-    using reply_map =
-        util::node_map<uint64_t, reply_to, 0, heap_allocated>;
+    uint64_t m_free_slots;
+    reply_slot m_slots[max_pending];
 
-    util::spinlock m_reply_lock;
-    reply_map m_reply_map;
+    util::spinlock m_ring_lock;
+    util::vector<ring_client*> m_rings;
+    uint32_t m_ring_pending;
 
     bool m_closed;
-    reply_tag_t m_next_reply_tag;
-
-    friend reply_tag_t & get_map_key(reply_to &rt);
 };
 
-inline mailbox::reply_tag_t & get_map_key(mailbox::reply_to &rt) { return rt.reply_tag; }
-
 } // namespace obj
@@ -3,6 +3,7 @@
 #include "kassert.h"
 #include "capabilities.h"
 #include "cpu.h"
+#include "objects/mailbox.h"
 #include "objects/process.h"
 #include "objects/thread.h"
 #include "objects/vm_area.h"
@@ -51,9 +52,11 @@ process::exit(int32_t code)
     if (m_state == state::exited)
         return;
 
-    m_state = state::exited;
+    __atomic_store_n(&m_state, state::exited, __ATOMIC_RELEASE);
     m_return_code = code;
 
+    detach_rings();
+
     thread &current = thread::current();
 
     util::scoped_lock lock {m_threads_lock};
@@ -115,6 +118,65 @@ process::thread_exited(thread *th)
     th->handle_release();
 }
 
+bool
+process::add_ring(mailbox *mb)
+{
+    util::scoped_lock lock {m_rings_lock};
+    if (exited())
+        return false;
+
+    for (auto &rm : m_ring_mailboxes) {
+        if (rm.mb == mb) {
+            ++rm.rings;
+            return true;
+        }
+    }
+
+    mb->handle_retain();
+    m_ring_mailboxes.append({mb, 1});
+    return true;
+}
+
+void
+process::remove_rings(mailbox *mb, size_t count)
+{
+    util::scoped_lock lock {m_rings_lock};
+    for (size_t i = 0; i < m_ring_mailboxes.count(); ++i) {
+        ring_mailbox &rm = m_ring_mailboxes[i];
+        if (rm.mb != mb)
+            continue;
+
+        rm.rings = count < rm.rings ? rm.rings - count : 0;
+        if (!rm.rings) {
+            m_ring_mailboxes.remove_swap_at(i);
+            lock.release();
+            mb->handle_release();
+        }
+        return;
+    }
+}
+
+void
+process::detach_rings(const vm_area *area)
+{
+    // Mailboxes never call back into the process with their own lock
+    // held, so theirs can be taken under this one
+    util::scoped_lock lock {m_rings_lock};
+    for (size_t i = 0; i < m_ring_mailboxes.count();) {
+        ring_mailbox &rm = m_ring_mailboxes[i];
+        size_t count = rm.mb->detach_rings(*this, area);
+        rm.rings = count < rm.rings ? rm.rings - count : 0;
+        if (area && rm.rings) {
+            ++i;
+            continue;
+        }
+
+        // When exiting, every mailbox is let go
+        rm.mb->handle_release();
+        m_ring_mailboxes.remove_swap_at(i);
+    }
+}
+
 void
 process::add_handle(j6_handle_t handle)
 {
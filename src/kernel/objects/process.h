@@ -13,6 +13,9 @@
 
 namespace obj {
 
+class mailbox;
+class vm_area;
+
 class process :
     public kobject
 {
@@ -73,6 +76,25 @@ public:
     /// \returns      Total number of handles (may be more than number copied)
     size_t list_handles(j6_handle_descriptor *handles, size_t len);
 
+    /// Record that a ring was attached to a mailbox in this process's
+    /// address space, so it can be detached when the process exits or
+    /// unmaps it. The mailbox is kept alive while it has rings here.
+    /// \arg mb  The mailbox the ring was attached to
+    /// \returns False if the process has already exited
+    bool add_ring(mailbox *mb);
+
+    /// Record that a ring attached to a mailbox was detached
+    /// \arg mb     The mailbox the ring was attached to
+    /// \arg count  The number of rings detached
+    void remove_rings(mailbox *mb, size_t count = 1);
+
+    /// Detach this process's rings from every mailbox they are attached to
+    /// \arg area  Only detach rings in this area, or all rings if null
+    void detach_rings(const vm_area *area = nullptr);
+
+    /// Check if this process has exited
+    inline bool exited() const { return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE) == state::exited; }
+
     /// Inform the process of an exited thread
     /// \args th  The thread which has exited
     void thread_exited(thread *th);
@@ -105,6 +127,14 @@ private:
     util::node_set<j6_handle_t, j6_handle_invalid, heap_allocated> m_handles;
     util::spinlock m_handles_lock;
 
+    struct ring_mailbox
+    {
+        mailbox *mb;
+        size_t rings;
+    };
+    util::vector<ring_mailbox> m_ring_mailboxes;
+    util::spinlock m_rings_lock;
+
     enum class state : uint8_t { running, exited };
     state m_state;
 };
@@ -29,6 +29,9 @@ thread::thread(process &parent, uint8_t pri, uintptr_t rsp0) :
     parent.space().initialize_tcb(m_tcb);
     m_tcb.priority = pri;
     m_tcb.thread = this;
+    m_tcb.wake_next = nullptr;
+    m_tcb.wake_pprev = nullptr;
+    m_tcb.wake_deadline = 0;
 
     if (!rsp0)
         setup_kernel_stack();
@@ -79,6 +82,20 @@ thread::block(util::scoped_lock &lock)
     return m_wake_value;
 }
 
+uint64_t
+thread::handoff(thread &partner, uint64_t value)
+{
+    kassert(current_cpu().thread == this,
+            "handoff() called on non-current thread");
+
+    if (!partner.has_state(state::ready))
+        partner.m_wake_value = value;
+
+    clear_state(state::ready);
+    scheduler::get().handoff(partner.tcb());
+    return m_wake_value;
+}
+
 j6_status_t
 thread::join()
 {
@@ -108,20 +125,28 @@ void
 thread::wake_only()
 {
     m_wake_timeout = 0;
-    set_state(state::ready);
+    scheduler::get().ready_thread(tcb());
 }
 
-void thread::set_message_data(ipc::message &&md) { m_message = util::move(md); }
-ipc::message && thread::get_message_data() { return util::move(m_message); }
-
 void
 thread::exit()
 {
-    m_wake_timeout = 0;
-    set_state(state::exited);
-    m_parent.thread_exited(this);
-    m_join_queue.clear();
-    block();
+    const bool current = current_cpu().thread == this;
+
+    // A thread may be killed more than once, or killed and then
+    // try to exit itself, but only clean up once
+    if (!has_state(state::exited)) {
+        m_wake_timeout = 0;
+        set_state(state::exited);
+        m_parent.thread_exited(this);
+        m_join_queue.clear();
+
+        if (!current)
+            scheduler::get().exit_thread(tcb());
+    }
+
+    if (current)
+        block();
 }
 
 void
@@ -41,6 +41,11 @@ struct TCB
 
     uintptr_t kernel_stack;
     cpu_data *cpu;
+
+    // Links for the run queue's timer_wheel
+    TCB *wake_next;
+    TCB **wake_pprev;
+    uint64_t wake_deadline;
 };
 
 using tcb_list = util::linked_list<TCB>;
@@ -105,12 +110,21 @@ public:
     /// Block the calling thread until this thread exits
     j6_status_t join();
 
+    /// Block this thread, and switch directly to a blocked partner thread,
+    /// waking it with a value. If the partner can't be switched to
+    /// directly, it is woken normally. This must be called on the
+    /// current thread.
+    /// \arg partner  The thread to run next
+    /// \arg value    The value that the partner's block() should return
+    /// \returns      The value passed to wake()
+    uint64_t handoff(thread &partner, uint64_t value = 0);
+
     /// Wake this thread, giving it a value
     /// \arg value  The value that block() should return
     void wake(uint64_t value = 0);
 
-    /// Set this thread as awake, but do not call the scheduler
-    /// or set the wake value.
+    /// Set this thread as awake and move it to its run queue's
+    /// ready list, but do not preempt or set the wake value.
     void wake_only();
 
     /// Set a timeout to unblock this thread
@@ -121,8 +135,9 @@ public:
     /// \returns  The clock time at which to wake. 0 for no timeout.
     inline uint64_t wake_timeout() const { return m_wake_timeout; }
 
-    void set_message_data(ipc::message &&md);
-    ipc::message && get_message_data();
+    /// Get the message this thread is sending or waiting to receive
+    /// through a mailbox
+    inline ipc::message & message() { return m_message; }
 
     inline bool has_state(state s) const {
         return __atomic_load_n(reinterpret_cast<const uint8_t*>(&m_state), __ATOMIC_ACQUIRE) &
@@ -3,7 +3,10 @@
 #include "frame_allocator.h"
 #include "memory.h"
 #include "objects/vm_area.h"
+#include "page_table.h"
+#include "tlb.h"
 #include "vm_space.h"
+#include "zero_pool.h"
 
 namespace obj {
 
@@ -12,6 +15,8 @@ using mem::frame_size;
 vm_area::vm_area(size_t size, util::bitset32 flags) :
     m_size {size},
     m_flags {flags},
+    m_fault_window {0},
+    m_share_gen {0},
     m_spaces {m_vector_static, 0, static_size},
     kobject {kobject::type::vma}
 {
@@ -48,11 +53,103 @@ vm_area::on_no_handles()
 size_t
 vm_area::resize(size_t size)
 {
-    if (can_resize(size))
-        m_size = size;
+    if (!can_resize(size))
+        return m_size;
+
+    // Unmap any pages past the new end, which shoots down their
+    // TLB entries on any other CPUs using those spaces
+    size_t old_pages = (m_size + frame_size - 1) / frame_size;
+    size_t new_pages = (size + frame_size - 1) / frame_size;
+    if (new_pages < old_pages) {
+        for (auto *space : m_spaces)
+            space->clear(*this, new_pages * frame_size, old_pages - new_pages);
+    }
+
+    m_size = size;
     return m_size;
 }
 
+size_t
+vm_area::get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc)
+{
+    return get_page(offset & ~(frame_size - 1), phys, alloc) ? frame_size : 0;
+}
+
+size_t
+vm_area::page_size() const
+{
+    if (m_flags.get(vm_flags::huge_pages))
+        return page_table::entry_sizes[unsigned(page_table::level::pdp)];
+    if (m_flags.get(vm_flags::large_pages))
+        return page_table::entry_sizes[unsigned(page_table::level::pd)];
+    return frame_size;
+}
+
+size_t
+vm_area::get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        phys[i] = 0;
+        if (get_page(offset + i * frame_size, phys[i]) && phys[i])
+            ++found;
+        else
+            phys[i] = 0;
+    }
+    return found;
+}
+
+vm_area *
+vm_area::clone(uintptr_t offset, size_t size, util::bitset32 flags)
+{
+    return nullptr;
+}
+
+bool
+vm_area::copy_on_write(uintptr_t offset, uintptr_t &phys)
+{
+    if (!m_flags.get(vm_flags::write) || !unshare_page(offset, phys))
+        return false;
+
+    // Every space mapping this area may still have the shared page
+    // mapped read-only, and would keep reading it after this write
+    for (auto *space : m_spaces)
+        space->clear(*this, offset, 1);
+
+    return true;
+}
+
+bool
+vm_area::unshare_page(uintptr_t offset, uintptr_t &phys)
+{
+    return false;
+}
+
+void
+vm_area::advise(util::bitset32 hints, size_t window)
+{
+    m_flags = (m_flags.value() & ~vm_hint_mask.value()) | (hints.value() & vm_hint_mask.value());
+    m_fault_window = window > max_fault_window ? max_fault_window : window;
+}
+
+void
+vm_area::protect(util::bitset32 flags)
+{
+    m_flags = (m_flags.value() & ~vm_protect_mask.value()) | (flags.value() & vm_protect_mask.value());
+    for (auto *space : m_spaces)
+        space->protect(*this);
+}
+
+size_t
+vm_area::fault_window() const
+{
+    if (m_flags.get(vm_flags::random))
+        return 1;
+    if (m_fault_window)
+        return m_fault_window;
+    return m_flags.get(vm_flags::sequential) ? fault_ahead_pages : fault_around_pages;
+}
+
 bool
 vm_area::can_resize(size_t size)
 {
@@ -129,23 +226,177 @@ vm_area_untracked::add_to(vm_space *space)
 
 vm_area_open::vm_area_open(size_t size, util::bitset32 flags) :
     m_mapped {nullptr},
+    m_cloning {0},
     vm_area {size, flags}
 {
 }
 
 vm_area_open::~vm_area_open()
 {
-    // the page_tree will free its pages when deleted
+    // Every space has unmapped this area by now, so its pages can go
+    // back to be zeroed for reuse
+    page_tree::release(m_mapped, 0);
     delete m_mapped;
 }
 
+size_t
+vm_area_open::resize(size_t size)
+{
+    size_t old_size = m_size;
+    size_t new_size = vm_area::resize(size);
+
+    // Pages past the new end were unmapped from every space by the
+    // base resize, so free them
+    if (new_size < old_size) {
+        util::scoped_lock lock {m_lock};
+        size_t end = (new_size + frame_size - 1) & ~(frame_size - 1);
+        page_tree::release(m_mapped, end);
+    }
+
+    return new_size;
+}
+
 bool
 vm_area_open::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
 {
+    size_t size = vm_area_open::get_large_page(offset, phys, alloc);
+    if (!size)
+        return false;
+
+    phys += (offset & (size - 1)) & ~(frame_size - 1);
+    return true;
+}
+
+size_t
+vm_area_open::get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc)
+{
+    // Large pages may not run past the end of the area, so use the
+    // next smaller size near the end
+    size_t size = page_size();
+    while (size > frame_size && (offset & ~(size - 1)) + size > m_size)
+        size >>= arch::table_bits;
+
+    util::scoped_lock lock {m_lock};
+
+    if (size > frame_size)
+        return page_tree::find_or_add_large(m_mapped, offset, size, phys, alloc);
+
     if (alloc)
-        return page_tree::find_or_add(m_mapped, offset, phys);
-    else
-        return page_tree::find(m_mapped, offset, &phys);
+        return page_tree::find_or_add(m_mapped, offset, phys) ? frame_size : 0;
+
+    uint64_t ent = 0;
+    if (!page_tree::find(m_mapped, offset, &ent) || !(ent & 1))
+        return 0;
+
+    phys = ent & ~0xfffull;
+    return frame_size;
+}
+
+size_t
+vm_area_open::get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero)
+{
+    if (page_size() > frame_size)
+        return vm_area::get_pages(offset, count, phys);
+
+    uintptr_t zero_page = zero ? zero_pool::zero_page() : 0;
+    util::scoped_lock lock {m_lock};
+
+    size_t found = 0;
+    size_t i = 0;
+    while (i < count) {
+        uint64_t ent = 0;
+        if (page_tree::find(m_mapped, offset + i * frame_size, &ent) && (ent & 1)) {
+            phys[i++] = (ent & ~0xfffull) |
+                ((ent & page_tree::shared_tag) ? page_shared : 0);
+            ++found;
+            continue;
+        }
+
+        // Allocate frames for the whole run of missing pages at once
+        size_t missing = 1;
+        while (i + missing < count &&
+                !(page_tree::find(m_mapped, offset + (i + missing) * frame_size, &ent) && (ent & 1)))
+            ++missing;
+
+        // Pages that are only being read can all share the zero page
+        // until they are written
+        if (zero_page) {
+            for (size_t j = 0; j < missing; ++j) {
+                phys[i + j] = zero_page | page_shared;
+                page_tree::add_existing(m_mapped, offset + (i + j) * frame_size, zero_page, true);
+            }
+
+            found += missing;
+            i += missing;
+            continue;
+        }
+
+        size_t n = zero_pool::allocate(missing, phys + i);
+        if (!n) {
+            while (i < count) phys[i++] = 0;
+            break;
+        }
+
+        for (size_t j = 0; j < n; ++j)
+            page_tree::add_existing(m_mapped, offset + (i + j) * frame_size, phys[i + j]);
+
+        found += n;
+        i += n;
+    }
+
+    return found;
+}
+
+vm_area *
+vm_area_open::clone(uintptr_t offset, size_t size, util::bitset32 flags)
+{
+    // Large pages would need to be copied whole on their first write
+    if (page_size() > frame_size || (offset & (frame_size - 1)) ||
+            flags.get(vm_flags::large_pages) || flags.get(vm_flags::huge_pages))
+        return nullptr;
+
+    vm_area_open *child = new vm_area_open {size, flags};
+
+    util::scoped_lock lock {m_lock};
+    size_t shared = page_tree::share(m_mapped, child->m_mapped, offset, size);
+    if (!shared)
+        return child;
+
+    // Faults that looked up pages before they were shared will see the
+    // new generation, and map them read-only
+    __atomic_add_fetch(&m_share_gen, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&m_cloning, 1, __ATOMIC_ACQ_REL);
+    lock.release();
+
+    // This area's existing mappings of the shared pages are writable, so
+    // unmap them to be faulted back in read-only
+    size_t end = offset + size < m_size ? offset + size : m_size;
+    size_t pages = mem::page_count(end - offset);
+    for (auto *space : m_spaces)
+        space->clear(*this, offset, pages);
+
+    __atomic_sub_fetch(&m_cloning, 1, __ATOMIC_ACQ_REL);
+    return child;
+}
+
+bool
+vm_area_open::unshare_page(uintptr_t offset, uintptr_t &phys)
+{
+    // Until a clone has cleared this area's writable mappings, other
+    // CPUs may still write to a shared page through stale TLB entries,
+    // and a copy made now would lose those writes. Wait for the clone,
+    // answering shootdowns while spinning, as tlb_batch::flush() does.
+    while (true) {
+        util::scoped_lock lock {m_lock};
+        if (!__atomic_load_n(&m_cloning, __ATOMIC_ACQUIRE))
+            return page_tree::unshare(m_mapped, offset, phys);
+
+        lock.release();
+        while (__atomic_load_n(&m_cloning, __ATOMIC_ACQUIRE)) {
+            tlb_shootdown_service();
+            asm volatile ( "pause" );
+        }
+    }
 }
 
 void
@@ -191,6 +442,27 @@ vm_area_guarded::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
     return vm_area_open::get_page(offset, phys, alloc);
 }
 
+size_t
+vm_area_guarded::get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc)
+{
+    // Guard pages must stay unmapped, so never use large pages
+    return vm_area::get_large_page(offset, phys, alloc);
+}
+
+size_t
+vm_area_guarded::get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero)
+{
+    // Every page must go through get_page, so guard pages stay unmapped
+    return vm_area::get_pages(offset, count, phys);
+}
+
+vm_area *
+vm_area_guarded::clone(uintptr_t offset, size_t size, util::bitset32 flags)
+{
+    // A clone would not know where the guard pages are
+    return nullptr;
+}
+
 vm_area_ring::vm_area_ring(size_t size, util::bitset32 flags) :
     vm_area_open {size * 2, flags},
     m_bufsize {size}
@@ -207,4 +479,26 @@ vm_area_ring::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
     return vm_area_open::get_page(offset, phys, alloc);
 }
 
+size_t
+vm_area_ring::get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc)
+{
+    // Both halves of the ring map the same pages, so never use large pages
+    return vm_area::get_large_page(offset, phys, alloc);
+}
+
+size_t
+vm_area_ring::get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero)
+{
+    // Every page must go through get_page, so both halves of the
+    // ring get the same pages
+    return vm_area::get_pages(offset, count, phys);
+}
+
+vm_area *
+vm_area_ring::clone(uintptr_t offset, size_t size, util::bitset32 flags)
+{
+    // A clone would not map its halves to the same pages
+    return nullptr;
+}
+
 } // namespace obj
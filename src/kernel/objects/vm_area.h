@@ -7,6 +7,7 @@
 
 #include <j6/cap_flags.h>
 #include <util/bitset.h>
+#include <util/spinlock.h>
 #include <util/vector.h>
 
 #include "block_allocator.h"
@@ -26,6 +27,8 @@ enum class vm_flags
 
 inline constexpr util::bitset32 vm_driver_mask = 0x00ff'ffff; ///< flags allowed via syscall for drivers
 inline constexpr util::bitset32 vm_user_mask   = 0x000f'ffff; ///< flags allowed via syscall for non-drivers
+inline constexpr util::bitset32 vm_hint_mask   = 0x0000'0600; ///< access hint flags settable with advise
+inline constexpr util::bitset32 vm_protect_mask = 0x0000'0003; ///< permission flags settable with protect
 
 /// Virtual memory areas allow control over memory allocation
 class vm_area :
@@ -36,6 +39,20 @@ public:
     static constexpr j6_cap_t creation_caps = j6_cap_vma_all;
     static constexpr kobject::type type = kobject::type::vma;
 
+    /// Default number of pages mapped around a faulting page
+    static constexpr size_t fault_around_pages = 16;
+
+    /// Default number of pages mapped from a faulting page onward, for
+    /// areas with the sequential hint
+    static constexpr size_t fault_ahead_pages = 64;
+
+    /// Largest number of pages that may be mapped for one fault
+    static constexpr size_t max_fault_window = 64;
+
+    /// Set in the addresses returned by get_pages for pages that are
+    /// shared copy-on-write, and must be mapped read-only
+    static constexpr uintptr_t page_shared = 0x1;
+
     /// Constructor.
     /// \arg size  Initial virtual size of the memory area
     /// \arg flags Flags for this memory area
@@ -49,6 +66,14 @@ public:
     /// Get the flags set for this area
     inline util::bitset32 flags() const { return m_flags; }
 
+    /// Get the area's share generation, which changes whenever some of
+    /// its pages become shared copy-on-write. Pages looked up before it
+    /// changed may have been shared since, and must not be mapped
+    /// writable.
+    inline uint64_t share_generation() const {
+        return __atomic_load_n(&m_share_gen, __ATOMIC_ACQUIRE);
+    }
+
     /// Track that this area was added to a vm_space
     /// \arg space  The space to add this area to
     /// \returns    False if this area cannot be added
@@ -74,6 +99,65 @@ public:
     /// \returns    True if there should be a page at the given offset
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) = 0;
 
+    /// Get the physical page containing the given offset, which may be a
+    /// large or huge page if this area prefers them.
+    /// \arg offset The offset into the VMA
+    /// \arg phys   [out] Receives the physical address of the start of the page
+    /// \arg alloc  If true, and this is a valid address with no frame,
+    ///             allocate one if applicable
+    /// \returns    The size of the page, or 0 if there is no page
+    virtual size_t get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc = true);
+
+    /// Get the size of pages this area prefers to be mapped with, based
+    /// on its large_pages and huge_pages flags.
+    size_t page_size() const;
+
+    /// Get the physical pages for a run of offsets, as with get_page,
+    /// allocating any that do not exist yet.
+    /// \arg offset The offset into the VMA of the first page
+    /// \arg count  The number of pages
+    /// \arg phys   [out] Array of `count` entries to receive the physical
+    ///             page addresses. Pages that are not valid receive 0, and
+    ///             shared pages have `page_shared` set.
+    /// \arg zero   If true, pages that do not exist yet may be given the
+    ///             shared zero page instead of being allocated, to be
+    ///             copied on their first write
+    /// \returns    The number of valid pages
+    virtual size_t get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero = false);
+
+    /// Create a new area that shares this area's pages copy-on-write.
+    /// Writes made to this area while it is being cloned may or may
+    /// not be seen by the clone. Pages of this area are not copied on
+    /// write until its writable mappings have been cleared from every
+    /// CPU, so no write can be lost from this area.
+    /// \arg offset Page-aligned offset into this area of the pages to share
+    /// \arg size   Size of the new area. Pages of this area in that range
+    ///             from `offset` are shared.
+    /// \arg flags  Flags for the new area
+    /// \returns    The new area, or nullptr if this area cannot be cloned
+    virtual vm_area * clone(uintptr_t offset, size_t size, util::bitset32 flags);
+
+    /// Handle a write to a page that may be shared copy-on-write, by
+    /// giving this area its own copy of the page and unmapping the shared
+    /// page from every space this area is mapped into.
+    /// \arg offset The offset into the VMA of the page
+    /// \arg phys   [out] Receives the physical address of the page
+    /// \returns    True if the page exists and is now writable
+    bool copy_on_write(uintptr_t offset, uintptr_t &phys);
+
+    /// Set the access hints for this area.
+    /// \arg hints  The sequential or random flags, or none for the default
+    /// \arg window Number of pages to map on each fault, or 0 for the default
+    void advise(util::bitset32 hints, size_t window);
+
+    /// Change the write and exec permissions of this area, updating
+    /// its existing mappings in every space it is mapped into.
+    /// \arg flags  The write and exec flags to set, other flags are ignored
+    void protect(util::bitset32 flags);
+
+    /// Get the number of pages to map when handling a fault in this area
+    size_t fault_window() const;
+
 protected:
     /// A VMA is not deleted until both no handles remain AND it's not
     /// mapped by any VM space.
@@ -81,8 +165,17 @@ protected:
 
     bool can_resize(size_t size);
 
+    /// Make sure the page at the given offset is not shared with any other
+    /// area, copying it if it is.
+    /// \arg offset The offset into the VMA of the page
+    /// \arg phys   [out] Receives the physical address of the page
+    /// \returns    True if the page exists and is not shared
+    virtual bool unshare_page(uintptr_t offset, uintptr_t &phys);
+
     size_t m_size;
     util::bitset32 m_flags;
+    size_t m_fault_window;
+    uint64_t m_share_gen;
     util::vector<vm_space*> m_spaces;
 
     // Initial static space for m_spaces - most areas will never grow
@@ -124,14 +217,25 @@ public:
     vm_area_open(size_t size, util::bitset32 flags);
     virtual ~vm_area_open();
 
+    virtual size_t resize(size_t size) override;
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero = false) override;
+    virtual vm_area * clone(uintptr_t offset, size_t size, util::bitset32 flags) override;
 
     /// Tell this VMA about an existing mapping that did not originate
     /// from get_page.
     void add_existing(uintptr_t offset, uintptr_t phys);
 
+protected:
+    virtual bool unshare_page(uintptr_t offset, uintptr_t &phys) override;
+
 private:
     page_tree *m_mapped;
+    util::spinlock m_lock;
+
+    /// Number of clones of this area still clearing its writable mappings
+    uint32_t m_cloning;
 };
 
 
@@ -176,6 +280,9 @@ public:
     void return_section(uintptr_t addr);
 
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero = false) override;
+    virtual vm_area * clone(uintptr_t offset, size_t size, util::bitset32 flags) override;
 
 private:
     size_t m_pages;
@@ -197,6 +304,9 @@ public:
     virtual ~vm_area_ring();
 
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_large_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual size_t get_pages(uintptr_t offset, size_t count, uintptr_t *phys, bool zero = false) override;
+    virtual vm_area * clone(uintptr_t offset, size_t size, util::bitset32 flags) override;
 
 private:
     size_t m_bufsize;
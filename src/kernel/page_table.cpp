@@ -2,6 +2,7 @@
 #include <util/pointers.h>
 
 #include "kassert.h"
+#include "cpu.h"
 #include "memory.h"
 #include "frame_allocator.h"
 #include "page_table.h"
@@ -17,8 +18,9 @@ constexpr size_t page_table::entry_sizes[4];
 inline constexpr util::bitset64 table_flags = page_flags::present | page_flags::write;
 
 
-page_table::iterator::iterator(uintptr_t virt, page_table *pml4) :
-    m_table {pml4, 0, 0, 0}
+page_table::iterator::iterator(uintptr_t virt, page_table *pml4, uint64_t *tables) :
+    m_table {pml4, 0, 0, 0},
+    m_tables {tables}
 {
     for (unsigned i = 0; i < D; ++i)
         m_index[i] = static_cast<uint16_t>((virt >> (12 + 9*(3-i))) & 0x1ff);
@@ -28,6 +30,7 @@ page_table::iterator::iterator(const page_table::iterator &o)
 {
     memcpy(&m_table, &o.m_table, sizeof(m_table));
     memcpy(&m_index, &o.m_index, sizeof(m_index));
+    m_tables = o.m_tables;
 }
 
 inline static level to_lv(unsigned i) { return static_cast<level>(i); }
@@ -84,6 +87,17 @@ page_table::iterator::depth() const
     return level::pt;
 }
 
+page_table::level
+page_table::iterator::page_level() const
+{
+    for (level i = level::pml4; i < level::pt; ++i) {
+        uint64_t e = entry(i);
+        if (!(e & 1) || (i > level::pml4 && (e & 0x80)))
+            return i;
+    }
+    return level::pt;
+}
+
 void
 page_table::iterator::next(level l)
 {
@@ -135,6 +149,8 @@ page_table::iterator::ensure_table(level l)
 
     page_table *table = page_table::get_table_page();
     uintptr_t phys = reinterpret_cast<uintptr_t>(table) & ~linear_offset;
+    if (m_tables)
+        __atomic_add_fetch(m_tables, 1, __ATOMIC_RELAXED);
 
     uint64_t &parent = entry(l - 1);
     util::bitset64 flags = table_flags;
@@ -176,22 +192,38 @@ struct free_page_header
     uint64_t x [x_count];
 };
 
+// Disable interrupts while using the current CPU's table page cache, so
+// the current thread can't be preempted or migrated in the middle of it
+inline uint64_t
+cache_lock()
+{
+    uint64_t rflags;
+    asm volatile ("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+inline void
+cache_unlock(uint64_t rflags)
+{
+    if (rflags & 0x200)
+        asm volatile ("sti" ::: "memory");
+}
+
 page_table *
 page_table::get_table_page()
 {
-    free_page_header *page = nullptr;
+    uint64_t rflags = cache_lock();
+    cpu_data &cpu = current_cpu();
 
-    {
-        util::scoped_lock lock(s_lock);
+    if (!cpu.table_pages)
+        refill_table_cache(cpu);
 
-        if (!s_page_cache)
-            fill_table_page_cache();
+    free_page_header *page = cpu.table_pages;
+    kassert(page, "Somehow the page cache pointer is null");
 
-        kassert(s_page_cache, "Somehow the page cache pointer is null");
-
-        page = s_page_cache;
-        s_page_cache = s_page_cache->next;
-    }
+    cpu.table_pages = page->next;
+    --cpu.table_page_count;
+    cache_unlock(rflags);
 
     memset(page, 0, frame_size);
     return reinterpret_cast<page_table*>(page);
@@ -200,30 +232,68 @@ page_table::get_table_page()
 void
 page_table::free_table_page(page_table *pt)
 {
-    util::scoped_lock lock(s_lock);
     free_page_header *page =
         reinterpret_cast<free_page_header*>(pt);
-    page->next = s_page_cache;
-    s_page_cache = page;
+
+    uint64_t rflags = cache_lock();
+    cpu_data &cpu = current_cpu();
+
+    if (cpu.table_page_count >= table_cache_size)
+        drain_table_cache(cpu);
+
+    page->next = cpu.table_pages;
+    cpu.table_pages = page;
+    ++cpu.table_page_count;
+    cache_unlock(rflags);
 }
 
 void
-page_table::fill_table_page_cache()
+page_table::refill_table_cache(cpu_data &cpu)
 {
-    static constexpr size_t request_pages = 32;
-    frame_allocator &fa = frame_allocator::get();
+    {
+        util::scoped_lock lock(s_lock);
+
+        while (s_page_cache && cpu.table_page_count < table_cache_batch) {
+            free_page_header *page = s_page_cache;
+            s_page_cache = page->next;
+
+            page->next = cpu.table_pages;
+            cpu.table_pages = page;
+            ++cpu.table_page_count;
+        }
+    }
+
+    if (cpu.table_pages)
+        return;
 
     uintptr_t phys = 0;
-    size_t n = fa.allocate(request_pages, &phys);
+    size_t n = frame_allocator::get().allocate(table_cache_batch, &phys);
 
     free_page_header *pages =
         mem::to_virtual<free_page_header>(phys);
 
-    for (int i = 0; i < n - 1; ++i) {
+    for (size_t i = 0; i < n - 1; ++i) {
         pages[i].next = &pages[i + 1];
     }
-    pages[n - 1].next = s_page_cache;
-    s_page_cache = pages;
+    pages[n - 1].next = nullptr;
+
+    cpu.table_pages = pages;
+    cpu.table_page_count = n;
+}
+
+void
+page_table::drain_table_cache(cpu_data &cpu)
+{
+    util::scoped_lock lock(s_lock);
+
+    for (size_t i = 0; i < table_cache_batch && cpu.table_pages; ++i) {
+        free_page_header *page = cpu.table_pages;
+        cpu.table_pages = page->next;
+        --cpu.table_page_count;
+
+        page->next = s_page_cache;
+        s_page_cache = page;
+    }
 }
 
 void
@@ -238,7 +308,7 @@ page_table::free(page_table::level l)
         if (!is_present(i)) continue;
         if (is_page(l, i)) {
             size_t count = mem::page_count(entry_sizes[unsigned(l)]);
-            fa.free(entries[i] & ~0xfffull, count);
+            fa.free(entries[i] & address_mask, count);
         } else {
             get(i)->free(l + 1);
         }
@@ -7,6 +7,7 @@
 #include <util/bitset.h>
 #include <util/spinlock.h>
 
+struct cpu_data;
 struct free_page_header;
 
 namespace page_flags {
@@ -22,6 +23,7 @@ namespace page_flags {
     inline constexpr util::bitset64 pat2      = 0x0080; /// PAT selector bit 2 on PT entries
     inline constexpr util::bitset64 global    = 0x0100; /// Entry is not PCID-specific
     inline constexpr util::bitset64 pat2_lg   = 0x1000; /// PAT selector bit 2 on large/huge pages
+    inline constexpr util::bitset64 nx        = 0x8000'0000'0000'0000; /// Section may not be executed
 
     inline constexpr util::bitset64 wb    = 0;
     inline constexpr util::bitset64 wt    = pat0;
@@ -51,8 +53,12 @@ struct page_table
         pat2      =  7, /// PAT selector bit 2 on PT entries
         global    =  8, /// Entry is not PCID-specific
         pat2_lg   = 12, /// PAT selector bit 2 on large/huge pages
+        nx        = 63, /// Section may not be executed
     };
 
+    /// Mask of the physical address bits of a page entry
+    static constexpr uint64_t address_mask = 0x000f'ffff'ffff'f000ull;
+
     /// Helper for getting the next level value
     inline static level deeper(level l) {
         return static_cast<level>(static_cast<unsigned>(l) + 1);
@@ -74,7 +80,9 @@ struct page_table
         /// Constructor.
         /// \arg virt       Virtual address this iterator is starting at
         /// \arg pml4       Root of the page tables to iterate
-        iterator(uintptr_t virt, page_table *pml4);
+        /// \arg tables     If set, incremented for each table page the
+        ///                 iterator allocates
+        iterator(uintptr_t virt, page_table *pml4, uint64_t *tables = nullptr);
 
         /// Copy constructor.
         iterator(const iterator &o);
@@ -119,6 +127,11 @@ struct page_table
         /// Get the depth of tables that actually exist for the current address
         level depth() const;
 
+        /// Get the level of the entry that maps the current address: the
+        /// first entry that is not present, a large or huge page entry, or
+        /// otherwise the PT entry.
+        level page_level() const;
+
         /// Increment iteration to the next entry aligned to the given level
         void next(level l);
 
@@ -140,21 +153,34 @@ struct page_table
         // contents in const functions.
         mutable page_table *m_table[D];
         uint16_t m_index[D];
+        uint64_t *m_tables;
     };
 
-    /// Allocate a page for a page table, or pull one from the cache
+    /// Maximum number of free table pages each CPU caches
+    static constexpr size_t table_cache_size = 32;
+
+    /// Number of table pages moved to or from a CPU's cache at once
+    static constexpr size_t table_cache_batch = table_cache_size / 2;
+
+    /// Allocate a page for a page table, or pull one from the current
+    /// CPU's cache
     /// \returns  An empty page, mapped in the linear offset area
     static page_table * get_table_page();
 
-    /// Return a page table's page to the page cache.
+    /// Return a page table's page to the current CPU's cache.
     /// \arg pt  The page to be returned
     static void free_table_page(page_table *pt);
 
-    // Ensure the page table page cache has a minimum number of pages
-    // in it.
-    static void fill_table_page_cache();
+    /// Refill a CPU's empty table page cache with a batch of pages from
+    /// the shared cache, or from the frame allocator. Must be called with
+    /// interrupts disabled.
+    static void refill_table_cache(cpu_data &cpu);
+
+    /// Move a batch of pages from a CPU's full table page cache to the
+    /// shared cache. Must be called with interrupts disabled.
+    static void drain_table_cache(cpu_data &cpu);
 
-    static free_page_header *s_page_cache; ///< Cache of free pages to use for tables
+    static free_page_header *s_page_cache; ///< Pages drained from CPUs' caches
     static util::spinlock s_lock;          ///< Lock for shared page cache
 
     /// Get an entry in the page table as a page_table pointer
@@ -1,9 +1,13 @@
 #include <j6/memutils.h>
 #include <arch/memory.h>
+#include <util/node_map.h>
+#include <util/spinlock.h>
 
 #include "kassert.h"
 #include "frame_allocator.h"
+#include "memory.h"
 #include "page_tree.h"
+#include "zero_pool.h"
 
 // Page tree levels map the following parts of an offset. Note the xxx part of
 // the offset but represent the bits of the actual sub-page virtual address.
@@ -23,6 +27,70 @@
 
 static_assert(sizeof(page_tree) == 67 * sizeof(uintptr_t));
 
+// Entries in the tree are physical addresses of pages, with flags in the
+// low bits. When a VMA uses large pages, the entry at the start of each
+// large page's range either holds the large page, or is marked split once
+// anything in that range was allocated as single pages. Large pages bigger
+// than 2MiB are also marked as huge. Pages shared copy-on-write with
+// another tree are marked with page_tree::shared_tag, and counted in
+// g_shares so the last tree holding them frees them.
+static constexpr uint64_t present_tag = 0x1;
+static constexpr uint64_t large_tag   = 0x2;
+static constexpr uint64_t split_tag   = 0x4;
+static constexpr uint64_t huge_tag    = 0x10;
+
+static constexpr size_t large_frames = 1ull << arch::table_bits;
+static constexpr size_t huge_frames  = large_frames << arch::table_bits;
+
+namespace {
+
+// The number of trees holding each shared frame. A frame is added when
+// it's first shared, and removed once the last tree holding it frees
+// it or takes it back as its own. Frames not in the table belong to
+// only one tree. The zero page is never counted, or freed.
+struct frame_shares
+{
+    uintptr_t frame = 0;
+    size_t count = 0;
+};
+
+inline uintptr_t & get_map_key(frame_shares &s) { return s.frame; }
+
+util::node_map<uintptr_t, frame_shares> g_shares;
+util::spinlock g_shares_lock;
+
+// Drop one tree's hold on a shared frame.
+// Returns true if no other tree holds the frame, and so it should be freed.
+bool
+drop_share(uintptr_t frame)
+{
+    util::scoped_lock lock {g_shares_lock};
+    frame_shares *s = g_shares.find(frame);
+    kassert(s && s->count, "Dropping a share of an uncounted frame");
+    if (!s || --s->count)
+        return false;
+
+    g_shares.erase(frame);
+    return true;
+}
+
+// Check if a tree is the last one holding a shared frame, and if so,
+// stop counting the frame so the tree can take it back as its own.
+bool
+last_share(uintptr_t frame)
+{
+    util::scoped_lock lock {g_shares_lock};
+    frame_shares *s = g_shares.find(frame);
+    kassert(s && s->count, "Checking shares of an uncounted frame");
+    if (!s || s->count > 1)
+        return false;
+
+    g_shares.erase(frame);
+    return true;
+}
+
+} // namespace
+
 bool
 page_tree::find_or_add(page_tree * &root, uint64_t offset, uintptr_t &page)
 {
@@ -30,24 +98,182 @@ page_tree::find_or_add(page_tree * &root, uint64_t offset, uintptr_t &page)
     uint64_t &ent = radix_tree::find_or_add(radix_root, offset);
     root = static_cast<page_tree*>(radix_root);
 
-    if (!(ent & 1)) {
+    if (!(ent & present_tag)) {
         // No entry for this page exists, so make one
-        if (!frame_allocator::get().allocate(1, &ent))
+        uintptr_t phys = 0;
+        if (!zero_pool::allocate(1, &phys))
             return false;
-        ent |= 1;
+        ent |= phys | present_tag;
     }
 
     page = ent & ~0xfffull;
     return true;
 }
 
+size_t
+page_tree::find_or_add_large(page_tree * &root, uint64_t offset,
+        size_t size, uintptr_t &page, bool alloc)
+{
+    uint64_t start = offset & ~(size - 1);
+
+    if (!alloc) {
+        uint64_t ent = 0;
+        if (find(root, start, &ent) && (ent & large_tag)) {
+            page = ent & ~0xfffull;
+            return size;
+        }
+
+        if (!find(root, offset, &ent) || !(ent & present_tag))
+            return 0;
+
+        page = ent & ~0xfffull;
+        return arch::frame_size;
+    }
+
+    node_type * radix_root = root;
+    uint64_t &head = radix_tree::find_or_add(radix_root, start);
+    root = static_cast<page_tree*>(radix_root);
+
+    if (head & large_tag) {
+        page = head & ~0xfffull;
+        return size;
+    }
+
+    if (!(head & split_tag)) {
+        // Nothing in this range has been allocated yet, so try to
+        // back all of it with one large page
+        uintptr_t phys = 0;
+        size_t frames = size / arch::frame_size;
+        if (frame_allocator::get().allocate_contiguous(frames, frames, &phys)) {
+            head = phys | large_tag | present_tag |
+                (frames > large_frames ? huge_tag : 0);
+            page = phys;
+            return size;
+        }
+
+        head |= split_tag;
+    }
+
+    return find_or_add(root, offset, page) ? arch::frame_size : 0;
+}
+
+size_t
+page_tree::share(page_tree * &root, page_tree * &dest, uint64_t offset, size_t size)
+{
+    const uintptr_t zero_page = zero_pool::zero_page();
+
+    size_t shared = 0;
+    auto share_entry = [&](uint64_t key, uint64_t &ent) {
+        if (key < offset || key - offset >= size || !(ent & present_tag))
+            return;
+
+        kassert(!(ent & large_tag), "Sharing a large page from a page_tree");
+
+        // A frame being shared for the first time is now held by both
+        // trees, otherwise it's held by one more
+        uintptr_t frame = ent & ~0xfffull;
+        if (frame != zero_page) {
+            frame_shares &s = g_shares[frame];
+            s.count = (ent & shared_tag) ? s.count + 1 : 2;
+        }
+        ent |= shared_tag;
+
+        node_type *dest_root = dest;
+        radix_tree::find_or_add(dest_root, key - offset) = ent;
+        dest = static_cast<page_tree*>(dest_root);
+        ++shared;
+    };
+
+    util::scoped_lock lock {g_shares_lock};
+    for_each(root, share_entry);
+    return shared;
+}
+
+bool
+page_tree::unshare(page_tree * &root, uint64_t offset, uintptr_t &page)
+{
+    uint64_t ent = 0;
+    if (!find(root, offset, &ent) || !(ent & present_tag))
+        return false;
+
+    if (!(ent & shared_tag)) {
+        page = ent & ~0xfffull;
+        return true;
+    }
+
+    // The other tree(s) sharing this page may still be using it, so
+    // this tree gets the copy. Copies of the zero page just need to
+    // be zeroed. If every other tree has let go of the page, this
+    // one can just take it back.
+    uintptr_t phys = 0;
+    uintptr_t old = ent & ~0xfffull;
+    if (old == zero_pool::zero_page()) {
+        if (!zero_pool::allocate(1, &phys))
+            return false;
+    } else if (last_share(old)) {
+        phys = old;
+    } else {
+        if (!frame_allocator::get().allocate(1, &phys))
+            return false;
+        memcpy(mem::to_virtual<void>(phys), mem::to_virtual<void>(old), arch::frame_size);
+
+        // If the other trees let go of the page during the copy, this
+        // tree keeps it after all. It may still be mapped read-only, so
+        // it can't be freed here.
+        if (drop_share(old)) {
+            zero_pool::free(phys, 1);
+            phys = old;
+        }
+    }
+
+    node_type *radix_root = root;
+    radix_tree::find_or_add(radix_root, offset) = phys | present_tag;
+    root = static_cast<page_tree*>(radix_root);
+
+    page = phys;
+    return true;
+}
+
+size_t
+page_tree::release(page_tree *root, uint64_t offset)
+{
+    const uintptr_t zero_page = zero_pool::zero_page();
+
+    size_t freed = 0;
+    auto release_entry = [&](uint64_t key, uint64_t &ent) {
+        if (key < offset)
+            return;
+
+        uint64_t old = ent;
+        ent = 0;
+
+        if (!(old & present_tag))
+            return;
+
+        // Shared pages are only freed by the last tree to let go of them
+        if ((old & shared_tag) &&
+            ((old & ~0xfffull) == zero_page || !drop_share(old & ~0xfffull)))
+            return;
+
+        size_t frames = 1;
+        if (old & large_tag)
+            frames = (old & huge_tag) ? huge_frames : large_frames;
+
+        zero_pool::free(old & ~0xfffull, frames);
+        freed += frames;
+    };
+
+    for_each(root, release_entry);
+    return freed;
+}
+
 void
-page_tree::add_existing(page_tree * &root, uint64_t offset, uintptr_t page)
+page_tree::add_existing(page_tree * &root, uint64_t offset, uintptr_t page, bool shared)
 {
     node_type * radix_root = root;
     uint64_t &ent = radix_tree::find_or_add(radix_root, offset);
     root = static_cast<page_tree*>(radix_root);
 
-    kassert(!(ent & 1), "Replacing existing mapping in page_tree::add_existing");
-    ent = page | 1;
+    kassert(!(ent & present_tag), "Replacing existing mapping in page_tree::add_existing");
+    ent = page | present_tag | (shared ? shared_tag : 0);
 }
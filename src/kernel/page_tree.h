@@ -12,8 +12,13 @@ class page_tree :
     public util::radix_tree<uintptr_t, 64, 5, arch::frame_bits>
 {
 public:
+    /// Tag in an entry's low bits marking a page that is shared with
+    /// another tree, and so must be copied before it is written. Shared
+    /// frames are counted, and freed by the last tree holding them.
+    static constexpr uint64_t shared_tag = 0x8;
+
     /// Get the physical address of the page at the given offset. If one does
-    /// not exist yet, allocate a page, insert it, and return that. Overrides
+    /// not exist yet, allocate a zeroed page, insert it, and return that. Overrides
     /// `util::radix_tree::find_or_add`.
     /// \arg root    [inout] The root node of the tree. This pointer may be updated.
     /// \arg offset  Offset into the VMA, in bytes
@@ -21,9 +26,53 @@ public:
     /// \returns     True if a page was found
     static bool find_or_add(page_tree * &root, uint64_t offset, uintptr_t &page);
 
+    /// Get the physical address of the page containing the given offset, in
+    /// a VMA that prefers to be backed by large pages. If nothing in the
+    /// large page's range has been allocated yet, try to allocate one
+    /// contiguous, aligned large page for it. Otherwise (or if that fails)
+    /// the range falls back to single pages as `find_or_add`.
+    /// \arg root    [inout] The root node of the tree. This pointer may be updated.
+    /// \arg offset  Offset into the VMA, in bytes
+    /// \arg size    Size of the preferred large page, in bytes
+    /// \arg page    [out] Receives the physical address of the start of the page
+    /// \arg alloc   If false, only find an existing page
+    /// \returns     The size of the page found, or 0 if none was found
+    static size_t find_or_add_large(page_tree * &root, uint64_t offset,
+            size_t size, uintptr_t &page, bool alloc = true);
+
+    /// Share a range of pages with another tree, copy-on-write. Both trees'
+    /// entries for the shared pages are marked with `shared_tag`.
+    /// \arg root    [inout] The root node of the source tree. This pointer may be updated.
+    /// \arg dest    [inout] The root node of the tree to share pages into. This
+    ///              pointer may be updated.
+    /// \arg offset  Offset of the range in the source tree, in bytes
+    /// \arg size    Size of the range, in bytes. Pages in the range are at
+    ///              offsets starting from 0 in `dest`.
+    /// \returns     The number of pages shared
+    static size_t share(page_tree * &root, page_tree * &dest, uint64_t offset, size_t size);
+
+    /// Make sure the page at the given offset is not shared with any other
+    /// tree, copying it to a new page if it is. A page that every other
+    /// tree has let go of is kept without copying.
+    /// \arg root    [inout] The root node of the tree. This pointer may be updated.
+    /// \arg offset  Offset into the VMA, in bytes
+    /// \arg page    [out] Receives the page physical address
+    /// \returns     True if the page exists and is no longer shared
+    static bool unshare(page_tree * &root, uint64_t offset, uintptr_t &page);
+
+    /// Remove every page at or past an offset from the tree, and free the
+    /// ones that no other tree still holds into the zero_pool.
+    /// Large pages starting before the offset are kept whole. The tree's
+    /// mappings of these pages must already have been cleared.
+    /// \arg root    The root node of the tree
+    /// \arg offset  Offset into the VMA, in bytes
+    /// \returns     The number of frames freed
+    static size_t release(page_tree *root, uint64_t offset);
+
     /// Add an existing mapping not allocated via find_or_add.
     /// \arg root    [inout] The root node of the tree. This pointer may be updated.
     /// \arg offset  Offset into the VMA, in bytes
     /// \arg page    The mapped page physical address
-    static void add_existing(page_tree * &root, uint64_t offset, uintptr_t page);
+    /// \arg shared  If true, mark the page with `shared_tag`
+    static void add_existing(page_tree * &root, uint64_t offset, uintptr_t page, bool shared = false);
 };
@@ -1,5 +1,6 @@
 #include <stddef.h>
 
+#include <j6/types.h>
 #include <util/spinlock.h>
 
 #include "apic.h"
@@ -18,13 +19,18 @@
 #include "objects/thread.h"
 #include "objects/vm_area.h"
 #include "scheduler.h"
+#include "timer_wheel.h"
+#include "tlb.h"
 
 using obj::process;
 using obj::thread;
 
-extern "C" void task_switch(TCB *tcb);
+extern "C" void task_switch(TCB *tcb, uint64_t cr3);
 scheduler *scheduler::s_instance = nullptr;
 
+static_assert(scheduler::num_priorities <= 8,
+        "run_queue::ready_mask is too small for num_priorities");
+
 struct run_queue
 {
     tcb_node *current = nullptr;
@@ -32,9 +38,98 @@ struct run_queue
     tcb_list ready[scheduler::num_priorities];
     tcb_list blocked;
 
+    /// Which priorities of the ready lists are non-empty
+    util::bitset8 ready_mask;
+
+    /// Blocked threads with wake timeouts, by deadline
+    timer_wheel sleepers;
+
+    /// Threads that exited while current, waiting to be released
+    tcb_list exited;
+
+    /// Number of non-idle threads on the ready lists. Written under
+    /// the lock, but read without it by other CPUs as a load hint.
+    uint32_t ready_count = 0;
+
+    /// Whether the current thread is a non-idle thread
+    bool busy = false;
+
+    /// Whether a schedule IPI has been sent to this queue's CPU since
+    /// it last ran schedule()
+    bool kicked = false;
+
+    /// Whether the last steal_work could not lock the busiest queue
+    bool steal_missed = false;
+
+    /// Decaying average of runnable threads, in fixed point with
+    /// load_frac_bits fractional bits
+    uint32_t load = 0;
+
+    uint64_t added = 0;
+    uint64_t migrated = 0;
+    uint64_t switches = 0;
+    uint64_t handoffs = 0;
+
     uint64_t last_promotion = 0;
     uint64_t last_steal = 0;
     util::spinlock lock;
+
+    static constexpr unsigned load_frac_bits = 8;
+    static constexpr unsigned load_decay_shift = 3;
+
+    inline void count_ready(uint8_t priority, int delta) {
+        if (priority != scheduler::idle_priority)
+            __atomic_store_n(&ready_count, ready_count + delta, __ATOMIC_RELAXED);
+    }
+
+    inline void push_ready(tcb_node *t, bool front = false) {
+        if (front)
+            ready[t->priority].push_front(t);
+        else
+            ready[t->priority].push_back(t);
+        ready_mask.set(t->priority);
+        count_ready(t->priority, 1);
+    }
+
+    inline void remove_ready(tcb_node *t) {
+        tcb_list &list = ready[t->priority];
+        list.remove(t);
+        if (list.empty())
+            ready_mask.clear(t->priority);
+        count_ready(t->priority, -1);
+    }
+
+    inline tcb_node * pop_ready() {
+        kassert(!ready_mask.empty(), "All runlists are empty");
+        unsigned priority = __builtin_ctz(ready_mask.value());
+        tcb_list &list = ready[priority];
+        tcb_node *t = list.pop_front();
+        if (list.empty())
+            ready_mask.clear(priority);
+        count_ready(priority, -1);
+        return t;
+    }
+
+    /// Fold the current number of runnable threads into the
+    /// decaying load average.
+    inline void update_load() {
+        uint32_t runnable = ready_count + (busy ? 1 : 0);
+        uint32_t next = load - (load >> load_decay_shift) +
+            ((runnable << load_frac_bits) >> load_decay_shift);
+        __atomic_store_n(&load, next, __ATOMIC_RELAXED);
+    }
+
+    /// Get the load of this queue for placement decisions, the larger
+    /// of its current runnable count and its recent load average. This
+    /// may be called without holding the lock.
+    inline uint32_t placement_load() const {
+        uint32_t runnable =
+            __atomic_load_n(&ready_count, __ATOMIC_RELAXED) +
+            (__atomic_load_n(&busy, __ATOMIC_RELAXED) ? 1 : 0);
+        uint32_t now = runnable << load_frac_bits;
+        uint32_t avg = __atomic_load_n(&load, __ATOMIC_RELAXED);
+        return now > avg ? now : avg;
+    }
 };
 
 scheduler::scheduler(unsigned cpus) :
@@ -76,7 +171,7 @@ scheduler::create_kernel_task(void (*task)(), uint8_t priority, bool constant)
     if (constant)
         th->set_state(thread::state::constant);
 
-    th->set_state(thread::state::ready);
+    th->wake_only();
 
     log::verbose(logs::task, "Spawned new kernel task <%02lx:%02lx>", kp.obj_id(), th->obj_id());
 }
@@ -103,165 +198,347 @@ scheduler::start()
     cpu.apic->reset_timer(10);
 }
 
+cpu_data *
+scheduler::pick_cpu()
+{
+    cpu_data &here = current_cpu();
+    const uint32_t here_load = m_run_queues[here.index].placement_load();
+
+    unsigned best = here.index;
+    uint32_t best_load = here_load;
+
+    // Start the search at a rotating index, so that ties don't
+    // always go to the same CPU
+    const unsigned count = g_num_cpus;
+    const unsigned start = m_add_index++;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned index = (start + i) % count;
+        uint32_t load = m_run_queues[index].placement_load();
+        if (load < best_load) {
+            best = index;
+            best_load = load;
+        }
+    }
+
+    // New threads are often short-lived helpers that share data with
+    // their creator, so keep them on the creator's CPU while it has
+    // no more than about one thread more than the least loaded CPU.
+    if (here_load <= best_load + placement_slack)
+        best = here.index;
+
+    return g_cpu_data[best];
+}
+
 void
 scheduler::add_thread(TCB *t)
 {
-    cpu_data *cpu = g_cpu_data[m_add_index++ % g_num_cpus];
+    cpu_data *cpu = pick_cpu();
     run_queue &queue = m_run_queues[cpu->index];
     util::scoped_lock lock {queue.lock};
 
     obj::thread *th = t->thread;
     th->handle_retain();
 
+    ++queue.added;
     t->cpu = cpu;
     t->time_left = quantum(t->priority);
     queue.blocked.push_back(static_cast<tcb_node*>(t));
 }
 
+run_queue &
+scheduler::lock_queue(TCB *t, util::spinlock::waiter &waiter)
+{
+    // Ready threads may be stolen by another CPU between reading
+    // t->cpu and acquiring the lock, so check again once locked
+    while (true) {
+        cpu_data *cpu = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+        kassert(cpu, "thread with a null cpu");
+
+        run_queue &queue = m_run_queues[cpu->index];
+        queue.lock.acquire(&waiter);
+        if (__atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE) == cpu)
+            return queue;
+
+        queue.lock.release(&waiter);
+    }
+}
+
 void
-scheduler::prune(run_queue &queue, uint64_t now)
+scheduler::ready_thread(TCB *t)
 {
-    // Find processes that are ready or have exited and
-    // move them to the appropriate lists.
-    auto *tcb = queue.blocked.front();
-    while (tcb) {
-        thread *th = tcb->thread;
-        uint8_t priority = tcb->priority;
+    tcb_node *tcb = static_cast<tcb_node*>(t);
+    thread *th = tcb->thread;
 
-        uint64_t timeout = th->wake_timeout();
-        if (timeout && timeout <= now)
-            th->wake_only();
+    util::spinlock::waiter waiter {false, nullptr, "ready_thread"};
+    run_queue &queue = lock_queue(t, waiter);
+
+    // Ready threads that are not current are always on the ready
+    // list, and the current thread will be put on the ready list by
+    // schedule(), so only blocked threads need to move.
+    bool was_ready = th->has_state(thread::state::ready);
+    th->set_state(thread::state::ready);
 
-        bool ready = th->has_state(thread::state::ready);
-        bool exited = th->has_state(thread::state::exited);
-        bool constant = th->has_state(thread::state::constant);
-        bool current = tcb == queue.current;
+    bool pushed = false;
+    if (!was_ready && tcb != queue.current &&
+        !th->has_state(thread::state::exited)) {
+        queue.blocked.remove(tcb);
+        queue.sleepers.remove(tcb);
+        queue.push_ready(tcb);
+        pushed = true;
+    }
+
+    const unsigned index = t->cpu->index;
+    const bool busy = queue.busy;
+    queue.lock.release(&waiter);
 
-        auto *remove = tcb;
-        tcb = tcb->next();
-        if (!exited && !ready)
+    if (!pushed)
+        return;
+
+    // An idle CPU may have its timer stopped, so it must be woken to
+    // run the thread. If the thread's CPU is busy, wake an idle CPU
+    // to steal it instead.
+    if (!busy)
+        kick_cpu(index);
+    else
+        kick_idle_cpu(index);
+}
+
+void
+scheduler::kick_cpu(unsigned index)
+{
+    run_queue &queue = m_run_queues[index];
+    if (__atomic_exchange_n(&queue.kicked, true, __ATOMIC_ACQ_REL))
+        return;
+
+    current_cpu().apic->send_ipi(
+        lapic::ipi_fixed, isr::ipiSchedule, g_cpu_data[index]->id);
+}
+
+void
+scheduler::kick_idle_cpu(unsigned except)
+{
+    const unsigned count = m_run_queues.count();
+    for (unsigned i = 0; i < count; ++i) {
+        if (i == except) continue;
+
+        run_queue &queue = m_run_queues[i];
+        if (__atomic_load_n(&queue.busy, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&queue.ready_count, __ATOMIC_RELAXED))
             continue;
 
-        if (exited) {
-            // If the current thread has exited, wait until the next call
-            // to prune() to delete it, because we may be deleting our current
-            // page tables
-            if (current) continue;
+        kick_cpu(i);
+        return;
+    }
+}
+
+void
+scheduler::exit_thread(TCB *t)
+{
+    tcb_node *tcb = static_cast<tcb_node*>(t);
+    thread *th = tcb->thread;
 
-            queue.blocked.remove(remove);
-            th->handle_release();
+    util::spinlock::waiter waiter {false, nullptr, "exit_thread"};
+    run_queue &queue = lock_queue(t, waiter);
+
+    bool was_ready = th->has_state(thread::state::ready);
+    th->clear_state(thread::state::ready);
+
+    // The current thread will be moved to the exited list by
+    // its next reschedule.
+    if (tcb != queue.current) {
+        if (was_ready) {
+            queue.remove_ready(tcb);
         } else {
-            queue.blocked.remove(remove);
-            log::spam(logs::sched, "Prune: readying unblocked thread %llx", th->koid());
-            queue.ready[remove->priority].push_back(remove);
+            queue.blocked.remove(tcb);
+            queue.sleepers.remove(tcb);
+        }
+        queue.exited.push_back(tcb);
+    }
+
+    queue.lock.release(&waiter);
+}
+
+size_t
+scheduler::prune(run_queue &queue, uint64_t now)
+{
+    // Wake any threads whose timeouts have passed
+    size_t woken = 0;
+    queue.sleepers.expire(now, [&queue, &woken](TCB *t) {
+            tcb_node *tcb = static_cast<tcb_node*>(t);
+            thread *th = tcb->thread;
+            log::spam(logs::sched, "Prune: waking timed out thread %llx", th->koid());
+
+            th->set_wake_timeout(0);
+            th->set_state(thread::state::ready);
+            queue.blocked.remove(tcb);
+            queue.push_ready(tcb);
+            ++woken;
+        });
+
+    return woken;
+}
+
+void
+scheduler::release_exited(run_queue &queue)
+{
+    // Releasing the last thread of a process destroys its address
+    // space, which waits for TLB shootdowns on other CPUs. Those CPUs
+    // may be spinning on this queue's lock with interrupts disabled,
+    // so move the threads off the queue, and only release them once
+    // the lock is dropped.
+    tcb_list exited;
+    {
+        util::scoped_lock lock {queue.lock};
+
+        // Skip the current thread, because we may be deleting our
+        // current page tables or stack
+        auto *tcb = queue.exited.front();
+        while (tcb) {
+            auto *next = tcb->next();
+            if (tcb != queue.current) {
+                queue.exited.remove(tcb);
+                exited.push_back(tcb);
+            }
+            tcb = next;
         }
     }
+
+    while (!exited.empty())
+        exited.pop_front()->thread->handle_release();
 }
 
 void
 scheduler::check_promotions(run_queue &queue, uint64_t now)
 {
     for (auto &pri_list : queue.ready) {
-        for (auto *tcb : pri_list) {
+        auto *tcb = pri_list.front();
+        while (tcb) {
+            auto *next = tcb->next();
             const thread *th = tcb->thread;
 
-            if (th->has_state(thread::state::constant))
-                continue;
-
             const uint64_t age = now - tcb->last_ran;
             const uint8_t priority = tcb->priority;
 
             bool stale =
+                !th->has_state(thread::state::constant) &&
                 age > quantum(priority) * 2 &&
                 tcb->priority > promote_limit;
 
             if (stale) {
                 // If the thread is stale, promote it
-                queue.ready[priority].remove(tcb);
+                queue.remove_ready(tcb);
                 tcb->priority -= 1;
                 tcb->time_left = quantum(tcb->priority);
-                queue.ready[tcb->priority].push_back(tcb);
+                queue.push_ready(tcb);
                 log::verbose(logs::sched, "Scheduler promoting thread %llx, priority %d",
                         th->koid(), tcb->priority);
             }
+
+            tcb = next;
         }
     }
 
     queue.last_promotion = now;
 }
 
+/// Move ready threads from one run queue to another until the two are
+/// balanced, or `limit` threads have been moved.
+/// \arg to        The run queue to move threads to
+/// \arg from      The run queue to move threads from
+/// \arg new_cpu   The CPU that owns `to`
+/// \arg now       The current clock time
+/// \arg limit     The maximum number of threads to move
+/// \arg take_hot  If false, skip threads that ran recently enough that
+///                they likely still have state in their CPU's cache
+/// \returns       The number of threads moved
 static size_t
-balance_lists(tcb_list &to, tcb_list &from, cpu_data &new_cpu)
+migrate_threads(run_queue &to, run_queue &from, cpu_data &new_cpu,
+        uint64_t now, size_t limit, bool take_hot)
 {
-    size_t to_len = to.length();
-    size_t from_len = from.length();
-
-    // Only steal from the rich, don't be Dennis Moore
-    if (from_len <= to_len)
-        return 0;
-
-    size_t steal = (from_len - to_len) / 2;
-    for (size_t i = 0; i < steal; ++i) {
-        tcb_node *node = from.pop_front();
-        node->cpu = &new_cpu;
-        to.push_front(node);
+    size_t moved = 0;
+
+    // Steal from most urgent lists first, don't steal idle threads.
+    // Blocked threads stay put, since their wake timeouts are tracked
+    // by their current run queue.
+    for (unsigned pri = 0; pri < scheduler::idle_priority; ++pri) {
+        // Threads at the back of the list would wait the longest
+        // on their current CPU, so take them first
+        tcb_node *node = from.ready[pri].back();
+        while (node) {
+            // Only steal from the rich, don't be Dennis Moore. The
+            // thief's next thread is still on its ready list, but the
+            // victim's running thread is not, so this evens them out.
+            if (moved == limit || from.ready_count <= to.ready_count)
+                return moved;
+
+            tcb_node *prev = node->prev();
+            if (take_hot || now - node->last_ran >= scheduler::cache_hot_micros) {
+                from.remove_ready(node);
+                __atomic_store_n(&node->cpu, &new_cpu, __ATOMIC_RELEASE);
+                to.push_ready(node);
+                ++moved;
+            }
+            node = prev;
+        }
     }
-    return steal;
+
+    return moved;
 }
 
 void
-scheduler::steal_work(cpu_data &cpu)
+scheduler::steal_work(cpu_data &cpu, uint64_t now)
 {
     run_queue &my_queue = m_run_queues[cpu.index];
+    const bool idle = my_queue.ready_count == 0;
+    my_queue.steal_missed = false;
+
+    // Find the busiest queue by its load hint, without locking
+    unsigned busiest = cpu.index;
+    uint32_t busiest_ready = my_queue.ready_count;
 
     const unsigned count = m_run_queues.count();
     for (unsigned i = 0; i < count; ++i) {
-        if (i == cpu.index) continue;
+        uint32_t ready = __atomic_load_n(&m_run_queues[i].ready_count, __ATOMIC_RELAXED);
+        if (ready > busiest_ready) {
+            busiest = i;
+            busiest_ready = ready;
+        }
+    }
 
-        run_queue &other_queue = m_run_queues[i];
-        util::scoped_lock other_queue_lock {other_queue.lock};
+    if (busiest == cpu.index)
+        return;
 
-        size_t stolen = 0;
+    // Our own queue is already locked, so only try for the other
+    // queue's lock, to avoid deadlocking with a CPU stealing from us.
+    // If this CPU goes idle without the lock, switch_to() arms the
+    // timer to try again.
+    run_queue &other_queue = m_run_queues[busiest];
+    util::spinlock::waiter waiter {false, nullptr, "steal_work"};
+    if (!other_queue.lock.try_acquire(&waiter)) {
+        my_queue.steal_missed = true;
+        return;
+    }
 
-        // Steal from most urgent queues first, don't steal idle threads
-        for (unsigned pri = 0; pri < idle_priority; ++pri)
-            stolen += balance_lists(my_queue.ready[pri], other_queue.ready[pri], cpu);
+    // Cap the number of threads moved in one pass, so a single
+    // burst of new threads isn't bounced around between CPUs. Prefer
+    // threads whose caches have gone cold, but an idle CPU will take
+    // any ready thread rather than stay idle.
+    size_t stolen = migrate_threads(my_queue, other_queue, cpu, now, max_migrations, false);
+    if (idle && !stolen)
+        stolen = migrate_threads(my_queue, other_queue, cpu, now, 1, true);
 
-        stolen += balance_lists(my_queue.blocked, other_queue.blocked, cpu);
-        other_queue_lock.release();
+    other_queue.lock.release(&waiter);
 
-        if (stolen)
-            log::verbose(logs::sched, "CPU%02x stole %2d tasks from CPU%02x",
-                    cpu.index, stolen, i);
+    if (stolen) {
+        my_queue.migrated += stolen;
+        log::verbose(logs::sched, "CPU%02x stole %2d tasks from CPU%02x",
+                cpu.index, stolen, busiest);
     }
 }
 
 void
-scheduler::schedule()
+scheduler::requeue_current(run_queue &queue, uint32_t remaining)
 {
-    cpu_data &cpu = current_cpu();
-    run_queue &queue = m_run_queues[cpu.index];
-    lapic &apic = *cpu.apic;
-
-    uint32_t remaining = apic.stop_timer();
-    uint64_t now = clock::get().value();
-
-    // We need to explicitly lock/unlock here instead of
-    // using a scoped lock, because the scope doesn't "end"
-    // for the current thread until it gets scheduled again,
-    // and _new_ threads start their life at the end of this
-    // function, which screws up RAII
-    util::spinlock::waiter waiter {false, nullptr, "schedule"};
-    queue.lock.acquire(&waiter);
-
-    // Only one CPU can be stealing at a time
-    if (m_steal_turn == cpu.index &&
-        now - queue.last_steal > steal_frequency) {
-        steal_work(cpu);
-        queue.last_steal = now;
-        m_steal_turn = (m_steal_turn + 1) % m_run_queues.count();
-    }
-
     queue.current->time_left = remaining;
     thread *th = queue.current->thread;
     uint8_t priority = queue.current->priority;
@@ -282,41 +559,66 @@ scheduler::schedule()
         queue.current->time_left += bonus;
     }
 
-    if (th->has_state(thread::state::ready)) {
-        queue.ready[queue.current->priority].push_back(queue.current);
+    if (th->has_state(thread::state::exited)) {
+        queue.exited.push_back(queue.current);
+    } else if (th->has_state(thread::state::ready)) {
+        queue.push_ready(queue.current);
     } else {
         queue.blocked.push_back(queue.current);
+
+        uint64_t timeout = th->wake_timeout();
+        if (timeout)
+            queue.sleepers.insert(queue.current, timeout);
     }
+}
 
-    clock::get().update();
-    prune(queue, now);
-    if (now - queue.last_promotion > promote_frequency)
-        check_promotions(queue, now);
+void
+scheduler::switch_to(cpu_data &cpu, run_queue &queue, TCB *t,
+        uint64_t now, util::spinlock::waiter &waiter)
+{
+    tcb_node *next = static_cast<tcb_node*>(t);
+    lapic &apic = *cpu.apic;
 
-    priority = 0;
-    while (queue.ready[priority].empty()) {
-        ++priority;
-        kassert(priority < num_priorities, "All runlists are empty");
+    // When idle, only wake for the next sleeping thread's timeout,
+    // or not at all. Other CPUs will send an IPI if work arrives.
+    // Timeouts further off than the timer can count wake early, and
+    // are re-armed from here by the next schedule(). If another CPU
+    // has ready threads this one failed to steal, it won't be sent an
+    // IPI for them, so wake soon to try again.
+    if (next->priority == idle_priority) {
+        uint64_t deadline = queue.sleepers.next_deadline();
+        uint64_t interval = 0;
+        if (deadline)
+            interval = deadline > now ? deadline - now : 1;
+        if (interval > lapic::max_interval())
+            interval = lapic::max_interval();
+        if (queue.steal_missed && (!interval || interval > idle_steal_micros))
+            interval = idle_steal_micros;
+        if (interval)
+            apic.reset_timer(interval);
+    } else {
+        apic.reset_timer(next->time_left);
     }
 
-    queue.current->last_ran = now;
-
-    auto *next = queue.ready[priority].pop_front();
-    next->last_ran = now;
-    apic.reset_timer(next->time_left);
+    __atomic_store_n(&queue.busy, next->priority != idle_priority, __ATOMIC_RELAXED);
+    queue.update_load();
 
     if (next == queue.current) {
         queue.lock.release(&waiter);
         return;
     }
 
-    queue.prev = queue.current->thread->obj_id();
+    ++queue.switches;
+    thread *th = queue.current->thread;
+    queue.prev = th->obj_id();
     thread *next_thread = next->thread;
 
     cpu.thread = next_thread;
     cpu.process = &next_thread->parent();
     queue.current = next;
 
+    uint64_t cr3 = tlb_switch_cr3(cpu, cpu.process->space(), next->pml4);
+
     log::spam(logs::sched, "CPU%02x switching threads %llx->%llx",
             cpu.index, th->koid(), next_thread->koid());
     log::spam(logs::sched, "    priority %d time left %d @ %lld.",
@@ -324,7 +626,125 @@ scheduler::schedule()
     log::spam(logs::sched, "    PML4 %llx", next->pml4);
 
     queue.lock.release(&waiter);
-    task_switch(queue.current);
+    task_switch(queue.current, cr3);
+}
+
+void
+scheduler::handoff(TCB *t)
+{
+    cpu_data &cpu = current_cpu();
+    run_queue &queue = m_run_queues[cpu.index];
+    tcb_node *next = static_cast<tcb_node*>(t);
+    thread *next_thread = next->thread;
+
+    util::spinlock::waiter waiter {false, nullptr, "handoff"};
+    queue.lock.acquire(&waiter);
+
+    // Our own queue is already locked, so as in steal_work, only try
+    // for the lock of the queue the thread is blocked on. As in
+    // lock_queue, check its CPU again once locked. A thread that is
+    // still current there is on its way to blocking, and is left to
+    // be woken normally.
+    cpu_data *from_cpu = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+    run_queue &from = m_run_queues[from_cpu->index];
+    util::spinlock::waiter from_waiter {false, nullptr, "handoff from"};
+    const bool same = &from == &queue;
+    const bool locked = same || from.lock.try_acquire(&from_waiter);
+
+    // Only switch directly if nothing more urgent is waiting here,
+    // otherwise the partner just becomes ready like any woken thread
+    const bool urgent = !queue.ready_mask.empty() &&
+        __builtin_ctz(queue.ready_mask.value()) < next->priority;
+
+    const bool direct = locked && !urgent &&
+        __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE) == from_cpu &&
+        next != from.current &&
+        next->priority != idle_priority &&
+        !next_thread->has_state(thread::state::ready) &&
+        !next_thread->has_state(thread::state::exited);
+
+    if (!direct) {
+        if (locked && !same)
+            from.lock.release(&from_waiter);
+        queue.lock.release(&waiter);
+
+        next_thread->wake_only();
+        schedule();
+        return;
+    }
+
+    from.blocked.remove(next);
+    from.sleepers.remove(next);
+    __atomic_store_n(&next->cpu, &cpu, __ATOMIC_RELEASE);
+    if (!same)
+        from.lock.release(&from_waiter);
+
+    next_thread->set_wake_timeout(0);
+    next_thread->set_state(thread::state::ready);
+
+    uint32_t remaining = cpu.apic->stop_timer();
+    uint64_t now = clock::get().value();
+
+    // Donate what is left of the current timeslice to the partner, so
+    // that a request and its response together use up one timeslice
+    if (remaining > next->time_left)
+        next->time_left = remaining;
+
+    requeue_current(queue, remaining);
+
+    ++queue.handoffs;
+    queue.current->last_ran = now;
+    next->last_ran = now;
+
+    switch_to(cpu, queue, next, now, waiter);
+}
+
+void
+scheduler::schedule()
+{
+    cpu_data &cpu = current_cpu();
+    run_queue &queue = m_run_queues[cpu.index];
+    lapic &apic = *cpu.apic;
+
+    uint32_t remaining = apic.stop_timer();
+    release_exited(queue);
+
+    uint64_t now = clock::get().value();
+    __atomic_store_n(&queue.kicked, false, __ATOMIC_RELEASE);
+
+    // We need to explicitly lock/unlock here instead of
+    // using a scoped lock, because the scope doesn't "end"
+    // for the current thread until it gets scheduled again,
+    // and _new_ threads start their life at the end of this
+    // function, which screws up RAII
+    util::spinlock::waiter waiter {false, nullptr, "schedule"};
+    queue.lock.acquire(&waiter);
+
+    requeue_current(queue, remaining);
+
+    clock::get().update();
+
+    // This CPU can only run one of the threads whose timeouts passed,
+    // and idle CPUs with stopped timers won't notice the rest
+    if (prune(queue, now) > 1)
+        kick_idle_cpu(cpu.index);
+    if (now - queue.last_promotion > promote_frequency)
+        check_promotions(queue, now);
+
+    // Steal immediately if this CPU would otherwise go idle,
+    // otherwise periodically rebalance with the busiest CPU
+    if (queue.ready_count == 0 ||
+        now - queue.last_steal > steal_frequency) {
+        steal_work(cpu, now);
+        queue.last_steal = now;
+    }
+
+    queue.current->last_ran = now;
+
+    auto *next = queue.pop_ready();
+    next->last_ran = now;
+
+    switch_to(cpu, queue, next, now, waiter);
 }
 
 void
@@ -334,10 +754,31 @@ scheduler::maybe_schedule(TCB *t)
     kassert(cpu, "thread with a null cpu");
 
     run_queue &queue = m_run_queues[cpu->index];
-    uint8_t current_pri = queue.current->priority;
-    if (current_pri <= t->priority)
+    tcb_node *current = __atomic_load_n(&queue.current, __ATOMIC_ACQUIRE);
+    if (current == t || current->priority <= t->priority)
         return;
 
-    current_cpu().apic->send_ipi(
-        lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+    kick_cpu(cpu->index);
+}
+
+size_t
+scheduler::get_stats(j6_run_queue_stats *stats, size_t count)
+{
+    const size_t cpus = m_run_queues.count();
+    for (size_t i = 0; i < count && i < cpus; ++i) {
+        run_queue &queue = m_run_queues[i];
+        util::scoped_lock lock {queue.lock};
+
+        j6_run_queue_stats &s = stats[i];
+        s.ready = queue.ready_count;
+        s.blocked = queue.blocked.length();
+        s.load = queue.load;
+        s.busy = queue.busy ? 1 : 0;
+        s.timer_interrupts = g_cpu_data[i]->timer_interrupts;
+        s.added = queue.added;
+        s.migrated = queue.migrated;
+        s.switches = queue.switches;
+        s.handoffs = queue.handoffs;
+    }
+    return cpus;
 }
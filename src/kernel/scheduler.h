@@ -2,7 +2,9 @@
 /// \file scheduler.h
 /// The task scheduler and related definitions
 
+#include <stddef.h>
 #include <stdint.h>
+#include <util/spinlock.h>
 #include <util/vector.h>
 
 extern cpu_data** g_cpu_data;
@@ -13,6 +15,7 @@ namespace args {
 }}
 
 struct cpu_data;
+struct j6_run_queue_stats;
 class lapic;
 struct page_table;
 struct run_queue;
@@ -47,6 +50,14 @@ public:
     /// How many quanta a process gets before being rescheduled
     static const uint16_t process_quanta = 10;
 
+    /// How long since a thread last ran that it is considered to still
+    /// have its working set in its CPU's cache, in us
+    static const uint64_t cache_hot_micros = quantum_micros;
+
+    /// How long an idle CPU that could not get at another CPU's ready
+    /// threads waits before trying again, in us
+    static const uint32_t idle_steal_micros = quantum_micros * 2;
+
     /// Constructor.
     /// \arg cpus  The number of CPUs to schedule for
     scheduler(unsigned cpus);
@@ -76,6 +87,16 @@ public:
     /// Run the scheduler, possibly switching to a new task
     void schedule();
 
+    /// Block the current thread and switch directly to a blocked partner
+    /// thread on this CPU, without going through the ready lists. The
+    /// partner also gets the rest of the current timeslice, if that is
+    /// more than it has left. If the partner can't be taken directly,
+    /// or a more urgent thread is waiting, the partner is woken normally
+    /// and the scheduler runs instead. The caller must already have
+    /// cleared the current thread's ready state.
+    /// \arg t  The partner thread's TCB
+    void handoff(TCB *t);
+
     /// Check if the CPU is running a more important task. If not,
     /// run the scheduler.
     void maybe_schedule(TCB *t);
@@ -84,6 +105,23 @@ public:
     /// \arg t  The new thread's TCB
     void add_thread(TCB *t);
 
+    /// Mark a thread as ready, and move it directly from its run
+    /// queue's blocked list to the ready list.
+    /// \arg t  The thread's TCB
+    void ready_thread(TCB *t);
+
+    /// Move an exited thread to its run queue's list of threads to be
+    /// released. If the thread is currently running, it is moved at
+    /// its next reschedule.
+    /// \arg t  The thread's TCB
+    void exit_thread(TCB *t);
+
+    /// Get statistics about each CPU's run queue.
+    /// \arg stats  [out] Array of stats structures, one per CPU
+    /// \arg count  The number of structures in `stats`
+    /// \returns    The number of CPUs being scheduled
+    size_t get_stats(j6_run_queue_stats *stats, size_t count);
+
     /// Get a reference to the scheduler
     /// \returns  A reference to the global system scheduler
     static scheduler & get() { return *s_instance; }
@@ -94,9 +132,60 @@ private:
     static constexpr uint64_t promote_frequency = 100;
     static constexpr uint64_t steal_frequency = 10;
 
-    void prune(run_queue &queue, uint64_t now);
+    /// Maximum number of threads to migrate in one steal_work pass
+    static constexpr size_t max_migrations = 4;
+
+    /// How much more loaded (as run_queue::load fixed point) the
+    /// creating CPU may be than the least loaded CPU and still have
+    /// new threads placed on it
+    static constexpr uint32_t placement_slack = 1 << 8;
+
+    /// Choose the CPU to place a new thread on.
+    cpu_data * pick_cpu();
+
+    /// Lock the run queue that currently owns the given thread.
+    /// \arg t       The thread's TCB
+    /// \arg waiter  The waiter to use to acquire the lock
+    /// \returns     The locked run queue
+    run_queue & lock_queue(TCB *t, util::spinlock::waiter &waiter);
+
+    /// Send a schedule IPI to a CPU, unless one is already pending.
+    /// \arg index  The index of the CPU to interrupt
+    void kick_cpu(unsigned index);
+
+    /// Send a schedule IPI to one idle CPU, so it may steal work.
+    /// \arg except  The index of a CPU not to interrupt
+    void kick_idle_cpu(unsigned except);
+
+    /// Put the current thread back on its run queue's lists, and
+    /// adjust its timeslice. The queue must be locked.
+    /// \arg queue      The current CPU's run queue
+    /// \arg remaining  The time left in the current thread's timeslice
+    void requeue_current(run_queue &queue, uint32_t remaining);
+
+    /// Switch to the given thread, and release the run queue lock.
+    /// \arg cpu     The current CPU
+    /// \arg queue   The current CPU's run queue, locked with `waiter`
+    /// \arg t       The TCB of the thread to run, which is not on the
+    ///              ready lists
+    /// \arg now     The current clock time
+    /// \arg waiter  The waiter used to lock `queue`
+    void switch_to(cpu_data &cpu, run_queue &queue, TCB *t,
+            uint64_t now, util::spinlock::waiter &waiter);
+
+    /// Wake threads whose timeouts have passed. The queue must be locked.
+    /// \arg queue  The current CPU's run queue
+    /// \arg now    The current clock time
+    /// \returns    The number of threads woken
+    size_t prune(run_queue &queue, uint64_t now);
+
+    /// Release the run queue's exited threads, other than the current
+    /// thread. The queue must not be locked, since releasing a thread
+    /// may destroy its process and send TLB shootdowns.
+    /// \arg queue  The current CPU's run queue
+    void release_exited(run_queue &queue);
     void check_promotions(run_queue &queue, uint64_t now);
-    void steal_work(cpu_data &cpu);
+    void steal_work(cpu_data &cpu, uint64_t now);
 
     uint32_t m_add_index;
     uint32_t m_tick_count;
@@ -105,7 +194,6 @@ private:
 
     util::vector<run_queue> m_run_queues;
 
-    unsigned m_steal_turn = 0;
     static scheduler *s_instance;
 };
 
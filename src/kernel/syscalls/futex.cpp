@@ -35,6 +35,21 @@ inline uint64_t & get_map_key(futex &f) { return f.address; }
 util::node_map<uintptr_t, futex> g_futexes;
 util::spinlock g_futexes_lock;
 
+namespace {
+
+// Futexes are keyed by physical address. A word on a shared page, like
+// a copy-on-write page or the zero page, moves to a new frame when it's
+// first written, so give it its own page first or wakers and waiters
+// would look up different futexes.
+uintptr_t
+futex_key(const uint32_t *value)
+{
+    uintptr_t address = reinterpret_cast<uintptr_t>(value);
+    return process::current().space().find_writable(address);
+}
+
+} // namespace
+
 j6_status_t
 futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
 {
@@ -46,12 +61,16 @@ futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
         return j6_status_futex_changed;
     }
 
-    uintptr_t address = reinterpret_cast<uintptr_t>(value);
-    vm_space &space = process::current().space();
-    uintptr_t phys = space.find_physical(address);
+    uintptr_t phys = futex_key(value);
 
     util::scoped_lock lock {g_futexes_lock};
 
+    // Check the value again under the lock, and join the queue before
+    // releasing it, so a waker that changes the value first can't miss
+    // this thread
+    if (*value != expected)
+        return j6_status_futex_changed;
+
     futex &f = g_futexes[phys];
 
     if (timeout) {
@@ -61,8 +80,8 @@ futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
 
     log::spam(logs::syscall, "<%02x:%02x> blocking on futex %lx", p.obj_id(), t.obj_id(), value);
 
-    lock.release();
-    f.queue.wait();
+    f.queue.add_thread(&t);
+    t.block(lock);
 
     log::spam(logs::syscall, "<%02x:%02x> woke on futex %lx", p.obj_id(), t.obj_id(), value);
     return j6_status_ok;
@@ -71,9 +90,7 @@ futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
 j6_status_t
 futex_wake(const uint32_t *value, size_t count)
 {
-    uintptr_t address = reinterpret_cast<uintptr_t>(value);
-    vm_space &space = process::current().space();
-    uintptr_t phys = space.find_physical(address);
+    uintptr_t phys = futex_key(value);
 
     util::scoped_lock lock {g_futexes_lock};
 
@@ -29,6 +29,28 @@ mailbox_close(mailbox *self)
     return j6_status_ok;
 }
 
+namespace {
+
+// Hand the handles and data of a received message back to the
+// current thread's syscall arguments
+void
+deliver(const ipc::message &message, uint64_t *tag, size_t *data_len,
+        j6_handle_t *out_handles, size_t *handles_count)
+{
+    for (unsigned i = 0; i < message.handle_count; ++i)
+        process::current().add_handle(message.handles[i]);
+
+    *tag = message.tag;
+    if (data_len)
+        *data_len = message.data.count;
+
+    size_t handles_min = *handles_count > message.handle_count ? message.handle_count : *handles_count;
+    *handles_count = handles_min;
+    memcpy(out_handles, message.handles, handles_min * sizeof(j6_handle_t));
+}
+
+} // namespace
+
 j6_status_t
 mailbox_call(
         mailbox *self,
@@ -39,33 +61,24 @@ mailbox_call(
         j6_handle_t *in_handles,
         size_t *handles_count)
 {
+    if (*handles_count > mailbox::max_handle_count)
+        return j6_err_invalid_arg;
+
     thread &cur = thread::current();
 
+    // The message data stays in this thread's buffer, which the
+    // receiver copies from and the reply is copied back into
     util::buffer data {in_data, data_in_len};
     util::counted<j6_handle_t> handles {in_handles, *handles_count};
 
-    ipc::message message(*tag, data, handles);
-    cur.set_message_data(util::move(message));
+    ipc::message &message = cur.message();
+    message = ipc::message {*tag, data, in_data ? *data_len : 0, handles};
 
     j6_status_t s = self->call();
     if (s != j6_status_ok)
         return s;
 
-    message = cur.get_message_data();
-
-    if (message.handles) {
-        for (unsigned i = 0; i < message.handles.count; ++i)
-            process::current().add_handle(message.handles[i]);
-    }
-
-    *tag = message.tag;
-    *data_len = *data_len > message.data.count ? message.data.count : *data_len;
-    memcpy(in_data, message.data.pointer, *data_len);
-
-    size_t handles_min = *handles_count > message.handles.count ? message.handles.count : *handles_count;
-    *handles_count = handles_min;
-    memcpy(in_handles, message.handles.pointer, handles_min * sizeof(j6_handle_t));
-
+    deliver(message, tag, data_len, in_handles, handles_count);
     return j6_status_ok;
 }
 
@@ -81,37 +94,48 @@ mailbox_respond(
         uint64_t *reply_tag,
         uint64_t flags)
 {
+    if (*handles_count > mailbox::max_handle_count)
+        return j6_err_invalid_arg;
+
     util::buffer data {in_data, data_in_len};
     util::counted<j6_handle_t> handles {in_handles, *handles_count};
 
-    ipc::message message(*tag, data, handles);
+    ipc::message message {*tag, data, in_data ? *data_len : 0, handles};
 
+    // The caller replied to is only woken by receive(), so that it can
+    // be switched to directly if this thread blocks
+    thread *replied = nullptr;
     if (*reply_tag) {
-        j6_status_t s = self->reply(*reply_tag, util::move(message));
+        j6_status_t s = self->reply(*reply_tag, message, &replied);
         if (s != j6_status_ok)
             return s;
     }
 
     bool block = flags & j6_flag_block;
-    j6_status_t s = self->receive(message, *reply_tag, block);
+    j6_status_t s = self->receive(message, *reply_tag, block, replied);
     if (s != j6_status_ok)
         return s;
 
-    if (message.handles) {
-        for (unsigned i = 0; i < message.handles.count; ++i)
-            process::current().add_handle(message.handles[i]);
-    }
-
-    *tag = message.tag;
-    *data_len = *data_len > message.data.count ? message.data.count : *data_len;
-    memcpy(in_data, message.data.pointer, *data_len);
+    deliver(message, tag, data_len, in_handles, handles_count);
+    return j6_status_ok;
+}
 
-    size_t handles_min = *handles_count > message.handles.count ? message.handles.count : *handles_count;
-    *handles_count = handles_min;
-    memcpy(in_handles, message.handles.pointer, handles_min * sizeof(j6_handle_t));
+j6_status_t
+mailbox_ring_attach(mailbox *self, uintptr_t ring, uint32_t entries)
+{
+    return self->ring_attach(ring, entries);
+}
 
-    return j6_status_ok;
+j6_status_t
+mailbox_ring_enter(mailbox *self, uintptr_t ring, size_t wait_count, size_t *submitted)
+{
+    return self->ring_enter(ring, wait_count, *submitted);
 }
 
+j6_status_t
+mailbox_ring_detach(mailbox *self, uintptr_t ring)
+{
+    return self->ring_detach(ring);
+}
 
 } // namespace syscalls
@@ -10,6 +10,7 @@
 #include "objects/thread.h"
 #include "objects/system.h"
 #include "objects/vm_area.h"
+#include "scheduler.h"
 #include "syscalls/helpers.h"
 
 extern log::logger &g_logger;
@@ -37,6 +38,19 @@ noop()
     return j6_status_ok;
 }
 
+j6_status_t
+sched_stats(j6_run_queue_stats *stats, size_t *stats_len)
+{
+    size_t requested = *stats_len;
+
+    *stats_len = scheduler::get().get_stats(stats, requested);
+
+    if (*stats_len > requested)
+        return j6_err_insufficient;
+
+    return j6_status_ok;
+}
+
 [[ noreturn ]] j6_status_t
 test_finish(uint32_t exit_code)
 {
@@ -25,7 +25,7 @@ thread_create(j6_handle_t *self, process *proc, uintptr_t stack_top, uintptr_t e
 
     *self = g_cap_table.create(child, thread::creation_caps);
 
-    child->set_state(thread::state::ready);
+    child->wake_only();
 
     log::verbose(logs::task, "Thread <%02lx:%02lx> spawned new thread <%02lx:%02lx>",
         parent_pr.obj_id(), parent_th.obj_id(), proc->obj_id(), child->obj_id());
@@ -48,8 +48,9 @@ vma_map(vm_area *self, process *proc, uintptr_t *base, uint32_t flags)
 j6_status_t
 vma_unmap(vm_area *self, process *proc)
 {
-    vm_space &space = proc ? proc->space() : process::current().space();
-    space.remove(self);
+    process &owner = proc ? *proc : process::current();
+    if (owner.space().remove(self))
+        owner.detach_rings(self);
     return j6_status_ok;
 }
 
@@ -64,6 +65,50 @@ vma_resize(vm_area *self, size_t *size)
     return j6_status_ok;
 }
 
+j6_status_t
+vma_advise(vm_area *self, uint32_t flags, size_t window)
+{
+    self->advise(flags, window);
+    return j6_status_ok;
+}
+
+j6_status_t
+vma_clone(vm_area *self, j6_handle_t *area, size_t offset, size_t size, uint32_t flags)
+{
+    util::bitset32 f = flags & vm_user_mask;
+    if (f.get(vm_flags::ring))
+        return j6_err_invalid_arg;
+
+    vm_area *clone = self->clone(offset, size, f);
+    if (!clone)
+        return j6_err_invalid_arg;
+
+    *area = g_cap_table.create(clone, vm_area::creation_caps);
+    process::current().add_handle(*area);
+    return j6_status_ok;
+}
+
+j6_status_t
+vma_protect(vm_area *self, uint32_t flags)
+{
+    if (flags & ~vm_protect_mask.value())
+        return j6_err_invalid_arg;
+
+    self->protect(flags);
+    return j6_status_ok;
+}
 
+j6_status_t
+vm_stats(j6_vm_space_stats *stats, size_t *stats_size)
+{
+    if (*stats_size < sizeof(j6_vm_space_stats)) {
+        *stats_size = sizeof(j6_vm_space_stats);
+        return j6_err_insufficient;
+    }
+
+    process::current().space().get_stats(*stats);
+    *stats_size = sizeof(j6_vm_space_stats);
+    return j6_status_ok;
+}
 
 } // namespace syscalls
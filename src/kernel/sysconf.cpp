@@ -1,9 +1,11 @@
 #include <j6/memutils.h>
 
 #include "kassert.h"
+#include "clock.h"
 #include "cpu.h"
 #include "frame_allocator.h"
 #include "memory.h"
+#include "page_table.h"
 #include "sysconf.h"
 
 struct kheader
@@ -26,6 +28,9 @@ extern kheader _kernel_header;
 system_config *g_sysconf = nullptr;
 uintptr_t g_sysconf_phys = 0;
 
+j6_clock_page *g_clock_page = nullptr;
+uintptr_t g_clock_page_phys = 0;
+
 constexpr size_t sysconf_pages = mem::bytes_to_pages(sizeof(system_config));
 
 void
@@ -33,9 +38,9 @@ sysconf_create()
 {
     auto &fa = frame_allocator::get();
 
-    size_t count = fa.allocate(sysconf_pages, &g_sysconf_phys);
+    bool allocated = fa.allocate_contiguous(sysconf_pages, 1, &g_sysconf_phys);
 
-    kassert(count == sysconf_pages,
+    kassert(allocated,
             "Could not get enough contiguous pages for sysconf");
 
     g_sysconf = mem::to_virtual<system_config>(g_sysconf_phys);
@@ -47,7 +52,14 @@ sysconf_create()
     g_sysconf->kernel_version_gitsha = _kernel_header.version_gitsha;
 
     g_sysconf->sys_page_size = mem::frame_size;
-    g_sysconf->sys_large_page_size = 0;
-    g_sysconf->sys_huge_page_size = 0;
+    g_sysconf->sys_large_page_size = page_table::entry_sizes[2];
+    g_sysconf->sys_huge_page_size = page_table::entry_sizes[1];
     g_sysconf->sys_num_cpus = g_num_cpus;
+
+    size_t count = fa.allocate(1, &g_clock_page_phys);
+    kassert(count == 1, "Could not get a page for the clock page");
+
+    g_clock_page = mem::to_virtual<j6_clock_page>(g_clock_page_phys);
+    memset(g_clock_page, 0, mem::frame_size);
+    clock::get().publish(g_clock_page);
 }
@@ -40,8 +40,7 @@ task_switch:
 	; Install next task's TCB
 	mov [gs:CPU_DATA.tcb], rdi     ; rdi: next TCB (function param)
 	mov rsp, [rdi + TCB.rsp]       ; next task's stack pointer
-	mov r14, 0x00003fffffffffff
-	and r14, [rdi + TCB.pml4]      ; r14: next task's pml4 (phys portion of address)
+	mov r14, rsi                   ; r14: CR3 value to load, or 0 (function param)
 
 	; Update syscall/interrupt rsp
 	mov rcx, [rdi + TCB.rsp0]      ; rcx: top of next task's kernel stack
@@ -70,9 +69,8 @@ task_switch:
 	mov [gs:CPU_DATA.rflags3], rcx
 
 	; check if we need to update CR3
-	mov rdx, cr3                   ; rdx: old CR3
-	cmp r14, rdx
-	je .no_cr3
+	test r14, r14
+	jz .no_cr3
 	mov cr3, r14
 .no_cr3:
 
@@ -0,0 +1,103 @@
+#include "kassert.h"
+#include "objects/thread.h"
+#include "timer_wheel.h"
+
+timer_wheel::timer_wheel() :
+    m_slots {nullptr},
+    m_cursor {0},
+    m_count {0}
+{
+}
+
+bool
+timer_wheel::contains(const TCB *t)
+{
+    return t->wake_pprev != nullptr;
+}
+
+uint64_t
+timer_wheel::deadline(const TCB *t)
+{
+    return t->wake_deadline;
+}
+
+TCB **
+timer_wheel::next_link(TCB *t)
+{
+    return &t->wake_next;
+}
+
+void
+timer_wheel::insert(TCB *t, uint64_t deadline)
+{
+    if (contains(t))
+        remove(t);
+
+    // Deadlines already in the past go in the next slot to be expired
+    uint64_t tick = deadline >> slot_shift;
+    if (tick < m_cursor)
+        tick = m_cursor;
+
+    TCB **head = &m_slots[tick % slot_count];
+
+    t->wake_deadline = deadline;
+    t->wake_next = *head;
+    t->wake_pprev = head;
+    if (*head)
+        (*head)->wake_pprev = &t->wake_next;
+    *head = t;
+
+    ++m_count;
+}
+
+void
+timer_wheel::remove(TCB *t)
+{
+    if (contains(t))
+        unlink(t);
+}
+
+void
+timer_wheel::unlink(TCB *t)
+{
+    kassert(m_count, "Unlinking from an empty timer_wheel");
+
+    *t->wake_pprev = t->wake_next;
+    if (t->wake_next)
+        t->wake_next->wake_pprev = t->wake_pprev;
+
+    t->wake_next = nullptr;
+    t->wake_pprev = nullptr;
+    --m_count;
+}
+
+uint64_t
+timer_wheel::next_deadline() const
+{
+    if (!m_count)
+        return 0;
+
+    // Look for the first slot with a deadline in the current
+    // rotation, which must hold the earliest deadline.
+    uint64_t earliest = -1ull;
+    for (unsigned i = 0; i < slot_count; ++i) {
+        uint64_t tick = m_cursor + i;
+        for (const TCB *t = m_slots[tick % slot_count]; t; t = t->wake_next) {
+            if ((t->wake_deadline >> slot_shift) <= tick && t->wake_deadline < earliest)
+                earliest = t->wake_deadline;
+        }
+
+        if (earliest != -1ull)
+            return earliest;
+    }
+
+    // Every deadline is more than a rotation away, check them all
+    for (unsigned i = 0; i < slot_count; ++i) {
+        for (const TCB *t = m_slots[i]; t; t = t->wake_next) {
+            if (t->wake_deadline < earliest)
+                earliest = t->wake_deadline;
+        }
+    }
+
+    return earliest;
+}
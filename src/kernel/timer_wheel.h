@@ -0,0 +1,90 @@
+#pragma once
+/// \file timer_wheel.h
+/// A hashed timing wheel of threads waiting on wake timeouts
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct TCB;
+
+/// Tracks TCBs that are blocked with a wake timeout. TCBs are bucketed
+/// into slots by deadline, so adding, removing, and expiring a TCB are
+/// all constant-time. The wheel is not internally locked, callers must
+/// hold the lock of the run queue that owns it.
+class timer_wheel
+{
+public:
+    /// Number of slots in the wheel
+    static constexpr unsigned slot_count = 256;
+
+    /// Width of each slot, as a power of two of clock units (us)
+    static constexpr unsigned slot_shift = 9;
+
+    timer_wheel();
+
+    /// Add a TCB to the wheel. If the TCB is already in the wheel,
+    /// it is moved to its new deadline.
+    /// \arg t         The TCB to add
+    /// \arg deadline  The clock time at which the TCB should wake
+    void insert(TCB *t, uint64_t deadline);
+
+    /// Remove a TCB from the wheel. Does nothing if the TCB
+    /// is not in the wheel.
+    /// \arg t  The TCB to remove
+    void remove(TCB *t);
+
+    /// Check if a TCB is currently in any wheel.
+    static bool contains(const TCB *t);
+
+    /// Remove all TCBs whose deadline is at or before `now` from the
+    /// wheel, passing each to the given callback.
+    /// \arg now  The current clock time
+    /// \arg fn   Callback with the signature `void fn(TCB *)`
+    template <typename Func>
+    void expire(uint64_t now, Func fn)
+    {
+        uint64_t tick = now >> slot_shift;
+        if (!m_count) {
+            m_cursor = tick;
+            return;
+        }
+
+        // Everything from before one full rotation ago hashes
+        // to a slot we're going to visit anyway
+        if (tick - m_cursor >= slot_count)
+            m_cursor = tick - (slot_count - 1);
+
+        while (m_count) {
+            TCB **link = &m_slots[m_cursor % slot_count];
+            while (*link) {
+                TCB *t = *link;
+                if (deadline(t) > now) {
+                    link = next_link(t);
+                    continue;
+                }
+
+                unlink(t);
+                fn(t);
+            }
+
+            if (m_cursor == tick) break;
+            ++m_cursor;
+        }
+    }
+
+    /// Get the earliest deadline of any TCB in the wheel.
+    /// \returns  The earliest deadline, or 0 if the wheel is empty
+    uint64_t next_deadline() const;
+
+    /// Get the number of TCBs in the wheel
+    inline size_t count() const { return m_count; }
+
+private:
+    static uint64_t deadline(const TCB *t);
+    static TCB ** next_link(TCB *t);
+    void unlink(TCB *t);
+
+    TCB *m_slots[slot_count];
+    uint64_t m_cursor;
+    size_t m_count;
+};
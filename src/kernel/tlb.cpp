@@ -0,0 +1,213 @@
+#include <util/spinlock.h>
+
+#include "apic.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "objects/process.h"
+#include "tlb.h"
+#include "vm_space.h"
+
+extern cpu_data **g_cpu_data;
+
+namespace {
+
+// With PCIDs, this CR3 bit keeps the new PCID's TLB entries
+constexpr uint64_t cr3_no_flush = 1ull << 63;
+constexpr uint64_t cr3_pcid_mask = 0xfff;
+
+// The shootdown currently being handled by other CPUs. Only one
+// shootdown is in flight at a time, serialized by g_shootdown_lock.
+struct shootdown_request
+{
+    const uintptr_t *pages; ///< Pages to invalidate
+    size_t count;           ///< Number of pages, or 0 to flush the whole TLB
+    bool global;            ///< If flushing the whole TLB, include global pages
+    uint64_t space;         ///< TLB id of the space, or 0 for the kernel space
+    uint64_t gen;           ///< The space's TLB generation after this request
+    uint32_t pending;       ///< Number of CPUs that have yet to finish
+};
+
+shootdown_request g_request;
+util::spinlock g_shootdown_lock;
+
+void
+invalidate(const uintptr_t *pages, size_t count, bool global)
+{
+    if (count) {
+        for (size_t i = 0; i < count; ++i) {
+            auto *addr = reinterpret_cast<const uint8_t *>(pages[i]);
+            asm volatile ( "invlpg %0" :: "m"(*addr) : "memory" );
+        }
+    } else if (global) {
+        // Toggling CR4.PGE flushes global pages as well
+        uint64_t cr4 = 0;
+        asm volatile ( "mov %%cr4, %0" : "=r"(cr4) );
+        asm volatile ( "mov %0, %%cr4" :: "r"(cr4 & ~(1ull << unsigned(cr4::PGE))) : "memory" );
+        asm volatile ( "mov %0, %%cr4" :: "r"(cr4) : "memory" );
+    } else {
+        // Reloading CR3 flushes only the current PCID's entries
+        uint64_t cr3 = 0;
+        asm volatile ( "mov %%cr3, %0" : "=r"(cr3) );
+        asm volatile ( "mov %0, %%cr3" :: "r"(cr3) : "memory" );
+    }
+}
+
+// After invalidating the request's pages for the current PCID, bring
+// its slot up to the request's generation, if it had all the
+// previous generations' changes already.
+void
+update_generation(cpu_data &cpu, const shootdown_request &req)
+{
+    if (!cpu.pcid || !req.space)
+        return;
+
+    pcid_slot &slot = cpu.pcids[cpu.pcid - 1];
+    if (slot.space == req.space && slot.gen + 1 == req.gen)
+        slot.gen = req.gen;
+}
+
+bool
+uses_space(cpu_data &cpu, const vm_space &space)
+{
+    // Every CPU has the kernel space mapped
+    if (space.is_kernel())
+        return true;
+
+    obj::process *p = __atomic_load_n(&cpu.process, __ATOMIC_ACQUIRE);
+    return p && &p->space() == &space;
+}
+
+} // namespace
+
+tlb_batch::tlb_batch(vm_space &space) :
+    m_space {space},
+    m_count {0}
+{
+}
+
+void
+tlb_batch::add(uintptr_t addr)
+{
+    // Past max_pages, only the count is kept, and the whole
+    // TLB will be flushed
+    if (m_count < max_pages)
+        m_pages[m_count] = addr;
+    ++m_count;
+}
+
+void
+tlb_batch::flush()
+{
+    if (!m_count)
+        return;
+
+    size_t count = m_count > max_pages ? 0 : m_count;
+    bool global = m_space.is_kernel();
+    m_count = 0;
+
+    // Don't get moved to another CPU, or hold up other CPUs by being
+    // preempted while holding the shootdown lock
+    uint64_t rflags;
+    asm volatile ("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+
+    cpu_data &me = current_cpu();
+
+    // Other CPUs may be shooting down entries on this CPU while it
+    // waits with interrupts disabled, so answer them while spinning
+    util::spinlock::waiter waiter {false, nullptr, "tlb_batch::flush"};
+    while (!g_shootdown_lock.try_acquire(&waiter)) {
+        tlb_shootdown_service();
+        asm volatile ( "pause" );
+    }
+
+    g_request.pages = m_pages;
+    g_request.count = count;
+    g_request.global = global;
+    g_request.space = global ? 0 : m_space.tlb_id();
+    __atomic_store_n(&g_request.pending, 0, __ATOMIC_RELEASE);
+
+    // Kernel pages are global, and so shared by every PCID. Other
+    // spaces start a new generation, under the lock so generations
+    // are flushed in order. CPUs not using the space now will see it
+    // when they switch to it, and flush any entries they kept.
+    if (!global)
+        g_request.gen = m_space.next_tlb_generation();
+
+    // Make sure the page table changes and new generation are visible
+    // before checking which CPUs are using the space. Any CPU that
+    // switches to it after this point sees the new generation.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (unsigned i = 0; g_cpu_data && i < g_num_cpus; ++i) {
+        cpu_data *cpu = g_cpu_data[i];
+        if (!cpu || cpu == &me || !uses_space(*cpu, m_space))
+            continue;
+
+        __atomic_add_fetch(&g_request.pending, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&cpu->tlb_shootdown, 1, __ATOMIC_RELEASE);
+        me.apic->send_ipi(lapic::ipi_fixed, isr::ipiShootdown, cpu->id);
+    }
+
+    invalidate(m_pages, count, global);
+    update_generation(me, g_request);
+
+    while (__atomic_load_n(&g_request.pending, __ATOMIC_ACQUIRE))
+        asm volatile ( "pause" );
+
+    g_shootdown_lock.release(&waiter);
+
+    if (rflags & 0x200)
+        asm volatile ("sti" ::: "memory");
+}
+
+void
+tlb_shootdown_service()
+{
+    cpu_data &cpu = current_cpu();
+    if (!__atomic_exchange_n(&cpu.tlb_shootdown, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    invalidate(g_request.pages, g_request.count, g_request.global);
+    update_generation(cpu, g_request);
+    __atomic_sub_fetch(&g_request.pending, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+tlb_switch_cr3(cpu_data &cpu, const vm_space &space, uintptr_t pml4)
+{
+    uint64_t cr3 = 0;
+    asm volatile ( "mov %%cr3, %0" : "=r"(cr3) );
+
+    if (!cpu.features[cpu::feature::pcid])
+        return (cr3 & ~cr3_pcid_mask) == pml4 ? 0 : pml4;
+
+    // Make sure the CPU's new process is visible before reading the
+    // space's generation. Either a concurrent tlb_batch::flush() sees
+    // this CPU using the space and sends it a shootdown, or this CPU
+    // sees the new generation here.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t id = space.tlb_id();
+    uint64_t gen = space.tlb_generation();
+
+    unsigned slot = 0;
+    while (slot < cpu_pcid_slots && cpu.pcids[slot].space != id)
+        ++slot;
+
+    bool fresh = slot < cpu_pcid_slots && cpu.pcids[slot].gen == gen;
+    if (slot == cpu_pcid_slots) {
+        // Recycle PCIDs round-robin. The new space's first load of CR3
+        // flushes whatever the previous space left behind.
+        slot = cpu.pcid_next;
+        cpu.pcid_next = (slot + 1) % cpu_pcid_slots;
+        cpu.pcids[slot].space = id;
+    }
+
+    cpu.pcids[slot].gen = gen;
+    cpu.pcid = slot + 1; // PCID 0 is left for boot
+
+    uint64_t value = pml4 | cpu.pcid;
+    if (!fresh)
+        return value;
+
+    return value == cr3 ? 0 : value | cr3_no_flush;
+}
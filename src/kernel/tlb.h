@@ -0,0 +1,60 @@
+#pragma once
+/// \file tlb.h
+/// Batched TLB invalidation, including shootdowns on other CPUs
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cpu_data;
+class vm_space;
+
+/// Collects the virtual addresses of mappings that have been changed
+/// or removed, so that their TLB entries can be invalidated together
+/// on every CPU that may be caching them.
+class tlb_batch
+{
+public:
+    /// Above this many pages, flush the whole TLB instead of
+    /// invalidating pages one at a time.
+    static constexpr size_t max_pages = 32;
+
+    /// Constructor.
+    /// \arg space  The address space the mappings belong to
+    tlb_batch(vm_space &space);
+
+    /// Add a page to the batch. Any size of page needs only one entry.
+    /// \arg addr  The virtual address of the page
+    void add(uintptr_t addr);
+
+    /// Check if the batch has any pages to invalidate
+    inline bool empty() const { return !m_count; }
+
+    /// Invalidate the batch's pages on this CPU and send one shootdown
+    /// IPI to each other CPU using the space, waiting for them all to
+    /// finish. CPUs that are not using the space but may still have
+    /// its entries tagged with a PCID flush them when next switching
+    /// to it. Must not be called with any spinlocks held, as the
+    /// other CPUs may be waiting on them with interrupts disabled.
+    void flush();
+
+private:
+    vm_space &m_space;
+    size_t m_count;
+    uintptr_t m_pages[max_pages];
+};
+
+/// Handle a pending TLB shootdown request on the current CPU, if
+/// there is one. Called from the shootdown IPI handler.
+void tlb_shootdown_service();
+
+/// Get the value to load into CR3 to switch the current CPU to an
+/// address space. With PCIDs, each CPU keeps the TLB entries of its
+/// most recently used spaces, and only flushes them when switching
+/// back if the space's mappings have changed since. The caller must
+/// have already set the CPU's current process, and have interrupts
+/// disabled until CR3 is loaded.
+/// \arg cpu    The current CPU
+/// \arg space  The address space being switched to
+/// \arg pml4   The physical address of the space's PML4
+/// \returns    The value to load into CR3, or 0 if it is already loaded
+uint64_t tlb_switch_cr3(cpu_data &cpu, const vm_space &space, uintptr_t pml4);
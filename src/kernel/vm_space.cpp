@@ -1,6 +1,7 @@
 #include <j6/memutils.h>
 #include <arch/memory.h>
 
+#include "cpu.h"
 #include "kassert.h"
 #include "frame_allocator.h"
 #include "logger.h"
@@ -9,16 +10,21 @@
 #include "objects/thread.h"
 #include "objects/vm_area.h"
 #include "sysconf.h"
+#include "tlb.h"
 #include "vm_space.h"
 
 using obj::vm_flags;
 
-// The initial memory for the array of areas for the kernel space
+// The initial memory for the arrays of areas for the kernel space
 static constexpr size_t num_kernel_areas = 8;
 static uint64_t kernel_areas[num_kernel_areas * 2];
+static uint64_t kernel_area_bases[num_kernel_areas * 2];
 
 static constexpr uint64_t locked_page_tag = 0xbadfe11a;
 
+// TLB ids start at 1, so that 0 can mean an unused PCID slot
+static uint64_t next_tlb_id = 1;
+
 int
 vm_space::area::compare(const vm_space::area &o) const
 {
@@ -33,16 +39,37 @@ vm_space::area::operator==(const vm_space::area &o) const
     return o.base == base && o.area == area;
 }
 
+int
+vm_space::area_base::compare(const vm_space::area_base &o) const
+{
+    if (area > o.area) return 1;
+    else if (area < o.area) return -1;
+    else return 0;
+}
+
 
 // Kernel address space contsructor
 vm_space::vm_space(page_table *p) :
     m_kernel {true},
     m_pml4 {p},
-    m_areas {reinterpret_cast<vm_space::area*>(kernel_areas), 0, num_kernel_areas}
+    m_tlb_id {__atomic_fetch_add(&next_tlb_id, 1, __ATOMIC_RELAXED)},
+    m_tlb_gen {0},
+    m_areas {reinterpret_cast<vm_space::area*>(kernel_areas), 0, num_kernel_areas},
+    m_bases {reinterpret_cast<vm_space::area_base*>(kernel_area_bases), 0, num_kernel_areas},
+    m_faults {0},
+    m_pages_faulted {0},
+    m_tables_allocated {0},
+    m_tables_freed {0}
 {}
 
 vm_space::vm_space() :
-    m_kernel {false}
+    m_kernel {false},
+    m_tlb_id {__atomic_fetch_add(&next_tlb_id, 1, __ATOMIC_RELAXED)},
+    m_tlb_gen {0},
+    m_faults {0},
+    m_pages_faulted {0},
+    m_tables_allocated {0},
+    m_tables_freed {0}
 {
     m_pml4 = page_table::get_table_page();
     page_table *kpml4 = kernel_space().m_pml4;
@@ -51,13 +78,23 @@ vm_space::vm_space() :
     for (unsigned i = arch::kernel_root_index; i < arch::table_entries; ++i)
         m_pml4->entries[i] = kpml4->entries[i];
 
-    // Every vm space has sysconf in it
+    // Every vm space has sysconf in it. Its pages are shared by every
+    // space and owned by the kernel, so mark the area mmio to keep
+    // them from being freed along with the area.
     obj::vm_area *sysc = new obj::vm_area_fixed(
             g_sysconf_phys,
             sizeof(system_config),
-            0);
+            util::bitset32::of(vm_flags::mmio));
 
     add(sysconf_user_address, sysc, util::bitset32::of(vm_flags::exact));
+
+    // ...and the clock page
+    obj::vm_area *clk = new obj::vm_area_fixed(
+            g_clock_page_phys,
+            sizeof(j6_clock_page),
+            util::bitset32::of(vm_flags::mmio));
+
+    add(clock_user_address, clk, util::bitset32::of(vm_flags::exact));
 }
 
 vm_space::~vm_space()
@@ -86,11 +123,19 @@ vm_space::add(uintptr_t base, obj::vm_area *area, util::bitset32 flags)
     if (!base)
         base = min_auto_address;
 
+    // Areas backed by large pages need their base aligned to use them
+    bool exact = flags.get(vm_flags::exact);
+    uintptr_t align = exact ? 1 : area->page_size();
+    base = (base + align - 1) & ~(align - 1);
+
     uintptr_t end = base + area->size();
 
-    //TODO: optimize find/insert
-    bool exact = flags.get(vm_flags::exact);
-    for (size_t i = 0; i < m_areas.count(); ++i) {
+    // Start at the last area that could overlap, and move past any
+    // areas in the way
+    size_t i = find_index(base);
+    if (i == m_areas.count()) i = 0;
+
+    for (; i < m_areas.count(); ++i) {
         const vm_space::area &a = m_areas[i];
         uintptr_t aend = a.base + a.area->size();
         if (base >= aend)
@@ -100,11 +145,13 @@ vm_space::add(uintptr_t base, obj::vm_area *area, util::bitset32 flags)
             break;
         else if (exact)
             return 0;
-        else
-            base = aend;
+
+        base = (aend + align - 1) & ~(align - 1);
+        end = base + area->size();
     }
 
-    m_areas.sorted_insert({base, area});
+    m_areas.insert(i, {base, area});
+    m_bases.sorted_insert({area, base});
     area->add_to(this);
     area->handle_retain();
     return base;
@@ -121,29 +168,27 @@ vm_space::remove_area(obj::vm_area *area)
 bool
 vm_space::remove(obj::vm_area *area)
 {
-    for (auto &a : m_areas) {
-        if (a.area == area) {
-            remove_area(area);
-            m_areas.remove(a);
-            return true;
-        }
-    }
-    return false;
+    size_t bi = find_base_index(area);
+    if (bi == m_bases.count())
+        return false;
+
+    uintptr_t base = m_bases[bi].base;
+    remove_area(area);
+
+    m_bases.remove_at(bi);
+    size_t i = find_index(base);
+    while (m_areas[i].area != area) --i;
+    m_areas.remove_at(i);
+    return true;
 }
 
 bool
 vm_space::can_resize(const obj::vm_area &vma, size_t size) const
 {
     uintptr_t base = 0;
-    unsigned n = m_areas.count();
-    for (unsigned i = 1; i < n - 1; ++i) {
-        const area &prev = m_areas[i - 1];
-        if (prev.area != &vma)
-            continue;
-
-        base = prev.base;
-        const area &next = m_areas[i];
-        if (prev.base + size > next.base)
+    if (find_vma(vma, base)) {
+        size_t i = find_index(base) + 1;
+        if (i < m_areas.count() && base + size > m_areas[i].base)
             return false;
     }
 
@@ -154,28 +199,62 @@ vm_space::can_resize(const obj::vm_area &vma, size_t size) const
     return end <= space_end;
 }
 
+size_t
+vm_space::find_index(uintptr_t addr) const
+{
+    // Binary search for the first area starting after addr
+    size_t start = 0;
+    size_t end = m_areas.count();
+    while (end > start) {
+        size_t m = start + (end - start) / 2;
+        if (m_areas[m].base > addr) end = m;
+        else start = m + 1;
+    }
+
+    return start ? start - 1 : m_areas.count();
+}
+
+size_t
+vm_space::find_base_index(const obj::vm_area *vma) const
+{
+    // Binary search for the first entry for this area
+    size_t start = 0;
+    size_t end = m_bases.count();
+    while (end > start) {
+        size_t m = start + (end - start) / 2;
+        if (m_bases[m].area < vma) start = m + 1;
+        else end = m;
+    }
+
+    if (start < m_bases.count() && m_bases[start].area == vma)
+        return start;
+    return m_bases.count();
+}
+
 obj::vm_area *
 vm_space::get(uintptr_t addr, uintptr_t *base)
 {
-    for (auto &a : m_areas) {
-        uintptr_t end = a.base + a.area->size();
-        if (addr >= a.base && addr < end) {
-            if (base) *base = a.base;
-            return a.area;
-        }
-    }
-    return nullptr;
+    size_t i = find_index(addr);
+    if (i == m_areas.count())
+        return nullptr;
+
+    const area &a = m_areas[i];
+    if (addr >= a.base + a.area->size())
+        return nullptr;
+
+    if (base) *base = a.base;
+    return a.area;
 }
 
 bool
 vm_space::find_vma(const obj::vm_area &vma, uintptr_t &base) const
 {
-    for (auto &a : m_areas) {
-        if (a.area != &vma) continue;
-        base = a.base;
-        return true;
-    }
-    return false;
+    size_t i = find_base_index(&vma);
+    if (i == m_bases.count())
+        return false;
+
+    base = m_bases[i].base;
+    return true;
 }
 
 void
@@ -187,7 +266,7 @@ vm_space::copy_from(const vm_space &source, const obj::vm_area &vma)
         return;
 
     size_t count = mem::page_count(vma.size());
-    page_table::iterator dit {to, m_pml4};
+    page_table::iterator dit {to, m_pml4, &m_tables_allocated};
     page_table::iterator sit {from, source.m_pml4};
 
     while (count--) {
@@ -199,36 +278,191 @@ vm_space::copy_from(const vm_space &source, const obj::vm_area &vma)
     }
 }
 
-void
-vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, size_t count)
+bool
+vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, size_t count, page_table::level lv)
 {
-    using mem::frame_size;
     util::scoped_lock lock {m_lock};
 
     uintptr_t base = 0;
     if (!find_vma(vma, base))
-        return;
+        return false;
+
+    bool large = lv != page_table::level::pt;
+    size_t page_size = page_table::entry_sizes[unsigned(lv)];
 
     uintptr_t virt = base + offset;
     util::bitset64 flags =
         page_flags::present |
-        (m_kernel ? page_flags::none : page_flags::user) |
+        (m_kernel ? page_flags::global : page_flags::user) |
+        (large ? page_flags::page : page_flags::none) |
         (vma.flags().get(vm_flags::write) ? page_flags::write : page_flags::none) |
-        (vma.flags().get(vm_flags::write_combine) ? page_flags::wc : page_flags::none);
+        (vma.flags().get(vm_flags::exec) ? page_flags::none : page_flags::nx);
 
-    page_table::iterator it {virt, m_pml4};
+    if (vma.flags().get(vm_flags::write_combine))
+        flags |= large ? page_flags::wc_lg : page_flags::wc;
+
+    page_table::iterator it {virt, m_pml4, &m_tables_allocated};
 
     for (size_t i = 0; i < count; ++i) {
-        uint64_t &entry = it.entry(page_table::level::pt);
-        entry = (phys + i * frame_size) | flags;
+        uint64_t &entry = it.entry(lv);
+        if (large && (entry & 1) && !(entry & page_flags::page))
+            return false;
+
+        entry = (phys + i * page_size) | flags;
         log::spam(logs::paging, "Setting entry for %016llx: %016llx [%04llx]",
-                it.vaddress(), (phys + i * frame_size), flags.value());
-        ++it;
+                it.vaddress(), (phys + i * page_size), flags.value());
+        it.next(lv + 1);
     }
+
+    return true;
 }
 
+size_t
+vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, const uintptr_t *phys, size_t count,
+        uint64_t gen)
+{
+    util::scoped_lock lock {m_lock};
+
+    uintptr_t base = 0;
+    if (!find_vma(vma, base))
+        return 0;
+
+    uintptr_t virt = base + offset;
+    util::bitset64 flags =
+        page_flags::present |
+        (m_kernel ? page_flags::global : page_flags::user) |
+        (vma.flags().get(vm_flags::write) ? page_flags::write : page_flags::none) |
+        (vma.flags().get(vm_flags::exec) ? page_flags::none : page_flags::nx) |
+        (vma.flags().get(vm_flags::write_combine) ? page_flags::wc : page_flags::none);
+
+    // A clone clears the area's mappings under this lock after changing
+    // the generation, so either it clears these pages after they're
+    // mapped here, or the change is seen here
+    const bool stale = vma.share_generation() != gen;
+
+    page_table::iterator it {virt, m_pml4, &m_tables_allocated};
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; ++i, ++it) {
+        uint64_t &entry = it.entry(page_table::level::pt);
+        if (!phys[i] || entry)
+            continue;
+
+        // Shared pages are mapped read-only, to be copied on write
+        entry = (phys[i] & ~obj::vm_area::page_shared) | flags;
+        if (stale || (phys[i] & obj::vm_area::page_shared))
+            entry &= ~page_flags::write.value();
+        ++mapped;
+    }
+
+    log::spam(logs::paging, "Mapped %d of %d pages at %016llx [%04llx]",
+            mapped, count, virt, flags.value());
+    return mapped;
+}
+
+// Replace a large or huge page entry with a table of the next smaller
+// size of pages mapping the same memory, so that part of it can be
+// unmapped.
+static void
+split_large_page(page_table::iterator &it, page_table::level lv, uint64_t &tables)
+{
+    using level = page_table::level;
+
+    uint64_t &entry = it.entry(lv);
+    uint64_t pat2_lg = page_flags::pat2_lg.value();
+    uint64_t phys = entry & page_table::address_mask &
+        ~(page_table::entry_sizes[unsigned(lv)] - 1) & ~pat2_lg;
+    uint64_t flags = entry & (0xfff | page_flags::nx.value());
+
+    level child = lv + 1;
+    if (child == level::pt) {
+        // The large page bit becomes the PAT selector bit 2 on PT entries
+        flags &= ~page_flags::page.value();
+        if (entry & pat2_lg)
+            flags |= page_flags::pat2.value();
+    } else {
+        flags |= entry & pat2_lg;
+    }
+
+    size_t child_size = page_table::entry_sizes[unsigned(child)];
+    page_table *table = page_table::get_table_page();
+    __atomic_add_fetch(&tables, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < arch::table_entries; ++i)
+        table->entries[i] = (phys + i * child_size) | flags;
+
+    uint64_t table_flags = (page_flags::present | page_flags::write).value() |
+        (flags & page_flags::user.value());
+
+    entry = (reinterpret_cast<uintptr_t>(table) & ~mem::linear_offset) | table_flags;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+namespace {
+
+// A run of physical frames to be freed once their TLB entries have
+// been shot down
+struct frame_run
+{
+    uintptr_t start;
+    size_t count;
+};
+
+static constexpr size_t static_frame_runs = 8;
+static constexpr size_t static_freed_tables = 8;
+
 void
-vm_space::clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free)
+add_frame_run(util::vector<frame_run> &runs, uintptr_t phys, size_t count)
+{
+    if (runs.count()) {
+        frame_run &last = runs[runs.count() - 1];
+        if (phys == last.start + last.count * mem::frame_size) {
+            last.count += count;
+            return;
+        }
+    }
+    runs.append({phys, count});
+}
+
+// Unlink the tables below `table` that cover [start, end) and no longer
+// map anything, adding them to `freed`. Their pages can't be reused until
+// the batch is flushed, as other CPUs may still be caching them.
+// \returns  True if `table` itself no longer maps anything
+bool
+reclaim_tables(page_table *table, page_table::level lv, uintptr_t table_base,
+        uintptr_t start, uintptr_t end, tlb_batch &batch, util::vector<page_table*> &freed)
+{
+    if (lv != page_table::level::pt) {
+        size_t entry_size = page_table::entry_sizes[unsigned(lv)];
+        size_t first = start > table_base ? (start - table_base) / entry_size : 0;
+        size_t last = (end - table_base + entry_size - 1) / entry_size;
+        if (last > arch::table_entries)
+            last = arch::table_entries;
+
+        for (size_t i = first; i < last; ++i) {
+            if (!table->is_present(i) || table->is_large_page(lv, i))
+                continue;
+
+            uintptr_t child_base = table_base + i * entry_size;
+            page_table *child = table->get(i);
+            if (!reclaim_tables(child, lv + 1, child_base, start, end, batch, freed))
+                continue;
+
+            table->entries[i] = 0;
+            batch.add(child_base);
+            freed.append(child);
+        }
+    }
+
+    for (unsigned i = 0; i < arch::table_entries; ++i)
+        if (table->entries[i])
+            return false;
+    return true;
+}
+
+} // namespace
+
+void
+vm_space::clear(const obj::vm_area &vma, uintptr_t offset, size_t count)
 {
     using mem::frame_size;
     util::scoped_lock lock {m_lock};
@@ -238,38 +472,64 @@ vm_space::clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool fr
         return;
 
     uintptr_t addr = base + offset;
-    uintptr_t free_start = 0;
-    size_t free_count = 0;
+    uintptr_t end = addr + count * frame_size;
+
+    // Tables can't be freed until no CPU can reach them through a
+    // stale TLB entry, so collect them until the batch is flushed
+    page_table *tables_static[static_freed_tables];
+    util::vector<page_table*> tables {tables_static, 0, static_freed_tables};
+    tlb_batch batch {*this};
+
+    page_table::iterator it {addr, m_pml4, &m_tables_allocated};
+
+    while (count) {
+        // Find the entry mapping this address, which may be a large page,
+        // or a missing table we can skip over entirely
+        page_table::level lv = it.page_level();
+        size_t entry_size = page_table::entry_sizes[unsigned(lv)];
+        size_t entry_pages = entry_size / frame_size;
+        size_t skipped = (it.vaddress() & (entry_size - 1)) / frame_size;
+
+        if (lv != page_table::level::pt) {
+            if (!(it.entry(lv) & 1)) {
+                size_t pages = entry_pages - skipped;
+                if (pages >= count) break;
+                count -= pages;
+                it.next(lv + 1);
+                continue;
+            }
 
-    frame_allocator &fa = frame_allocator::get();
-    page_table::iterator it {addr, m_pml4};
+            if (skipped || entry_pages > count) {
+                // Only part of this large page is being cleared
+                split_large_page(it, lv, m_tables_allocated);
+                continue;
+            }
+        }
 
-    while (count--) {
-        uint64_t &e = it.entry(page_table::level::pt);
-        uintptr_t phys = e & ~0xfffull;
+        // Swap the entry out atomically, so that the accessed flag
+        // can't be set by another CPU after it's read
+        uint64_t e = __atomic_exchange_n(&it.entry(lv), 0, __ATOMIC_ACQ_REL);
         util::bitset64 flags = e;
 
-        if (flags & page_flags::present) {
-            e = 0;
-            if (flags & page_flags::accessed) {
-                auto *addr = reinterpret_cast<const uint8_t *>(it.vaddress());
-                asm ( "invlpg %0" :: "m"(*addr) : "memory" );
-            }
-            if (free_count && phys == free_start + (free_count * frame_size)) {
-                ++free_count;
-            } else {
-                if (free && free_count)
-                    fa.free(free_start, free_count);
-                free_start = phys;
-                free_count = 1;
-            }
-        }
+        // Entries that were never accessed can't be in any TLB
+        if ((flags & page_flags::present) && (flags & page_flags::accessed))
+            batch.add(it.vaddress());
 
-        ++it;
+        count -= entry_pages;
+        it.next(lv + 1);
     }
 
-    if (free && free_count)
-        fa.free(free_start, free_count);
+    // The kernel's top-level entries are copied into every space, so
+    // its tables are never reclaimed
+    if (!m_kernel)
+        reclaim_tables(m_pml4, page_table::level::pml4, 0, addr, end, batch, tables);
+
+    lock.release();
+    batch.flush();
+
+    for (auto *table : tables)
+        page_table::free_table_page(table);
+    __atomic_add_fetch(&m_tables_freed, tables.count(), __ATOMIC_RELAXED);
 }
 
 void
@@ -284,24 +544,92 @@ vm_space::lock(const obj::vm_area &vma, uintptr_t offset, size_t count)
 
     uintptr_t addr = base + offset;
 
-    frame_allocator &fa = frame_allocator::get();
-    page_table::iterator it {addr, m_pml4};
+    frame_run runs_static[static_frame_runs];
+    util::vector<frame_run> runs {runs_static, 0, static_frame_runs};
+    tlb_batch batch {*this};
+
+    page_table::iterator it {addr, m_pml4, &m_tables_allocated};
 
     while (count--) {
         uint64_t &e = it.entry(page_table::level::pt);
-        uintptr_t phys = e & ~0xfffull;
-        util::bitset64 flags = e;
 
-        if (flags & page_flags::present) {
-            e = locked_page_tag;
-            if (flags & page_flags::accessed) {
-                auto *addr = reinterpret_cast<const uint8_t *>(it.vaddress());
-                asm ( "invlpg %0" :: "m"(*addr) : "memory" );
-            }
-            fa.free(phys, 1);
+        if (e & page_flags::present) {
+            uint64_t old = __atomic_exchange_n(&e, locked_page_tag, __ATOMIC_ACQ_REL);
+            if (old & page_flags::accessed)
+                batch.add(it.vaddress());
+            add_frame_run(runs, old & page_table::address_mask, 1);
         }
         ++it;
     }
+
+    lock.release();
+    batch.flush();
+
+    frame_allocator &fa = frame_allocator::get();
+    for (auto &run : runs)
+        fa.free(run.start, run.count);
+}
+
+void
+vm_space::protect(const obj::vm_area &vma)
+{
+    using mem::frame_size;
+    util::scoped_lock lock {m_lock};
+
+    uintptr_t base = 0;
+    if (!find_vma(vma, base))
+        return;
+
+    bool write = vma.flags().get(vm_flags::write);
+    bool exec = vma.flags().get(vm_flags::exec);
+
+    tlb_batch batch {*this};
+    page_table::iterator it {base, m_pml4, &m_tables_allocated};
+
+    size_t count = (vma.size() + frame_size - 1) / frame_size;
+    while (count) {
+        page_table::level lv = it.page_level();
+        size_t entry_size = page_table::entry_sizes[unsigned(lv)];
+        size_t entry_pages = entry_size / frame_size;
+        size_t skipped = (it.vaddress() & (entry_size - 1)) / frame_size;
+        size_t pages = entry_pages - skipped;
+
+        uint64_t &e = it.entry(lv);
+        uint64_t old = __atomic_load_n(&e, __ATOMIC_ACQUIRE);
+        while (old & page_flags::present) {
+            uint64_t entry = old;
+            if (exec)
+                entry &= ~page_flags::nx.value();
+            else
+                entry |= page_flags::nx.value();
+
+            // Pages can't just be made writable here, as they may be
+            // shared copy-on-write. Unmap them instead, and let the
+            // next fault map them back in with the new permissions.
+            if (!write)
+                entry &= ~page_flags::write.value();
+            else if (!(old & page_flags::write))
+                entry = 0;
+
+            if (entry == old)
+                break;
+
+            // The CPU may set the accessed or dirty flags at any time
+            if (__atomic_compare_exchange_n(&e, &old, entry, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                if (old & page_flags::accessed)
+                    batch.add(it.vaddress());
+                break;
+            }
+        }
+
+        if (pages >= count) break;
+        count -= pages;
+        it.next(lv + 1);
+    }
+
+    lock.release();
+    batch.flush();
 }
 
 uintptr_t
@@ -326,7 +654,9 @@ vm_space::activate() const
 {
     constexpr uint64_t phys_mask = ~mem::linear_offset & ~0xfffull;
     uintptr_t p = reinterpret_cast<uintptr_t>(m_pml4) & phys_mask;
-    __asm__ __volatile__ ( "mov %0, %%cr3" :: "r" (p) );
+    uint64_t cr3 = tlb_switch_cr3(current_cpu(), *this, p);
+    if (cr3)
+        __asm__ __volatile__ ( "mov %0, %%cr3" :: "r" (cr3) );
 }
 
 void
@@ -340,11 +670,14 @@ vm_space::initialize_tcb(TCB &tcb)
 bool
 vm_space::handle_fault(uintptr_t addr, util::bitset8 fault)
 {
+    uintptr_t page = (addr & ~0xfffull);
+
     // TODO: Handle more fult types
-    if (fault.get(fault_type::present))
+    if (fault.get(fault_type::present)) {
+        if (fault.get(fault_type::write))
+            return handle_write_fault(page);
         return false;
-
-    uintptr_t page = (addr & ~0xfffull);
+    }
 
     uintptr_t base = 0;
     obj::vm_area *area = get(addr, &base);
@@ -359,32 +692,253 @@ vm_space::handle_fault(uintptr_t addr, util::bitset8 fault)
             return false;
     }
 
+    __atomic_add_fetch(&m_faults, 1, __ATOMIC_RELAXED);
+
     uintptr_t offset = page - base;
+    if (area->page_size() == mem::frame_size) {
+        // Map a window of neighbouring pages along with the faulting one
+        uintptr_t first = offset;
+        size_t count = fault_window(*area, base, offset, first);
+
+        // Pages of user areas that are only being read can share the
+        // zero page. Kernel pages are never copied on write, as the
+        // fault could be on the stack the copy would need.
+        bool zero = !m_kernel && !fault.get(fault_type::write);
+
+        uintptr_t phys[obj::vm_area::max_fault_window];
+        uint64_t gen = area->share_generation();
+        area->get_pages(first, count, phys, zero);
+        if (!phys[(offset - first) / mem::frame_size])
+            return false;
+
+        size_t mapped = page_in(*area, first, phys, count, gen);
+        __atomic_add_fetch(&m_pages_faulted, mapped, __ATOMIC_RELAXED);
+        return true;
+    }
+
     uintptr_t phys_page = 0;
-    if (!area->get_page(offset, phys_page))
+    size_t size = area->get_large_page(offset, phys_page);
+    if (!size)
         return false;
 
-    page_in(*area, offset, phys_page, 1);
+    // Map the whole large page if the area's base is aligned for it, and
+    // no smaller pages have already been mapped in its range
+    page_table::level lv = page_table::level::pt;
+    while (page_table::entry_sizes[unsigned(lv)] < size) --lv;
+
+    if (lv != page_table::level::pt && !(base & (size - 1)) &&
+            page_in(*area, offset & ~(size - 1), phys_page, 1, lv)) {
+        __atomic_add_fetch(&m_pages_faulted, size / mem::frame_size, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    page_in(*area, offset, phys_page + (offset & (size - 1)), 1);
+    __atomic_add_fetch(&m_pages_faulted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool
+vm_space::handle_write_fault(uintptr_t page)
+{
+    uintptr_t base = 0;
+    obj::vm_area *area = get(page, &base);
+    if (!area)
+        return false;
+
+    // Copying the page unmaps the shared page from every space using
+    // this area, so map the copy back in here
+    uintptr_t phys = 0;
+    uint64_t gen = area->share_generation();
+    if (!area->copy_on_write(page - base, phys))
+        return false;
+
+    __atomic_add_fetch(&m_faults, 1, __ATOMIC_RELAXED);
+    page_in(*area, page - base, &phys, 1, gen);
     return true;
 }
 
+size_t
+vm_space::fault_window(const obj::vm_area &area, uintptr_t base, uintptr_t offset, uintptr_t &first)
+{
+    using mem::frame_size;
+
+    first = offset;
+    size_t window = m_kernel ? 1 : area.fault_window();
+    if (window <= 1)
+        return 1;
+
+    // Sequential areas map ahead of the fault, others map the
+    // window-aligned group of pages containing it
+    size_t index = offset / frame_size;
+    size_t start = area.flags().get(vm_flags::sequential) ?
+        index : index - (index % window);
+    size_t end = start + window;
+
+    // Stay inside the area, and inside the page table that maps the
+    // faulting page so that the window is only one table walk
+    size_t table_pages = arch::table_entries;
+    size_t table_start = (base / frame_size + index) & ~(table_pages - 1);
+    size_t area_pages = mem::page_count(area.size());
+    size_t base_page = base / frame_size;
+
+    if (start + base_page < table_start)
+        start = table_start - base_page;
+    if (end + base_page > table_start + table_pages)
+        end = table_start + table_pages - base_page;
+    if (end > area_pages)
+        end = area_pages;
+
+    // Only map the run of pages around the fault that are not
+    // already mapped
+    util::scoped_lock lock {m_lock};
+
+    page_table::iterator it {base + offset, m_pml4, &m_tables_allocated};
+    it.entry(page_table::level::pt);
+    const page_table *table = it.table(page_table::level::pt);
+    size_t table_index = it.index(page_table::level::pt);
+
+    size_t lo = index;
+    while (lo > start && !table->entries[table_index - (index - lo) - 1])
+        --lo;
+
+    size_t hi = index + 1;
+    while (hi < end && !table->entries[table_index + (hi - index)])
+        ++hi;
+
+    first = lo * frame_size;
+    return hi - lo;
+}
+
+uintptr_t
+vm_space::resolve(uintptr_t virt, bool write, size_t &span)
+{
+    // A write to a page that isn't mapped may first map a shared page
+    // read-only, which then needs a second fault to be copied. A clone
+    // of the area racing with either fault can cost one more.
+    static constexpr unsigned max_faults = 3;
+
+    for (unsigned faults = 0; ; ++faults) {
+        util::bitset8 fault = 0;
+        {
+            util::scoped_lock lock {m_lock};
+
+            bool present = false;
+            uintptr_t phys = translate(virt, write, span, present);
+            if (phys)
+                return phys;
+
+            if (present)
+                fault.set(fault_type::present);
+        }
+
+        if (faults == max_faults)
+            return 0;
+
+        if (write)
+            fault.set(fault_type::write);
+
+        if (!handle_fault(virt, fault))
+            return 0;
+    }
+}
+
+uintptr_t
+vm_space::translate(uintptr_t virt, bool write, size_t &span, bool &present) const
+{
+    const page_table::iterator it {virt, m_pml4};
+    page_table::level lv = it.page_level();
+    uint64_t e = it.entry(lv);
+
+    present = e & page_flags::present;
+    if (!present || (write && !(e & page_flags::write)))
+        return 0;
+
+    size_t size = page_table::entry_sizes[unsigned(lv)];
+    uintptr_t phys = e & page_table::address_mask & ~(size - 1);
+    if (lv != page_table::level::pt)
+        phys &= ~page_flags::pat2_lg.value();
+
+    present = false;
+    span = size - (virt & (size - 1));
+    return phys + (virt & (size - 1));
+}
+
 size_t
 vm_space::copy(vm_space &source, vm_space &dest, const void *from, void *to, size_t length)
 {
+    // The most data to copy with both spaces locked at once, so that
+    // other users of either space don't wait long behind a large copy
+    static constexpr size_t max_locked_copy = 0x10000;
+
     uintptr_t ifrom = reinterpret_cast<uintptr_t>(from);
     uintptr_t ito = reinterpret_cast<uintptr_t>(to);
 
-    page_table::iterator sit {ifrom, source.m_pml4};
-    page_table::iterator dit {ito, dest.m_pml4};
+    // Lock the spaces in address order, so copies going opposite ways
+    // between the same two spaces can't deadlock
+    vm_space *first = &source < &dest ? &source : &dest;
+    vm_space *second = &source < &dest ? &dest : &source;
+
+    // Each side is only resolved again once its current page has been
+    // used up, so every span between page boundaries of either side,
+    // up to a whole large page, is copied at once
+    uintptr_t src = 0, dst = 0;
+    size_t src_span = 0, dst_span = 0;
+
+    size_t copied = 0;
+    while (copied < length) {
+        if (!src_span && !(src = source.resolve(ifrom + copied, false, src_span)))
+            break;
+        if (!dst_span && !(dst = dest.resolve(ito + copied, true, dst_span)))
+            break;
+
+        size_t n = length - copied;
+        if (n > src_span) n = src_span;
+        if (n > dst_span) n = dst_span;
+        if (n > max_locked_copy) n = max_locked_copy;
+
+        // Resolving faults pages in without holding the locks, so check
+        // the pages are still mapped once locked. The locks keep them
+        // from being unmapped and freed, or copied on write, until the
+        // data is copied.
+        util::spinlock::waiter first_waiter {false, nullptr, "vm_space::copy"};
+        util::spinlock::waiter second_waiter {false, nullptr, "vm_space::copy"};
+        first->m_lock.acquire(&first_waiter);
+        if (second != first)
+            second->m_lock.acquire(&second_waiter);
+
+        size_t span = 0;
+        bool present = false;
+        const bool mapped =
+            source.translate(ifrom + copied, false, span, present) == src &&
+            dest.translate(ito + copied, true, span, present) == dst;
+
+        if (mapped)
+            memcpy(mem::to_virtual<void>(dst), mem::to_virtual<void>(src), n);
+
+        if (second != first)
+            second->m_lock.release(&second_waiter);
+        first->m_lock.release(&first_waiter);
+
+        if (!mapped) {
+            src_span = dst_span = 0;
+            continue;
+        }
 
-    // TODO: iterate page mappings and continue copying. For now i'm blindly
-    // assuming both buffers are fully contained within single pages
-    memcpy(
-        mem::to_virtual<void>((*dit & ~0xfffull) | (ito & 0xffful)),
-        mem::to_virtual<void>((*sit & ~0xfffull) | (ifrom & 0xffful)),
-        length);
+        copied += n;
+        src += n; src_span -= n;
+        dst += n; dst_span -= n;
+    }
 
-    return length;
+    return copied;
+}
+
+void
+vm_space::get_stats(j6_vm_space_stats &stats) const
+{
+    stats.faults = __atomic_load_n(&m_faults, __ATOMIC_RELAXED);
+    stats.pages_faulted = __atomic_load_n(&m_pages_faulted, __ATOMIC_RELAXED);
+    stats.tables_allocated = __atomic_load_n(&m_tables_allocated, __ATOMIC_RELAXED);
+    stats.tables_freed = __atomic_load_n(&m_tables_freed, __ATOMIC_RELAXED);
 }
 
 uintptr_t
@@ -395,8 +949,26 @@ vm_space::find_physical(uintptr_t virt)
     if (!area)
         return 0;
 
+    uintptr_t offset = virt - base;
     uintptr_t phys = 0;
-    area->get_page(virt - base, phys, false);
-    return phys;
+    size_t size = area->get_large_page(offset, phys, false);
+    if (!size || !phys)
+        return 0;
+
+    return phys + (offset & (size - 1));
 }
 
+uintptr_t
+vm_space::find_writable(uintptr_t virt)
+{
+    uintptr_t base = 0;
+    obj::vm_area *area = get(virt, &base);
+    if (!area)
+        return 0;
+
+    if (!area->flags().get(vm_flags::write))
+        return find_physical(virt);
+
+    size_t span = 0;
+    return resolve(virt, true, span);
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include <j6/flags.h>
+#include <j6/types.h>
 #include <util/bitset.h>
 #include <util/spinlock.h>
 #include <util/vector.h>
@@ -55,6 +56,23 @@ public:
     /// Check if this is the kernel space
     inline bool is_kernel() const { return m_kernel; }
 
+    /// Get the unique id of this space, used to tell its TLB entries
+    /// apart from other spaces' on a CPU. Ids are never reused.
+    inline uint64_t tlb_id() const { return m_tlb_id; }
+
+    /// Get this space's TLB generation. TLB entries cached for this
+    /// space in an older generation may be stale.
+    inline uint64_t tlb_generation() const {
+        return __atomic_load_n(&m_tlb_gen, __ATOMIC_ACQUIRE);
+    }
+
+    /// Start a new TLB generation for this space, after its mappings
+    /// have changed.
+    /// \returns  The new generation
+    inline uint64_t next_tlb_generation() {
+        return __atomic_add_fetch(&m_tlb_gen, 1, __ATOMIC_ACQ_REL);
+    }
+
     /// Get the kernel virtual memory space
     static vm_space & kernel_space();
 
@@ -63,14 +81,32 @@ public:
     /// \arg offset Offset of the starting virutal address from the VMA base
     /// \arg phys   The starting physical address
     /// \arg count  The number of contiugous physical pages to map
-    void page_in(const obj::vm_area &area, uintptr_t offset, uintptr_t phys, size_t count);
+    /// \arg lv     The level of the entries to map: level::pt for 4KiB
+    ///             pages, level::pd or level::pdp for large or huge pages
+    /// \returns    False if a table of smaller pages is already in the
+    ///             way of a large or huge page
+    bool page_in(const obj::vm_area &area, uintptr_t offset, uintptr_t phys, size_t count,
+            page_table::level lv = page_table::level::pt);
+
+    /// Map virtual addresses to a run of physical pages that need not be
+    /// contiguous. Pages that are already mapped are left alone.
+    /// \arg area   The VMA this mapping applies to
+    /// \arg offset Offset of the starting virutal address from the VMA base
+    /// \arg phys   Array of `count` physical page addresses. Entries of 0
+    ///             are skipped.
+    /// \arg count  The number of pages to map
+    /// \arg gen    The area's share generation from before `phys` was
+    ///             looked up. If it has changed since, every page is
+    ///             mapped read-only, as some may have been shared.
+    /// \returns    The number of pages mapped
+    size_t page_in(const obj::vm_area &area, uintptr_t offset, const uintptr_t *phys, size_t count,
+            uint64_t gen);
 
     /// Clear mappings from the given region
     /// \arg area   The VMA these mappings applies to
     /// \arg offset Offset of the starting virutal address from the VMA base
     /// \arg count  The number of pages worth of mappings to clear
-    /// \arg free   If true, free the pages back to the system
-    void clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free = false);
+    void clear(const obj::vm_area &vma, uintptr_t offset, size_t count);
 
     /// Clear mappings from the given region, and mark it as locked. Used for
     /// debugging heap allocation reuse.
@@ -79,6 +115,11 @@ public:
     /// \arg count  The number of pages worth of mappings to clear
     void lock(const obj::vm_area &vma, uintptr_t offset, size_t count);
 
+    /// Update the permissions of all existing mappings of an area to
+    /// match its write and exec flags.
+    /// \arg area   The VMA whose mappings to update
+    void protect(const obj::vm_area &vma);
+
     /// Look up the address of a given VMA's offset
     uintptr_t lookup(const obj::vm_area &vma, uintptr_t offset);
 
@@ -106,27 +147,54 @@ public:
     /// Set up a TCB to operate in this address space.
     void initialize_tcb(TCB &tcb);
 
-    /// Copy data from one address space to another
+    /// Copy data from one address space to another. The buffers may be
+    /// any length and alignment. Pages missing from either buffer are
+    /// faulted in, and destination pages are made writable, copying them
+    /// if they are shared copy-on-write. The copy stops early at the
+    /// first page that cannot be faulted in. Each piece is copied with
+    /// both spaces locked, so neither buffer's pages can be freed while
+    /// they are being copied.
     /// \arg source The address space data is being copied from
     /// \arg dest   The address space data is being copied to
     /// \arg from   Pointer to the data in the source address space
     /// \arg to     Pointer to the destination in the dest address space
     /// \arg length Amount of data to copy, in bytes
-    /// \returnd    The number of bytes copied
+    /// \returns    The number of bytes copied
     static size_t copy(vm_space &source, vm_space &dest, const void *from, void *to, size_t length);
 
+    /// Get statistics about this space
+    /// \arg stats  [out] The stats struct to fill
+    void get_stats(j6_vm_space_stats &stats) const;
+
     /// Get the physical address of a virtual address from this space
     /// \arg vrit  The virtual address
     /// \returns   The physical address mapped to that virtual address,
     ///            or 0 for none.
     uintptr_t find_physical(uintptr_t virt);
 
+    /// Get the physical address of a virtual address from this space,
+    /// first giving it a private page if it is mapped read-only in a
+    /// writable area, like copy-on-write pages and the zero page. This
+    /// address won't change when the page is next written.
+    /// \arg virt  The virtual address
+    /// \returns   The physical address mapped to that virtual address,
+    ///            or 0 for none.
+    uintptr_t find_writable(uintptr_t virt);
+
 private:
     friend class obj::vm_area;
 
     /// Find a given VMA in this address space
     bool find_vma(const obj::vm_area &vma, uintptr_t &base) const;
 
+    /// Find the last area in m_areas starting at or before an address
+    /// \returns  The index of the area, or m_areas.count() if none
+    size_t find_index(uintptr_t addr) const;
+
+    /// Find the first entry for a VMA in m_bases
+    /// \returns  The index of the entry, or m_bases.count() if none
+    size_t find_base_index(const obj::vm_area *vma) const;
+
     /// Check if a VMA can be resized
     bool can_resize(const obj::vm_area &vma, size_t size) const;
 
@@ -136,16 +204,67 @@ private:
     /// Remove an area's mappings from this space
     void remove_area(obj::vm_area *area);
 
+    /// Get the physical address a virtual address is mapped to, faulting
+    /// its page in if it is not mapped (or not writable, if needed).
+    /// \arg virt   The virtual address
+    /// \arg write  If true, the page must be writable
+    /// \arg span   [out] Receives the number of bytes from `virt` to the
+    ///             end of the page it is in, which may be a large page
+    /// \returns    The physical address, or 0 if the page could not be
+    ///             faulted in
+    uintptr_t resolve(uintptr_t virt, bool write, size_t &span);
+
+    /// Get the physical address a virtual address is currently mapped
+    /// to, without faulting. Must be called with m_lock held.
+    /// \arg virt     The virtual address
+    /// \arg write    If true, the page must be writable
+    /// \arg span     [out] Receives the number of bytes from `virt` to the
+    ///               end of the page it is in, which may be a large page
+    /// \arg present  [out] Set to true if the page is mapped, but not
+    ///               writable as needed
+    /// \returns      The physical address, or 0 if it is not mapped as needed
+    uintptr_t translate(uintptr_t virt, bool write, size_t &span, bool &present) const;
+
+    /// Handle a write fault on a present page, which may be a
+    /// copy-on-write page shared with another area.
+    /// \arg page  The address of the page that was written
+    /// \returns   True if the fault was handled
+    bool handle_write_fault(uintptr_t page);
+
+    /// Find the run of unmapped pages around a faulting page to map
+    /// together, based on the area's fault window.
+    /// \arg area   The VMA being faulted
+    /// \arg base   The base address of the area
+    /// \arg offset The offset of the faulting page in the area
+    /// \arg first  [out] Receives the offset of the first page of the run
+    /// \returns    The number of pages in the run
+    size_t fault_window(const obj::vm_area &area, uintptr_t base, uintptr_t offset, uintptr_t &first);
+
     bool m_kernel;
     page_table *m_pml4;
 
+    uint64_t m_tlb_id;
+    uint64_t m_tlb_gen;
+
     struct area {
         uintptr_t base;
         obj::vm_area *area;
         int compare(const struct area &o) const;
         bool operator==(const struct area &o) const;
     };
-    util::vector<area> m_areas;
+    util::vector<area> m_areas; ///< Mapped areas, sorted by base address
+
+    struct area_base {
+        const obj::vm_area *area;
+        uintptr_t base;
+        int compare(const struct area_base &o) const;
+    };
+    util::vector<area_base> m_bases; ///< Reverse index of areas' bases, sorted by area
 
     util::spinlock m_lock;
+
+    uint64_t m_faults;
+    uint64_t m_pages_faulted;
+    uint64_t m_tables_allocated; ///< Table pages allocated, not counting the PML4
+    uint64_t m_tables_freed;     ///< Table pages freed while clearing mappings
 };
\ No newline at end of file
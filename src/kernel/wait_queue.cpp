@@ -62,6 +62,15 @@ wait_queue::pop_next()
     return t;
 }
 
+void
+wait_queue::push_front(obj::thread *t)
+{
+    kassert(t, "Adding a null thread to the wait queue");
+    util::scoped_lock lock {m_lock};
+    t->handle_retain();
+    m_threads.push_front(t);
+}
+
 void
 wait_queue::clear(uint64_t value)
 {
@@ -29,6 +29,9 @@ public:
     /// Pops the next waiting thread off the queue.
     obj::thread * pop_next();
 
+    /// Put a thread taken by pop_next() back at the front of the queue.
+    void push_front(obj::thread *t);
+
     /// Wake and clear out all threads.
     /// \arg value  The value passed to thread::wake
     void clear(uint64_t value = 0);
@@ -0,0 +1,190 @@
+#include <j6/memutils.h>
+#include <util/spinlock.h>
+
+#include "frame_allocator.h"
+#include "logger.h"
+#include "memory.h"
+#include "objects/thread.h"
+#include "scheduler.h"
+#include "zero_pool.h"
+
+using mem::frame_size;
+
+namespace zero_pool {
+
+namespace {
+
+// Frames in the pool are kept on two lists, linked through the first
+// word of each frame: frames waiting to be zeroed, and frames that are
+// zeroed apart from that link word.
+struct frame_list
+{
+    uintptr_t head = 0;
+    size_t count = 0;
+
+    void push(uintptr_t phys) {
+        *mem::to_virtual<uintptr_t>(phys) = head;
+        head = phys;
+        ++count;
+    }
+
+    uintptr_t pop() {
+        uintptr_t phys = head;
+        if (phys) {
+            head = *mem::to_virtual<uintptr_t>(phys);
+            --count;
+        }
+        return phys;
+    }
+};
+
+util::spinlock g_lock;
+frame_list g_clean;
+frame_list g_dirty;
+uintptr_t g_zero_page = 0;
+obj::thread *g_sleeper = nullptr;
+
+void
+zero_frame(uintptr_t phys)
+{
+    memset(mem::to_virtual<void>(phys), 0, frame_size);
+}
+
+// Zero one frame for the clean list, either a freed one or a new one
+// from the frame allocator.
+// \returns  False if the clean list is already full
+bool
+zero_one()
+{
+    uintptr_t phys = 0;
+    {
+        util::scoped_lock lock {g_lock};
+        if (g_clean.count >= target_frames)
+            return false;
+        phys = g_dirty.pop();
+    }
+
+    if (!phys)
+        frame_allocator::get().allocate(1, &phys);
+
+    zero_frame(phys);
+
+    util::scoped_lock lock {g_lock};
+    g_clean.push(phys);
+    return true;
+}
+
+void
+zero_task()
+{
+    obj::thread &th = obj::thread::current();
+
+    while (true) {
+        while (zero_one());
+
+        // Sleep until allocations take the pool below its low-water
+        // mark, instead of waking periodically on idle CPUs
+        util::scoped_lock lock {g_lock};
+        if (g_clean.count < target_frames)
+            continue;
+
+        g_sleeper = &th;
+        th.block(lock);
+    }
+}
+
+// Give a run of frames that doesn't hold the zero page to the pool
+void
+free_run(uintptr_t phys, size_t count)
+{
+    size_t taken = 0;
+    {
+        util::scoped_lock lock {g_lock};
+        while (taken < count && g_clean.count + g_dirty.count < max_frames)
+            g_dirty.push(phys + frame_size * taken++);
+    }
+
+    if (taken < count)
+        frame_allocator::get().free(phys + frame_size * taken, count - taken);
+}
+
+} // namespace
+
+void
+start()
+{
+    uintptr_t phys = 0;
+    frame_allocator::get().allocate(1, &phys);
+    zero_frame(phys);
+    g_zero_page = phys;
+
+    scheduler::get().create_kernel_task(zero_task, scheduler::idle_priority, true);
+    log::verbose(logs::memory, "Zero page is at %016lx", phys);
+}
+
+uintptr_t
+zero_page()
+{
+    return g_zero_page;
+}
+
+size_t
+allocate(size_t count, uintptr_t *phys)
+{
+    size_t clean = 0;
+    size_t dirty = 0;
+    obj::thread *wake = nullptr;
+    {
+        util::scoped_lock lock {g_lock};
+        while (clean < count && g_clean.count)
+            phys[clean++] = g_clean.pop();
+
+        dirty = clean;
+        while (dirty < count && g_dirty.count)
+            phys[dirty++] = g_dirty.pop();
+
+        if (g_sleeper && g_clean.count < low_water_frames) {
+            wake = g_sleeper;
+            g_sleeper = nullptr;
+        }
+    }
+
+    // Callers may hold other locks, so only make the task ready
+    if (wake)
+        wake->wake_only();
+
+    // Clean frames only need their link word cleared
+    for (size_t i = 0; i < clean; ++i)
+        *mem::to_virtual<uintptr_t>(phys[i]) = 0;
+
+    frame_allocator &fa = frame_allocator::get();
+    size_t n = dirty;
+    while (n < count) {
+        uintptr_t frames = 0;
+        size_t got = fa.allocate(count - n, &frames);
+        if (!got) break;
+
+        for (size_t i = 0; i < got; ++i)
+            phys[n++] = frames + i * frame_size;
+    }
+
+    for (size_t i = clean; i < n; ++i)
+        zero_frame(phys[i]);
+
+    return n;
+}
+
+void
+free(uintptr_t phys, size_t count)
+{
+    uintptr_t end = phys + count * frame_size;
+    if (g_zero_page >= phys && g_zero_page < end) {
+        free_run(phys, (g_zero_page - phys) / frame_size);
+        free_run(g_zero_page + frame_size, (end - g_zero_page) / frame_size - 1);
+        return;
+    }
+
+    free_run(phys, count);
+}
+
+} // namespace zero_pool
@@ -0,0 +1,44 @@
+#pragma once
+/// \file zero_pool.h
+/// Pre-zeroed frames for newly faulted pages, and the shared zero page
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace zero_pool {
+
+/// Number of zeroed frames the pool tries to keep ready
+constexpr size_t target_frames = 256;
+
+/// Largest number of frames, zeroed or not, the pool holds
+constexpr size_t max_frames = 1024;
+
+/// Number of zeroed frames below which the zeroing task is woken
+constexpr size_t low_water_frames = target_frames / 4;
+
+/// Allocate the shared zero page, and start the kernel task that
+/// zeroes frames while the system is idle. The task sleeps once the
+/// pool is full, until allocations take it below `low_water_frames`.
+void start();
+
+/// Get the physical address of the shared zero page, which must only
+/// ever be mapped read-only.
+/// \returns  The zero page's address, or 0 if there is none yet
+uintptr_t zero_page();
+
+/// Get zeroed frames. Frames that were zeroed ahead of time are used
+/// first, and any others are zeroed now.
+/// \arg count  The number of frames to get
+/// \arg phys   [out] Array of `count` entries to receive the frames'
+///             physical addresses, which need not be contiguous
+/// \returns    The number of frames retrieved
+size_t allocate(size_t count, uintptr_t *phys);
+
+/// Free frames into the pool, to be zeroed while the system is idle.
+/// Frames the pool has no room for go back to the frame allocator,
+/// and the zero page is never freed.
+/// \arg phys   The physical address of the first frame
+/// \arg count  The number of frames
+void free(uintptr_t phys, size_t count);
+
+} // namespace zero_pool
@@ -18,30 +18,88 @@ namespace j6 {
 static uintptr_t channel_addr = 0x6000'0000;
 static util::spinlock addr_spinlock;
 
+/// One side of a lock-free channel's sleep state. The other side only
+/// makes a syscall to wake it when `sleeping` is set.
+struct channel_sleeper
+{
+    uint32_t sleeping;
+    uint32_t seq;
+};
+
 struct channel::header
 {
     size_t size;
-    size_t read_index;
-    size_t write_index;
+    size_t capacity;
+    bool spsc;
 
     mutex mutex;
     condition read_waiting;
     condition write_waiting;
 
-    uint8_t data[0];
+    // Each index is only written by one side in spsc mode, so keep
+    // them on separate cache lines
+    alignas(64) size_t read_index;
+    channel_sleeper reader;
+
+    alignas(64) size_t write_index;
+    channel_sleeper writer;
 
-    inline const void* read_at() const { return &data[read_index & (size - 1)]; }
-    inline void* write_at()            { return &data[write_index & (size - 1)]; }
+    // The data area shares the ring VMA with this header, so it can't
+    // use the VMA's mirrored mapping to wrap, and copies wrap by hand
+    alignas(64) uint8_t data[0];
 
     inline size_t read_avail() const   { return write_index - read_index; }
-    inline size_t write_avail() const  { return size - read_avail(); }
+    inline size_t write_avail() const  { return capacity - read_avail(); }
 
     inline void consume(size_t n)      { read_index += n; }
     inline void commit(size_t n)       { write_index += n; }
+
+    void copy_in(size_t index, const void *from, size_t len) {
+        size_t at = index % capacity;
+        size_t first = len < capacity - at ? len : capacity - at;
+        memcpy(&data[at], from, first);
+        memcpy(data, static_cast<const uint8_t*>(from) + first, len - first);
+    }
+
+    void copy_out(size_t index, void *to, size_t len) const {
+        size_t at = index % capacity;
+        size_t first = len < capacity - at ? len : capacity - at;
+        memcpy(to, &data[at], first);
+        memcpy(static_cast<uint8_t*>(to) + first, data, len - first);
+    }
 };
 
+namespace {
+
+// Sleep until `ready` is true, or until woken by the other side
+template <typename Ready>
+void
+sleep_until(channel_sleeper &s, Ready ready)
+{
+    uint32_t seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&s.sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if (!ready())
+        j6_futex_wait(&s.seq, seq, 0);
+
+    __atomic_store_n(&s.sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// Wake the other side, after having updated an index, if it is sleeping
+void
+wake(channel_sleeper &s)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s.sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&s.seq, 1, __ATOMIC_RELEASE);
+        j6_futex_wake(&s.seq, 0);
+    }
+}
+
+} // namespace
+
 channel *
-channel::create(size_t size)
+channel::create(size_t size, bool spsc)
 {
     j6_status_t result;
     j6_handle_t vma = j6_handle_invalid;
@@ -65,6 +123,8 @@ channel::create(size_t size)
     header *h = reinterpret_cast<header*>(addr);
     memset(h, 0, sizeof(*h));
     h->size = size;
+    h->capacity = size - sizeof(header);
+    h->spsc = spsc;
 
     return new channel {vma, h};
 }
@@ -84,7 +144,7 @@ channel::open(j6_handle_t vma)
     }
 
     header *h = reinterpret_cast<header*>(addr);
-    channel_addr += h->size;
+    channel_addr += h->size * 2; // account for ring buffer virtual space doubling
     lock.release();
 
     return new channel {vma, h};
@@ -97,12 +157,26 @@ channel::channel(j6_handle_t vma, header *h) :
 {
 }
 
+channel::~channel()
+{
+    j6_vma_unmap(m_vma, j6_handle_invalid);
+}
+
+size_t
+channel::capacity() const
+{
+    return m_header->capacity;
+}
+
 j6_status_t
 channel::send(const void *buffer, size_t len, bool block)
 {
-    if (len > m_header->size)
+    if (len > m_header->capacity)
         return j6_err_insufficient;
 
+    if (m_header->spsc)
+        return send_spsc(buffer, len, block);
+
     j6::scoped_lock lock {m_header->mutex};
     while (m_header->write_avail() < len) {
         if (!block)
@@ -113,7 +187,7 @@ channel::send(const void *buffer, size_t len, bool block)
         lock.acquire();
     }
 
-    memcpy(m_header->write_at(), buffer, len);
+    m_header->copy_in(m_header->write_index, buffer, len);
     m_header->commit(len);
     m_header->read_waiting.wake();
 
@@ -123,6 +197,9 @@ channel::send(const void *buffer, size_t len, bool block)
 j6_status_t
 channel::receive(void *buffer, size_t *size, bool block)
 {
+    if (m_header->spsc)
+        return receive_spsc(buffer, size, block);
+
     j6::scoped_lock lock {m_header->mutex};
     while (!m_header->read_avail()) {
         if (!block) {
@@ -138,7 +215,7 @@ channel::receive(void *buffer, size_t *size, bool block)
     size_t avail = m_header->read_avail();
     size_t read = *size > avail ? avail : *size;
 
-    memcpy(buffer, m_header->read_at(), read);
+    m_header->copy_out(m_header->read_index, buffer, read);
     m_header->consume(read);
     m_header->write_waiting.wake();
 
@@ -146,6 +223,61 @@ channel::receive(void *buffer, size_t *size, bool block)
     return j6_status_ok;
 }
 
+j6_status_t
+channel::send_spsc(const void *buffer, size_t len, bool block)
+{
+    header &h = *m_header;
+
+    // Only this side writes write_index
+    const size_t write = h.write_index;
+    auto space = [&h, write, len]() {
+        size_t read = __atomic_load_n(&h.read_index, __ATOMIC_ACQUIRE);
+        return h.capacity - (write - read) >= len;
+    };
+
+    while (!space()) {
+        if (!block)
+            return j6_status_would_block;
+        sleep_until(h.writer, space);
+    }
+
+    h.copy_in(write, buffer, len);
+    __atomic_store_n(&h.write_index, write + len, __ATOMIC_RELEASE);
+    wake(h.reader);
+
+    return j6_status_ok;
+}
+
+j6_status_t
+channel::receive_spsc(void *buffer, size_t *size, bool block)
+{
+    header &h = *m_header;
+
+    // Only this side writes read_index
+    const size_t read = h.read_index;
+    auto data = [&h, read]() {
+        return __atomic_load_n(&h.write_index, __ATOMIC_ACQUIRE) != read;
+    };
+
+    while (!data()) {
+        if (!block) {
+            *size = 0;
+            return j6_status_would_block;
+        }
+        sleep_until(h.reader, data);
+    }
+
+    size_t avail = __atomic_load_n(&h.write_index, __ATOMIC_ACQUIRE) - read;
+    size_t n = *size > avail ? avail : *size;
+
+    h.copy_out(read, buffer, n);
+    __atomic_store_n(&h.read_index, read + n, __ATOMIC_RELEASE);
+    wake(h.writer);
+
+    *size = n;
+    return j6_status_ok;
+}
+
 } // namespace j6
 
 #endif // __j6kernel
@@ -16,11 +16,19 @@ class API channel
 {
 public:
     /// Create a new channel of the given size.
-    static channel * create(size_t size);
+    /// \arg size  The size of the channel's memory, a power of two of at least a page
+    /// \arg spsc  If true, the channel is lock-free, and only makes syscalls when one
+    ///            side must sleep. At most one thread may send and one thread may
+    ///            receive on such a channel at any time.
+    static channel * create(size_t size, bool spsc = false);
 
     /// Open an existing channel for which we have a VMA handle
     static channel * open(j6_handle_t vma);
 
+    /// Unmap the channel's memory from this process. Other processes
+    /// that have the channel open are unaffected.
+    ~channel();
+
     /// Send data into the channel.
     /// \arg buffer  The buffer from which to read data
     /// \arg len     The number of bytes to read from `buffer`
@@ -36,11 +44,17 @@ public:
     /// Get the VMA handle for sharing with other processes
     j6_handle_t handle() const { return m_vma; }
 
+    /// Get the largest amount of data the channel can hold
+    size_t capacity() const;
+
 private:
     struct header;
 
     channel(j6_handle_t vma, header *h);
 
+    j6_status_t send_spsc(const void *buffer, size_t len, bool block);
+    j6_status_t receive_spsc(void *buffer, size_t *size, bool block);
+
     j6_handle_t m_vma;
 
     size_t m_size;
@@ -0,0 +1,42 @@
+#pragma once
+/// \file j6/clock.h
+/// Reading the system clock without a syscall
+
+#include <stdint.h>
+#include <j6/types.h>
+
+/// Layout of the read-only clock page that the kernel maps into
+/// every process. The kernel increments `seq` before and after each
+/// update, so readers must retry if it is odd or changes while they
+/// are reading.
+struct j6_clock_page
+{
+    uint32_t seq;        ///< Update sequence count
+    uint32_t shift;      ///< Shift for converting TSC ticks to ns
+    uint64_t mult;       ///< Multiplier for converting TSC ticks to ns
+    uint64_t base_ticks; ///< TSC value at `base_ns`
+    uint64_t base_ns;    ///< Clock time in ns at `base_ticks`
+    uint64_t frequency;  ///< TSC ticks per second, or 0 if the TSC is not the clock source
+};
+
+// The kernel depends on libj6 for some shared code,
+// but should not include the user-specific code.
+#ifndef __j6kernel
+#include <util/api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Get the current value of the system clock, without entering
+/// the kernel.
+/// \arg ns  [out] The time since boot, in ns
+/// \returns j6_err_not_ready if the system clock cannot be read
+///          from userspace
+j6_status_t API j6_clock_gettime(uint64_t *ns);
+
+#ifdef __cplusplus
+} // extern C
+#endif
+
+#endif // __j6kernel
@@ -50,6 +50,59 @@ struct j6_handle_descriptor
     j6_object_type type;
 };
 
+/// Per-CPU run queue statistics as returned by j6_sched_stats
+struct j6_run_queue_stats
+{
+    uint32_t ready;             ///< Non-idle threads waiting on the ready lists
+    uint32_t blocked;           ///< Threads blocked on this CPU
+    uint32_t load;              ///< Decaying average of runnable threads, 24.8 fixed point
+    uint32_t busy;              ///< Nonzero if a non-idle thread is running
+    uint64_t added;             ///< Threads placed on this CPU at creation
+    uint64_t migrated;          ///< Threads this CPU has stolen from other CPUs
+    uint64_t switches;          ///< Context switches performed on this CPU
+    uint64_t timer_interrupts;  ///< Scheduler timer interrupts on this CPU
+    uint64_t handoffs;          ///< Direct switches to an IPC partner thread
+};
+
+/// Virtual memory space statistics as returned by j6_vm_stats
+struct j6_vm_space_stats
+{
+    uint64_t faults;            ///< Page faults handled in this space
+    uint64_t pages_faulted;     ///< Pages mapped by handling page faults
+    uint64_t tables_allocated;  ///< Page table pages allocated for this space
+    uint64_t tables_freed;      ///< Page table pages freed from this space
+};
+
+/// Bytes of message data carried by each mailbox ring entry
+#define j6_mailbox_ring_data_size  96
+
+/// An entry in a mailbox ring's submission or completion queue
+struct j6_mailbox_ring_entry
+{
+    uint64_t id;            ///< Set by the client, and copied to the entry's completion
+    j6_tag_t tag;           ///< The message tag, or the reply's tag in a completion
+    j6_status_t status;     ///< The completion status, unused in submissions
+    uint32_t data_len;      ///< Bytes of data used
+    uint32_t reserved;
+    uint8_t data[j6_mailbox_ring_data_size];
+};
+
+/// Header of a mailbox submission and completion ring attached with
+/// j6_mailbox_ring_attach. It is followed in memory by `entries`
+/// submission entries, and then by `entries` completion entries. The
+/// client writes a submission at sq_tail while sq_tail - sq_head is
+/// less than `entries`, and reads completions from cq_head to cq_tail.
+/// The kernel updates sq_head and cq_tail in j6_mailbox_ring_enter.
+struct j6_mailbox_ring
+{
+    uint32_t entries;       ///< Entries in each queue, set by the kernel
+    uint32_t sq_head;       ///< Submissions received by the server
+    uint32_t sq_tail;       ///< Submissions written by the client
+    uint32_t cq_head;       ///< Completions read by the client
+    uint32_t cq_tail;       ///< Completions posted
+    uint32_t reserved[3];
+};
+
 /// Log entries as returned by j6_system_get_log
 struct j6_log_entry
 {
@@ -129,6 +129,25 @@ public:
         return leaf->m_entries.entries[index];
     }
 
+    /// Call a function on every entry in every leaf of the tree, in
+    /// order of their keys. Empty entries are included.
+    /// \arg root  The root node of the tree
+    /// \arg fn    The function to call, as `fn(uint64_t key, T &entry)`
+    template <typename Func>
+    static void for_each(node_type *root, Func &fn) {
+        if (!root)
+            return;
+
+        if (!root->m_level) {
+            for (size_t i = 0; i < N; ++i)
+                fn(root->m_base + (i << level_shift(0)), root->m_entries.entries[i]);
+            return;
+        }
+
+        for (auto *c : root->m_entries.children)
+            for_each(c, fn);
+    }
+
     virtual ~radix_tree() {
         if (m_level) {
             for (auto &c : m_entries.children)
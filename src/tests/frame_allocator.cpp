@@ -0,0 +1,233 @@
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bootproto/kernel.h>
+#include "frame_allocator.h"
+#include "catch.hpp"
+
+using bootproto::frame_block;
+using bootproto::frames_per_block;
+
+constexpr size_t fs = 0x1000; // frame size
+constexpr size_t words_per_block = frames_per_block / 64;
+
+/// A single frame block whose frames start out all free
+struct test_block
+{
+    frame_block block;
+    std::vector<uint64_t> bitmap;
+
+    test_block(uintptr_t base, size_t count) :
+        bitmap(words_per_block, 0)
+    {
+        block.base = base;
+        block.count = count;
+        block.map1 = 0;
+        for (auto &m : block.map2) m = 0;
+        block.bitmap = bitmap.data();
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t word = i >> 6;
+            bitmap[word] |= 1ull << (i & 0x3f);
+            block.map2[word >> 6] |= 1ull << (word & 0x3f);
+            block.map1 |= 1ull << (word >> 6);
+        }
+    }
+
+    bool is_free(uintptr_t addr) const {
+        size_t i = (addr - block.base) / fs;
+        return bitmap[i >> 6] & (1ull << (i & 0x3f));
+    }
+
+    bool all_free(uintptr_t addr, size_t count) const {
+        for (size_t i = 0; i < count; ++i)
+            if (!is_free(addr + i * fs)) return false;
+        return true;
+    }
+
+    bool none_free(uintptr_t addr, size_t count) const {
+        for (size_t i = 0; i < count; ++i)
+            if (is_free(addr + i * fs)) return false;
+        return true;
+    }
+};
+
+/// Allocate a run of frames, checking that every frame of it was free
+/// beforehand and is used afterwards. Checking only afterwards would
+/// miss runs that overlap frames that were already in use.
+bool
+allocate_checked(frame_allocator &fa, test_block &tb,
+        size_t count, size_t align, uintptr_t *addr)
+{
+    std::vector<uint64_t> before = tb.bitmap;
+    if (!fa.allocate_contiguous(count, align, addr))
+        return false;
+
+    size_t first = (*addr - tb.block.base) / fs;
+    for (size_t i = first; i < first + count; ++i) {
+        CAPTURE( i );
+        CHECK( (before[i >> 6] & (1ull << (i & 0x3f))) );
+    }
+    CHECK( tb.none_free(*addr, count) );
+    return true;
+}
+
+TEST_CASE( "Contiguous frame allocation", "[memory frames]" )
+{
+    const uintptr_t base = 0x40000000;
+    test_block tb {base, frames_per_block};
+    frame_allocator fa {&tb.block, 1};
+
+    // Fragment the block by using every other frame of the first 1024
+    for (size_t i = 0; i < 1024; i += 2)
+        fa.used(base + i * fs, 1);
+
+    uintptr_t addr = 0;
+    REQUIRE( allocate_checked(fa, tb, 100, 1, &addr) );
+    CHECK( addr >= base + 1023 * fs );
+
+    // Runs longer than one bitmap word
+    uintptr_t big = 0;
+    REQUIRE( allocate_checked(fa, tb, 1000, 1, &big) );
+    CHECK( (big >= addr + 100 * fs || big + 1000 * fs <= addr) );
+
+    // Freeing makes the frames available again
+    fa.free(big, 1000);
+    CHECK( tb.all_free(big, 1000) );
+    CHECK( tb.none_free(addr, 100) );
+}
+
+TEST_CASE( "Aligned frame allocation", "[memory frames]" )
+{
+    // Start the block at an address that is not 2MiB aligned
+    const uintptr_t base = 0x40000000 + 3 * fs;
+    test_block tb {base, frames_per_block - 3};
+    frame_allocator fa {&tb.block, 1};
+
+    const size_t large = 512; // 2MiB in frames
+
+    uintptr_t addr = 0;
+    REQUIRE( allocate_checked(fa, tb, large, large, &addr) );
+    CHECK( addr % (large * fs) == 0 );
+
+    // Use a single frame in the next aligned run, so the one after
+    // that must be chosen
+    uintptr_t next = addr + large * fs;
+    fa.used(next + 17 * fs, 1);
+
+    std::vector<uintptr_t> runs;
+    for (int i = 0; i < 4; ++i) {
+        uintptr_t a = 0;
+        REQUIRE( allocate_checked(fa, tb, large, large, &a) );
+        CHECK( a % (large * fs) == 0 );
+        CHECK( a != next );
+        for (uintptr_t r : runs)
+            CHECK( a != r );
+        runs.push_back(a);
+    }
+}
+
+TEST_CASE( "Aligned allocation from a fragmented block", "[memory frames]" )
+{
+    const uintptr_t base = 0x40000000;
+    test_block tb {base, frames_per_block};
+    frame_allocator fa {&tb.block, 1};
+
+    const size_t large = 512; // 2MiB in frames
+    const size_t runs = frames_per_block / large;
+
+    // Use one frame at a different offset in every aligned run but
+    // one, so that only one run has all its frames free, though most
+    // of the block is free and there are many long unaligned runs
+    const size_t open = runs - 3;
+    for (size_t r = 0; r < runs; ++r) {
+        if (r == open) continue;
+        fa.used(base + (r * large + (r * 37) % large) * fs, 1);
+    }
+
+    uintptr_t addr = 0;
+    REQUIRE( allocate_checked(fa, tb, large, large, &addr) );
+    CHECK( addr == base + open * large * fs );
+
+    // There are no other aligned runs left, even though unaligned
+    // runs of the same length are still free
+    uintptr_t none = 0;
+    CHECK_FALSE( fa.allocate_contiguous(large, large, &none) );
+
+    uintptr_t unaligned = 0;
+    REQUIRE( allocate_checked(fa, tb, large, 1, &unaligned) );
+    CHECK( unaligned % (large * fs) != 0 );
+
+    // Freeing the run makes it the only choice again
+    fa.free(addr, large);
+    uintptr_t again = 0;
+    REQUIRE( allocate_checked(fa, tb, large, large, &again) );
+    CHECK( again == addr );
+}
+
+TEST_CASE( "Random fragmentation", "[memory frames]" )
+{
+    using clock = std::chrono::system_clock;
+    unsigned seed = clock::now().time_since_epoch().count();
+    std::default_random_engine rng(seed);
+    INFO( "Random seed: " << seed );
+
+    const uintptr_t base = 0x80000000;
+    const size_t count = 64 * 64 * 4;
+    test_block tb {base, count};
+    frame_allocator fa {&tb.block, 1};
+
+    // Use a random half of the frames
+    std::uniform_int_distribution<size_t> frame_dist(0, count - 1);
+    for (size_t i = 0; i < count / 2; ++i)
+        fa.used(base + frame_dist(rng) * fs, 1);
+
+    std::uniform_int_distribution<size_t> size_dist(1, 8);
+    std::uniform_int_distribution<unsigned> align_dist(0, 3);
+    for (int i = 0; i < 200; ++i) {
+        size_t n = size_dist(rng);
+        size_t align = 1 << align_dist(rng);
+
+        // Find whether a run should exist before allocating
+        bool expected = false;
+        for (size_t f = 0; f + n <= count && !expected; ++f) {
+            if (((base / fs) + f) % align) continue;
+            expected = tb.all_free(base + f * fs, n);
+        }
+
+        uintptr_t addr = 0;
+        CAPTURE( n );
+        CAPTURE( align );
+        bool result = allocate_checked(fa, tb, n, align, &addr);
+        REQUIRE( result == expected );
+        if (!result) continue;
+
+        CHECK( (addr / fs) % align == 0 );
+    }
+}
+
+TEST_CASE( "Freeing 1GiB of frames", "[memory frames] [benchmark]" )
+{
+    using clock = std::chrono::steady_clock;
+
+    const uintptr_t base = 0x40000000;
+    test_block tb {base, frames_per_block};
+    frame_allocator fa {&tb.block, 1};
+
+    const size_t rounds = 100;
+    auto start = clock::now();
+    for (size_t i = 0; i < rounds; ++i) {
+        fa.used(base, frames_per_block);
+        fa.free(base, frames_per_block);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+
+    for (size_t i = 0; i < frames_per_block; i += 4099)
+        CHECK( tb.is_free(base + i * fs) );
+    CHECK( tb.block.map1 == ~0ull );
+
+    WARN( "Marking used and freeing 1GiB of frames: " << elapsed.count() / rounds << "us" );
+}
@@ -75,7 +75,8 @@ main(int argc, const char **argv)
     if (slp == j6_handle_invalid)
         return 1;
 
-    j6::channel *cout = j6::channel::create(0x2000);
+    // The logger is the only sender, and this loop the only receiver
+    j6::channel *cout = j6::channel::create(0x2000, true);
     if (!cout)
         return 2;
 
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <unordered_map>
 #include <j6/flags.h>
 #include <j6/errors.h>
 #include <j6/protocols/vfs.h>
@@ -11,22 +12,35 @@
 static uint64_t initfs_running = 1;
 static constexpr size_t buffer_size = 2048;
 
+// Files stay loaded once requested, and requests get copy-on-write
+// clones of them, so that every process loading a file shares its pages
+static std::unordered_map<const j6romfs::inode*, j6_handle_t> loaded_files;
+
 j6_status_t
 handle_load_request(j6romfs::fs &fs, const char *path, j6_handle_t &vma)
 {
+    vma = j6_handle_invalid;
     const j6romfs::inode *in = fs.lookup_inode(path);
-    if (!in) {
-        vma = j6_handle_invalid;
+    if (!in)
         return j6_status_ok;
-    }
 
-    uintptr_t load_addr = 0;
-    j6_vma_create_map(&vma, in->size, &load_addr, j6_vm_flag_write);
-    util::buffer dest = util::buffer::from(load_addr, in->size);
-    fs.load_inode_data(in, dest);
-    j6_vma_unmap(vma, 0);
+    j6_handle_t file = j6_handle_invalid;
+    auto it = loaded_files.find(in);
+    if (it != loaded_files.end()) {
+        file = it->second;
+    } else {
+        uintptr_t load_addr = 0;
+        j6_status_t s = j6_vma_create_map(&file, in->size, &load_addr, j6_vm_flag_write);
+        if (s != j6_status_ok)
+            return s;
+
+        util::buffer dest = util::buffer::from(load_addr, in->size);
+        fs.load_inode_data(in, dest);
+        j6_vma_unmap(file, 0);
+        loaded_files.insert({in, file});
+    }
 
-    return j6_status_ok;
+    return j6_vma_clone(file, &vma, 0, in->size, j6_vm_flag_write);
 }
 
 void
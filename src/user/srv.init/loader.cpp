@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <unordered_map>
 
 #include <bootproto/init.h>
 #include <elf/file.h>
@@ -25,6 +26,16 @@ static util::xoroshiro256pp rng {0x123456};
 
 inline uintptr_t align_up(uintptr_t a) { return ((a-1) & ~(MiB-1)) + MiB; }
 
+struct loaded_file
+{
+    j6_handle_t vma;
+    util::buffer data;
+};
+
+// Program files stay loaded, so that every process loaded from the
+// same file shares its pages
+static std::unordered_map<const j6romfs::inode*, loaded_file> loaded_files;
+
 class stack_pusher
 {
 public:
@@ -81,8 +92,67 @@ map_phys(j6_handle_t sys, uintptr_t phys, size_t len, j6_vm_flags flags)
     return vma;
 }
 
+// Create a VMA holding a segment's contents. If the segment's offset in
+// the file is page-aligned with its address, the VMA shares the file's
+// pages copy-on-write, otherwise the segment is copied. The VMA may be
+// left mapped into this process.
+static j6_handle_t
+create_segment_vma(const loaded_file &lf, const elf::file &file, const elf::segment_header &seg,
+        unsigned long flags, const char *path)
+{
+    size_t prologue = seg.vaddr & 0xfff;
+    size_t epilogue = seg.mem_size - seg.file_size;
+    size_t size = seg.mem_size + prologue;
+    size_t file_offset = seg.offset - prologue;
+
+    j6_handle_t sub_vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t res;
+
+    if (file_offset & 0xfff) {
+        res = j6_vma_create_map(&sub_vma, size, &addr, flags);
+        if (res != j6_status_ok) {
+            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating sub vma: %lx", path, res);
+            return j6_handle_invalid;
+        }
+
+        uint8_t *src = reinterpret_cast<uint8_t *>(file.base() + seg.offset);
+        uint8_t *dest = reinterpret_cast<uint8_t *>(addr);
+        memset(dest, 0, prologue);
+        memcpy(dest+prologue, src, seg.file_size);
+        memset(dest+prologue+seg.file_size, 0, epilogue);
+        return sub_vma;
+    }
+
+    // Only share the pages holding file data, any pages past them
+    // start out empty
+    size_t shared = (prologue + seg.file_size + 0xfff) & ~0xfffull;
+    res = j6_vma_clone(lf.vma, &sub_vma, file_offset, shared < size ? shared : size, flags);
+    if (res == j6_status_ok && shared < size)
+        res = j6_vma_resize(sub_vma, &size);
+    if (res != j6_status_ok) {
+        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': cloning sub vma: %lx", path, res);
+        return j6_handle_invalid;
+    }
+
+    // The rest of the last file page holds other parts of the file,
+    // which must be cleared for the bss
+    if (epilogue) {
+        res = j6_vma_map(sub_vma, 0, &addr, 0);
+        if (res != j6_status_ok) {
+            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': mapping sub vma: %lx", path, res);
+            return j6_handle_invalid;
+        }
+
+        uint8_t *dest = reinterpret_cast<uint8_t *>(addr);
+        memset(dest+prologue+seg.file_size, 0, epilogue);
+    }
+
+    return sub_vma;
+}
+
 uintptr_t
-load_program_into(j6_handle_t proc, elf::file &file, uintptr_t image_base, const char *path)
+load_program_into(j6_handle_t proc, const loaded_file &lf, elf::file &file, uintptr_t image_base, const char *path)
 {
     uintptr_t eop = 0; // end of program
 
@@ -90,30 +160,24 @@ load_program_into(j6_handle_t proc, elf::file &file, uintptr_t image_base, const
         if (seg.type != elf::segment_type::load)
             continue;
 
-        uintptr_t addr = 0;
-
-        // TODO: way to remap VMA as read-only if there's no write flag on
-        // the segment
+        // Segments start out writable to be set up, and then lose
+        // write permission if the segment doesn't have it
         unsigned long flags = j6_vm_flag_write;
         if (seg.flags.get(elf::segment_flags::exec))
             flags |= j6_vm_flag_exec;
 
-        uintptr_t start = file.base() + seg.offset;
         size_t prologue = seg.vaddr & 0xfff;
-        size_t epilogue = seg.mem_size - seg.file_size;
-
-        j6_handle_t sub_vma = j6_handle_invalid;
-        j6_status_t res = j6_vma_create_map(&sub_vma, seg.mem_size+prologue, &addr, flags);
-        if (res != j6_status_ok) {
-            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating sub vma: %lx", path, res);
+        j6_handle_t sub_vma = create_segment_vma(lf, file, seg, flags, path);
+        if (sub_vma == j6_handle_invalid)
             return 0;
-        }
 
-        uint8_t *src = reinterpret_cast<uint8_t *>(start);
-        uint8_t *dest = reinterpret_cast<uint8_t *>(addr);
-        memset(dest, 0, prologue);
-        memcpy(dest+prologue, src, seg.file_size);
-        memset(dest+prologue+seg.file_size, 0, epilogue);
+        if (!seg.flags.get(elf::segment_flags::write)) {
+            j6_status_t res = j6_vma_protect(sub_vma, flags & ~j6_vm_flag_write);
+            if (res != j6_status_ok) {
+                j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': protecting sub vma: %lx", path, res);
+                return 0;
+            }
+        }
 
         // end of segment
         uintptr_t eos = image_base + seg.vaddr + seg.mem_size + prologue;
@@ -122,7 +186,7 @@ load_program_into(j6_handle_t proc, elf::file &file, uintptr_t image_base, const
 
         uintptr_t start_addr = (image_base + seg.vaddr) & ~0xfffull;
         j6::syslog(j6::logs::srv, j6::log_level::verbose, "Mapping segment from %s at %012lx - %012lx", path, start_addr, start_addr+seg.mem_size);
-        res = j6_vma_map(sub_vma, proc, &start_addr, j6_vm_flag_exact);
+        j6_status_t res = j6_vma_map(sub_vma, proc, &start_addr, j6_vm_flag_exact);
         if (res != j6_status_ok) {
             j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': mapping sub vma to child: %lx", path, res);
             return 0;
@@ -168,20 +232,32 @@ create_process(j6_handle_t sys, j6_handle_t slp, j6_handle_t vfs)
     return proc;
 }
 
-static util::buffer
+static loaded_file
 load_file(const j6romfs::fs &fs, const char *path)
 {
     const j6romfs::inode *in = fs.lookup_inode(path);
     if (!in || in->type != j6romfs::inode_type::file)
-        return {};
+        return {j6_handle_invalid, {}};
+
+    auto it = loaded_files.find(in);
+    if (it != loaded_files.end())
+        return it->second;
 
     j6::syslog(j6::logs::srv, j6::log_level::info, "  Loading file: %s", path);
 
-    uint8_t *data = new uint8_t [in->size];
-    util::buffer program {data, in->size};
+    uintptr_t addr = 0;
+    j6_handle_t vma = j6_handle_invalid;
+    j6_status_t res = j6_vma_create_map(&vma, in->size, &addr, j6_vm_flag_write);
+    if (res != j6_status_ok) {
+        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating file vma: %lx", path, res);
+        return {j6_handle_invalid, {}};
+    }
+
+    loaded_file file {vma, util::buffer::from(addr, in->size)};
+    fs.load_inode_data(in, file.data);
 
-    fs.load_inode_data(in, program);
-    return program;
+    loaded_files.insert({in, file});
+    return file;
 }
 
 
@@ -192,11 +268,11 @@ load_program(
         const module *arg)
 {
     j6::syslog(j6::logs::srv, j6::log_level::info, "Loading program '%s' into new process", path);
-    util::buffer program_data = load_file(fs, path);
-    if (!program_data.pointer)
+    loaded_file program_file = load_file(fs, path);
+    if (!program_file.data.pointer)
         return false;
 
-    elf::file program_elf {program_data};
+    elf::file program_elf {program_file.data};
 
     bool dyn = program_elf.type() == elf::filetype::shared;
     uintptr_t program_image_base = 0;
@@ -209,7 +285,7 @@ load_program(
     }
 
     j6_handle_t proc = create_process(sys, slp, vfs);
-    uintptr_t eop = load_program_into(proc, program_elf, program_image_base, path);
+    uintptr_t eop = load_program_into(proc, program_file, program_elf, program_image_base, path);
     if (!eop)
         return false;
 
@@ -272,22 +348,21 @@ load_program(
         for (auto seg : program_elf.segments()) {
             if (seg.type == elf::segment_type::interpreter) {
                 const char *ldso_path = reinterpret_cast<const char*>(program_elf.base() + seg.offset);
-                util::buffer ldso_data = load_file(fs, ldso_path);
-                if (!ldso_data.pointer)
+                loaded_file ldso_file = load_file(fs, ldso_path);
+                if (!ldso_file.data.pointer)
                     return false;
 
-                elf::file ldso_elf {ldso_data};
+                elf::file ldso_elf {ldso_file.data};
                 if (!ldso_elf.valid(elf::filetype::shared)) {
                     j6::syslog(j6::logs::srv, j6::log_level::error, "error loading dynamic linker for '%s': ELF is invalid", path);
                     return false;
                 }
 
-                uintptr_t eop = load_program_into(proc, ldso_elf, ldso_image_base, ldso_path);
+                uintptr_t eop = load_program_into(proc, ldso_file, ldso_elf, ldso_image_base, ldso_path);
                 eop = (eop & ~0xfffffull) + 0x100000;
                 loader_arg->loader_base = ldso_image_base;
                 loader_arg->start_addr = eop;
                 entrypoint = ldso_elf.entrypoint() + ldso_image_base;
-                delete [] reinterpret_cast<uint8_t*>(ldso_data.pointer);
                 break;
             }
         }
@@ -313,8 +388,6 @@ load_program(
         return false;
     }
 
-    // TODO: smart pointer this, it's a memory leak if we return early
-    delete [] reinterpret_cast<uint8_t*>(program_data.pointer);
     return true;
 }
 
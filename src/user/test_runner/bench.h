@@ -0,0 +1,24 @@
+#pragma once
+/// \file bench.h
+/// Timing helpers for benchmark test cases
+
+#include <stdint.h>
+#include <j6/syslog.hh>
+
+namespace test {
+
+/// Read the CPU timestamp counter.
+/// \returns  The current TSC value, in cycles
+inline uint64_t
+cycles()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+} // namespace test
+
+/// Write a benchmark result to the system log, tagged with the test name
+#define BENCH_REPORT(fmt, ...) \
+    j6::syslog(j6::logs::app, j6::log_level::info, "bench %s: " fmt, test_name, __VA_ARGS__)
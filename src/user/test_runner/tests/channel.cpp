@@ -0,0 +1,154 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <j6/channel.hh>
+#include <j6/clock.h>
+#include <j6/errors.h>
+#include <j6/syscalls.h>
+#include <j6/thread.hh>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct channel_tests :
+    public test::fixture
+{
+};
+
+namespace {
+
+using test_thread = j6::thread<void (*)()>;
+
+constexpr size_t channel_size = 0x10000;
+constexpr size_t stream_bytes = 0x100000;
+constexpr size_t max_message = 0x1000;
+constexpr size_t producer_stack = 0x4000;
+constexpr size_t message_sizes[] = {16, 256, max_message};
+
+j6::channel *stream_channel = nullptr;
+volatile size_t stream_message = 0;
+volatile unsigned send_errors = 0;
+uint8_t send_buffer[max_message];
+uint8_t receive_buffer[channel_size];
+
+void
+producer_proc()
+{
+    const size_t len = stream_message;
+    for (size_t sent = 0; sent < stream_bytes; sent += len) {
+        if (stream_channel->send(send_buffer, len) != j6_status_ok)
+            ++send_errors;
+    }
+}
+
+// Stream data through a channel from another thread, and report
+// its throughput
+bool
+run_stream(bool spsc, size_t len, const char *test_name)
+{
+    stream_channel = j6::channel::create(channel_size, spsc);
+    if (!stream_channel)
+        return false;
+
+    stream_message = len;
+    send_errors = 0;
+
+    // Every message holds the same bytes, so the byte at each stream
+    // position is known
+    for (size_t i = 0; i < len; ++i)
+        send_buffer[i] = i & 0xff;
+
+    uint64_t start_ns = 0;
+    bool have_clock = j6_clock_gettime(&start_ns) == j6_status_ok;
+    uint64_t start = test::cycles();
+
+    test_thread producer {producer_proc, producer_stack};
+    if (producer.start() != j6_status_ok) {
+        delete stream_channel;
+        stream_channel = nullptr;
+        return false;
+    }
+
+    bool intact = true;
+    size_t received = 0;
+    while (received < stream_bytes) {
+        size_t size = sizeof(receive_buffer);
+        if (stream_channel->receive(receive_buffer, &size) != j6_status_ok)
+            break;
+
+        for (size_t i = 0; i < size; ++i) {
+            if (receive_buffer[i] != ((received + i) % len & 0xff)) {
+                intact = false;
+                break;
+            }
+        }
+        received += size;
+    }
+
+    uint64_t cycles = test::cycles() - start;
+    uint64_t end_ns = 0;
+    have_clock = have_clock && j6_clock_gettime(&end_ns) == j6_status_ok;
+
+    producer.join();
+    delete stream_channel;
+    stream_channel = nullptr;
+
+    const size_t messages = stream_bytes / len;
+    const char *mode = spsc ? "spsc" : "locked";
+    uint64_t ns = end_ns - start_ns;
+    if (have_clock && ns) {
+        BENCH_REPORT("%s %4lld byte messages: %lld MB/s, %lld messages/s, %lld cycles/message",
+                mode, len, stream_bytes * 1000 / ns, messages * 1000000000ull / ns,
+                cycles / messages);
+    } else {
+        BENCH_REPORT("%s %4lld byte messages: %lld cycles/message",
+                mode, len, cycles / messages);
+    }
+
+    return intact && received == stream_bytes && !send_errors;
+}
+
+} // namespace
+
+TEST_CASE( channel_tests, wrap_around )
+{
+    j6::channel *chan = j6::channel::create(channel_size, true);
+    REQUIRE( chan, "Could not create a channel" );
+
+    // Sends that don't divide the capacity eventually wrap mid-message
+    constexpr size_t len = 1000;
+    uint8_t out[len];
+    uint8_t in[len];
+
+    const size_t rounds = chan->capacity() / len * 3;
+    unsigned mismatches = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < len; ++i)
+            out[i] = (r + i) & 0xff;
+
+        CHECK( chan->send(out, len, false) == j6_status_ok, "Send on an empty channel failed" );
+
+        size_t size = len;
+        CHECK( chan->receive(in, &size, false) == j6_status_ok, "Receive on a full channel failed" );
+        if (size != len || memcmp(in, out, len))
+            ++mismatches;
+    }
+
+    CHECK( mismatches == 0, "Data was corrupted wrapping around the channel" );
+
+    size_t size = len;
+    CHECK( chan->receive(in, &size, false) == j6_status_would_block,
+            "Receive on an empty channel should not block" );
+
+    delete chan;
+}
+
+TEST_CASE( channel_tests, throughput )
+{
+    for (size_t len : message_sizes) {
+        CHECK( run_stream(false, len, test_name), "Locked channel stream failed" );
+        CHECK( run_stream(true, len, test_name), "Lock-free channel stream failed" );
+    }
+}
@@ -0,0 +1,64 @@
+#include <stdint.h>
+
+#include <j6/clock.h>
+#include <j6/errors.h>
+#include <j6/syscalls.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct clock_tests :
+    public test::fixture
+{
+};
+
+namespace {
+
+constexpr unsigned read_rounds = 10000;
+constexpr uint64_t sleep_interval = 10000; // us
+
+} // namespace
+
+TEST_CASE( clock_tests, monotonic )
+{
+    uint64_t prev = 0;
+    j6_status_t s = j6_clock_gettime(&prev);
+    if (s == j6_err_not_ready)
+        return; // The system clock is not the TSC
+
+    REQUIRE( s == j6_status_ok, "Could not read the clock page" );
+
+    for (unsigned i = 0; i < read_rounds; ++i) {
+        uint64_t now = 0;
+        j6_clock_gettime(&now);
+        CHECK( now >= prev, "Clock went backwards" );
+        prev = now;
+    }
+
+    j6_thread_sleep(sleep_interval);
+
+    uint64_t after = 0;
+    j6_clock_gettime(&after);
+    CHECK( after - prev >= sleep_interval * 1000, "Clock did not advance across a sleep" );
+}
+
+TEST_CASE( clock_tests, read_cost )
+{
+    uint64_t ns = 0;
+    if (j6_clock_gettime(&ns) != j6_status_ok)
+        return;
+
+    uint64_t start = test::cycles();
+    for (unsigned i = 0; i < read_rounds; ++i)
+        j6_clock_gettime(&ns);
+    uint64_t clock_cycles = (test::cycles() - start) / read_rounds;
+
+    start = test::cycles();
+    for (unsigned i = 0; i < read_rounds; ++i)
+        j6_noop();
+    uint64_t syscall_cycles = (test::cycles() - start) / read_rounds;
+
+    BENCH_REPORT("j6_clock_gettime %lld cycles, empty syscall %lld cycles",
+            clock_cycles, syscall_cycles);
+}
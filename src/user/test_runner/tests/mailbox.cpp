@@ -4,10 +4,13 @@
 
 #include <j6/errors.h>
 #include <j6/flags.h>
+#include <j6/init.h>
+#include <j6/protocols/service_locator.hh>
 #include <j6/thread.hh>
 #include <j6/types.h>
 #include <j6/syscalls.h>
 
+#include "bench.h"
 #include "test_case.h"
 #include "test_rng.h"
 
@@ -16,12 +19,11 @@ struct mailbox_tests :
 {
 };
 
-static constexpr uintptr_t caller_stack = 0x4000000;
+static constexpr size_t caller_stack = 0x4000;
 static j6_handle_t test_mailbox = j6_handle_invalid;
 
 TEST_CASE( mailbox_tests, would_block )
 {
-    return;
     j6_handle_t mb = j6_handle_invalid;
     j6_status_t s;
 
@@ -29,30 +31,27 @@ TEST_CASE( mailbox_tests, would_block )
     CHECK( s == j6_status_ok, "Could not create a mailbox" );
 
     uint64_t tag = 12345;
-    uint64_t subtag = 67890;
-    j6_handle_t handle;
+    size_t data_len = 0;
+    size_t handle_count = 0;
     uint64_t reply_tag = 0;
     uint64_t flags = 0;
 
-    s = j6_mailbox_respond( mb, &tag, &subtag, &handle, &reply_tag, flags );
+    s = j6_mailbox_respond( mb, &tag, nullptr, &data_len, 0,
+            nullptr, &handle_count, &reply_tag, flags );
     CHECK( s == j6_status_would_block, "Should have gotten would block error" );
 
     j6_mailbox_close(mb);
 }
 
 void
-caller_proc(void *)
+caller_proc()
 {
-    j6_status_t s;
-
     uint64_t tag = 12345;
-    uint64_t subtag = 67890;
-    j6_handle_t no_handle = j6_handle_invalid;
-
-    j6_mailbox_call( test_mailbox, &tag, &subtag, &no_handle );
+    size_t data_len = 0;
+    size_t handle_count = 0;
 
-    volatile int i = 0;
-    while (i != 0);
+    j6_mailbox_call( test_mailbox, &tag, nullptr, &data_len, 0,
+            nullptr, &handle_count );
 }
 
 TEST_CASE( mailbox_tests, send_receive )
@@ -67,16 +66,479 @@ TEST_CASE( mailbox_tests, send_receive )
     CHECK( s == j6_status_ok, "Could not start mailbox caller thread" );
 
     uint64_t tag = 0;
-    uint64_t subtag = 0;
+    size_t data_len = 0;
+    size_t handle_count = 0;
     uint64_t reply_tag = 0;
-    j6_handle_t mb_handle = j6_handle_invalid;
 
-    s = j6_mailbox_respond( test_mailbox, &tag, &subtag, &mb_handle, &reply_tag, j6_mailbox_block );
+    s = j6_mailbox_respond( test_mailbox, &tag, nullptr, &data_len, 0,
+            nullptr, &handle_count, &reply_tag, j6_flag_block );
     CHECK( s == j6_status_ok, "Did not respond successfully" );
-
     CHECK_BARE( tag == 12345 );
-    CHECK_BARE( subtag == 67890 );
 
     j6_mailbox_close(test_mailbox);
     caller.join();
 }
+
+static constexpr unsigned round_trips = 1000;
+static constexpr unsigned max_cpus = 64;
+static volatile uint64_t round_trip_cycles = 0;
+
+// Count the direct switches between IPC partners on all CPUs
+static uint64_t
+total_handoffs()
+{
+    j6_run_queue_stats stats[max_cpus];
+    size_t count = max_cpus;
+    if (j6_sched_stats(stats, &count) != j6_status_ok)
+        return 0;
+
+    uint64_t handoffs = 0;
+    for (size_t i = 0; i < count && i < max_cpus; ++i)
+        handoffs += stats[i].handoffs;
+    return handoffs;
+}
+
+void
+round_trip_caller_proc()
+{
+    uint64_t start = test::cycles();
+    for (unsigned i = 0; i < round_trips; ++i) {
+        uint64_t tag = i;
+        size_t data_len = 0;
+        size_t handle_count = 0;
+        j6_mailbox_call( test_mailbox, &tag, nullptr, &data_len, 0,
+                nullptr, &handle_count );
+    }
+    round_trip_cycles = test::cycles() - start;
+}
+
+TEST_CASE( mailbox_tests, round_trip_latency )
+{
+    j6_status_t s;
+
+    s = j6_mailbox_create(&test_mailbox);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    uint64_t handoffs = total_handoffs();
+
+    j6::thread caller {round_trip_caller_proc, caller_stack};
+    s = caller.start();
+    CHECK( s == j6_status_ok, "Could not start mailbox caller thread" );
+
+    uint64_t reply_tag = 0;
+    for (unsigned i = 0; i <= round_trips; ++i) {
+        uint64_t tag = 0;
+        size_t data_len = 0;
+        size_t handle_count = 0;
+
+        // Reply to the previous call, and wait for another unless
+        // that was the last one
+        uint64_t flags = i < round_trips ? j6_flag_block : 0;
+        s = j6_mailbox_respond( test_mailbox, &tag, nullptr, &data_len, 0,
+                nullptr, &handle_count, &reply_tag, flags );
+        if (i < round_trips && s != j6_status_ok)
+            break;
+    }
+    CHECK( s == j6_status_would_block, "Mailbox round trips did not all complete" );
+
+    caller.join();
+    j6_mailbox_close(test_mailbox);
+    handoffs = total_handoffs() - handoffs;
+
+    BENCH_REPORT("%d round trips, %lld cycles/round trip, %lld direct switches",
+            round_trips, round_trip_cycles / round_trips, handoffs);
+}
+
+TEST_CASE( mailbox_tests, cross_process_round_trip )
+{
+    // The service locator lives in srv.init, so calls to it switch
+    // address spaces whenever both run on the same CPU
+    j6_handle_t slp = j6_find_init_handle(j6::proto::sl::id);
+    if (slp == j6_handle_invalid)
+        return;
+
+    unsigned completed = 0;
+    uint64_t start = test::cycles();
+    for (; completed < round_trips; ++completed) {
+        // The locator answers unknown requests with an error
+        // status, without doing any other work
+        uint64_t tag = j6_proto_base_get_proto_id;
+        uint64_t data = 0;
+        size_t data_len = sizeof(data);
+        j6_handle_t handle = j6_handle_invalid;
+        size_t handle_count = 1;
+
+        j6_status_t s = j6_mailbox_call( slp, &tag, &data, &data_len, data_len,
+                &handle, &handle_count );
+        if (s != j6_status_ok || tag != j6_proto_base_status)
+            break;
+    }
+    uint64_t cycles = test::cycles() - start;
+
+    CHECK( completed == round_trips, "Service locator round trips did not all complete" );
+    if (completed)
+        BENCH_REPORT("%d cross-process round trips, %lld cycles/round trip",
+                completed, cycles / completed);
+}
+
+static constexpr size_t max_payload = 0x10000;
+static constexpr unsigned payload_trips = 200;
+static uint8_t caller_buffer[max_payload];
+static uint8_t responder_buffer[max_payload];
+static volatile size_t payload_size = 0;
+static volatile unsigned payload_errors = 0;
+
+void
+payload_caller_proc()
+{
+    for (unsigned i = 0; i < payload_trips; ++i) {
+        memset(caller_buffer, static_cast<uint8_t>(i), payload_size);
+
+        uint64_t tag = i;
+        size_t data_len = sizeof(caller_buffer);
+        size_t handle_count = 0;
+        j6_status_t s = j6_mailbox_call( test_mailbox, &tag, caller_buffer, &data_len,
+                payload_size, nullptr, &handle_count );
+
+        // The responder echoes the payload back
+        if (s != j6_status_ok || data_len != payload_size ||
+                (data_len && caller_buffer[data_len - 1] != static_cast<uint8_t>(i)))
+            ++payload_errors;
+    }
+}
+
+TEST_CASE( mailbox_tests, payload_throughput )
+{
+    static constexpr size_t sizes[] = {0, 64, 512, 0x1000, 0x4000, max_payload};
+
+    for (size_t size : sizes) {
+        j6_status_t s = j6_mailbox_create(&test_mailbox);
+        REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+        payload_size = size;
+        payload_errors = 0;
+
+        j6::thread caller {payload_caller_proc, caller_stack};
+        s = caller.start();
+        CHECK( s == j6_status_ok, "Could not start mailbox caller thread" );
+
+        uint64_t reply_tag = 0;
+        size_t reply_len = 0;
+        uint64_t start = test::cycles();
+        for (unsigned i = 0; i <= payload_trips; ++i) {
+            uint64_t tag = 0;
+            size_t data_len = sizeof(responder_buffer);
+            size_t handle_count = 0;
+
+            uint64_t flags = i < payload_trips ? j6_flag_block : 0;
+            s = j6_mailbox_respond( test_mailbox, &tag, responder_buffer, &data_len,
+                    reply_len, nullptr, &handle_count, &reply_tag, flags );
+            if (i < payload_trips && s != j6_status_ok)
+                break;
+
+            reply_len = data_len;
+        }
+        uint64_t cycles = test::cycles() - start;
+        CHECK( s == j6_status_would_block, "Mailbox payload round trips did not all complete" );
+
+        caller.join();
+        j6_mailbox_close(test_mailbox);
+
+        CHECK( payload_errors == 0, "Mailbox payloads were not echoed back intact" );
+        BENCH_REPORT("%lld byte payload, %d round trips, %lld cycles/round trip",
+                size, payload_trips, cycles / payload_trips);
+    }
+}
+
+TEST_CASE( mailbox_tests, stale_reply_tag )
+{
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handle_count = 0;
+    uint64_t reply_tag = 12345;
+
+    s = j6_mailbox_respond( mb, &tag, nullptr, &data_len, 0,
+            nullptr, &handle_count, &reply_tag, 0 );
+    CHECK( s == j6_err_invalid_arg, "Reply to a message never received should fail" );
+
+    j6_mailbox_close(mb);
+}
+
+using stress_thread = j6::thread<void (*)()>;
+
+static constexpr unsigned stress_responders = 4;
+static constexpr unsigned stress_callers = 16;
+static constexpr unsigned stress_calls = 200;
+static volatile unsigned stress_next_caller = 0;
+static volatile unsigned stress_completed = 0;
+static volatile unsigned stress_errors = 0;
+
+void
+stress_responder_proc()
+{
+    uint64_t reply_tag = 0;
+    uint64_t data = 0;
+    size_t reply_len = 0;
+
+    while (true) {
+        uint64_t tag = 0;
+        size_t data_len = sizeof(data);
+        size_t handle_count = 0;
+
+        j6_status_t s = j6_mailbox_respond( test_mailbox, &tag, &data, &data_len,
+                reply_len, nullptr, &handle_count, &reply_tag, j6_flag_block );
+        if (s != j6_status_ok)
+            break;
+
+        // Answer with the request's tag and data both incremented
+        tag += 1;
+        data += 1;
+        reply_len = data_len;
+    }
+}
+
+void
+stress_caller_proc()
+{
+    unsigned id = __atomic_fetch_add(&stress_next_caller, 1, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < stress_calls; ++i) {
+        uint64_t request = (static_cast<uint64_t>(id) << 32) | i;
+        uint64_t tag = request;
+        uint64_t data = ~request;
+        size_t data_len = sizeof(data);
+        size_t handle_count = 0;
+
+        j6_status_t s = j6_mailbox_call( test_mailbox, &tag, &data, &data_len,
+                data_len, nullptr, &handle_count );
+
+        if (s != j6_status_ok || tag != request + 1 ||
+                data_len != sizeof(data) || data != ~request + 1)
+            __atomic_fetch_add(&stress_errors, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&stress_completed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+TEST_CASE( mailbox_tests, multi_responder_stress )
+{
+    j6_status_t s = j6_mailbox_create(&test_mailbox);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    stress_next_caller = 0;
+    stress_completed = 0;
+    stress_errors = 0;
+
+    stress_thread *responders[stress_responders];
+    for (unsigned i = 0; i < stress_responders; ++i) {
+        responders[i] = new stress_thread {stress_responder_proc, caller_stack};
+        CHECK( responders[i]->start() == j6_status_ok, "Could not start responder thread" );
+    }
+
+    uint64_t start = test::cycles();
+
+    stress_thread *callers[stress_callers];
+    for (unsigned i = 0; i < stress_callers; ++i) {
+        callers[i] = new stress_thread {stress_caller_proc, caller_stack};
+        CHECK( callers[i]->start() == j6_status_ok, "Could not start caller thread" );
+    }
+
+    for (unsigned i = 0; i < stress_callers; ++i) {
+        callers[i]->join();
+        delete callers[i];
+    }
+
+    uint64_t cycles = test::cycles() - start;
+
+    // Closing the mailbox sends the responders away
+    j6_mailbox_close(test_mailbox);
+    for (unsigned i = 0; i < stress_responders; ++i) {
+        responders[i]->join();
+        delete responders[i];
+    }
+
+    CHECK( stress_errors == 0, "Some calls got the wrong replies" );
+    CHECK( stress_completed == stress_callers * stress_calls, "Not all calls completed" );
+
+    if (stress_completed)
+        BENCH_REPORT("%d callers, %d responders, %d calls, %lld cycles/call",
+                stress_callers, stress_responders, stress_completed,
+                cycles / stress_completed);
+}
+
+static constexpr unsigned idle_responders = 64; // The kernel's max pending replies
+static constexpr uint64_t idle_settle = 10000; // us
+
+TEST_CASE( mailbox_tests, idle_responders )
+{
+    j6_status_t s = j6_mailbox_create(&test_mailbox);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    stress_thread *responders[idle_responders];
+    for (unsigned i = 0; i < idle_responders; ++i) {
+        responders[i] = new stress_thread {stress_responder_proc, caller_stack};
+        CHECK( responders[i]->start() == j6_status_ok, "Could not start responder thread" );
+    }
+
+    // Let every responder block waiting for a caller
+    j6_thread_sleep(idle_settle);
+
+    // Blocked responders hold no reply slots, so another can still ask
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handle_count = 0;
+    uint64_t reply_tag = 0;
+    s = j6_mailbox_respond( test_mailbox, &tag, nullptr, &data_len, 0,
+            nullptr, &handle_count, &reply_tag, 0 );
+    CHECK( s == j6_status_would_block, "Idle responders used up the reply slots" );
+
+    uint64_t data = 41;
+    tag = 7;
+    data_len = sizeof(data);
+    s = j6_mailbox_call( test_mailbox, &tag, &data, &data_len,
+            data_len, nullptr, &handle_count );
+    CHECK( s == j6_status_ok && tag == 8 && data == 42, "Call with idle responders failed" );
+
+    j6_mailbox_close(test_mailbox);
+    for (unsigned i = 0; i < idle_responders; ++i) {
+        responders[i]->join();
+        delete responders[i];
+    }
+}
+
+static constexpr unsigned batch_requests = 10000;
+static constexpr uint32_t ring_entries = 64;
+
+TEST_CASE( mailbox_tests, ring_vs_sync )
+{
+    j6_status_t s = j6_mailbox_create(&test_mailbox);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    stress_thread responder {stress_responder_proc, caller_stack};
+    CHECK( responder.start() == j6_status_ok, "Could not start responder thread" );
+
+    // Synchronous calls, one at a time
+    unsigned sync_errors = 0;
+    uint64_t start = test::cycles();
+    for (unsigned i = 0; i < batch_requests; ++i) {
+        uint64_t tag = i;
+        uint64_t data = i;
+        size_t data_len = sizeof(data);
+        size_t handle_count = 0;
+
+        s = j6_mailbox_call( test_mailbox, &tag, &data, &data_len,
+                data_len, nullptr, &handle_count );
+        if (s != j6_status_ok || tag != i + 1 || data != i + 1)
+            ++sync_errors;
+    }
+    uint64_t sync_cycles = test::cycles() - start;
+    CHECK( sync_errors == 0, "Synchronous calls got the wrong replies" );
+
+    // The same requests submitted on a ring, waiting once for many
+    size_t ring_size = sizeof(j6_mailbox_ring) + 2 * ring_entries * sizeof(j6_mailbox_ring_entry);
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    s = j6_vma_create_map(&vma, ring_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not map a ring" );
+
+    s = j6_mailbox_ring_attach(test_mailbox, addr, ring_entries);
+    REQUIRE( s == j6_status_ok, "Could not attach a ring" );
+
+    auto *ring = reinterpret_cast<volatile j6_mailbox_ring*>(addr);
+    auto *sq = reinterpret_cast<j6_mailbox_ring_entry*>(addr + sizeof(j6_mailbox_ring));
+    auto *cq = sq + ring_entries;
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    unsigned ring_errors = 0;
+    unsigned enters = 0;
+
+    start = test::cycles();
+    while (completed < batch_requests) {
+        while (submitted < batch_requests &&
+                ring->sq_tail - ring->sq_head < ring_entries &&
+                ring->sq_tail - ring->cq_head < ring_entries) {
+            j6_mailbox_ring_entry &e = sq[ring->sq_tail & (ring_entries - 1)];
+            uint64_t data = submitted;
+            e.id = submitted;
+            e.tag = submitted;
+            e.data_len = sizeof(data);
+            memcpy(e.data, &data, sizeof(data));
+
+            ring->sq_tail = ring->sq_tail + 1;
+            ++submitted;
+        }
+
+        size_t accepted = 0;
+        s = j6_mailbox_ring_enter(test_mailbox, addr, ring_entries / 2, &accepted);
+        ++enters;
+        if (s != j6_status_ok)
+            break;
+
+        while (ring->cq_head != ring->cq_tail) {
+            const j6_mailbox_ring_entry &e = cq[ring->cq_head & (ring_entries - 1)];
+            uint64_t data = 0;
+            memcpy(&data, e.data, sizeof(data));
+
+            if (e.status != j6_status_ok || e.tag != e.id + 1 ||
+                    e.data_len != sizeof(data) || data != e.id + 1)
+                ++ring_errors;
+
+            ring->cq_head = ring->cq_head + 1;
+            ++completed;
+        }
+    }
+    uint64_t ring_cycles = test::cycles() - start;
+
+    j6_mailbox_close(test_mailbox);
+    responder.join();
+    j6_vma_unmap(vma, j6_handle_invalid);
+
+    CHECK( s == j6_status_ok, "Ring enter failed" );
+    CHECK( ring_errors == 0, "Ring submissions got the wrong completions" );
+    CHECK( completed == batch_requests, "Not all ring submissions completed" );
+
+    BENCH_REPORT("%d requests: sync %lld cycles/request, ring %lld cycles/request, %d ring enters",
+            batch_requests, sync_cycles / batch_requests,
+            ring_cycles / batch_requests, enters);
+}
+
+TEST_CASE( mailbox_tests, ring_detach )
+{
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    size_t ring_size = sizeof(j6_mailbox_ring) + 2 * ring_entries * sizeof(j6_mailbox_ring_entry);
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    s = j6_vma_create_map(&vma, ring_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not map a ring" );
+
+    s = j6_mailbox_ring_attach(mb, addr, ring_entries);
+    REQUIRE( s == j6_status_ok, "Could not attach a ring" );
+
+    s = j6_mailbox_ring_attach(mb, addr, ring_entries);
+    CHECK( s == j6_status_exists, "Attaching the same ring twice should fail" );
+
+    size_t accepted = 0;
+    s = j6_mailbox_ring_detach(mb, addr);
+    CHECK( s == j6_status_ok, "Could not detach a ring" );
+    s = j6_mailbox_ring_enter(mb, addr, 0, &accepted);
+    CHECK( s == j6_err_invalid_arg, "Entering a detached ring should fail" );
+    s = j6_mailbox_ring_detach(mb, addr);
+    CHECK( s == j6_err_invalid_arg, "Detaching a ring twice should fail" );
+
+    // Unmapping the ring's memory detaches it too
+    s = j6_mailbox_ring_attach(mb, addr, ring_entries);
+    CHECK( s == j6_status_ok, "Could not attach a ring again after detaching" );
+    j6_vma_unmap(vma, j6_handle_invalid);
+    s = j6_mailbox_ring_enter(mb, addr, 0, &accepted);
+    CHECK( s == j6_err_invalid_arg, "Unmapping a ring did not detach it" );
+
+    j6_mailbox_close(mb);
+}
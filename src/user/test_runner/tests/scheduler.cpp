@@ -0,0 +1,225 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <j6/errors.h>
+#include <j6/syscalls.h>
+#include <j6/thread.hh>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct scheduler_tests :
+    public test::fixture
+{
+};
+
+namespace {
+
+using test_thread = j6::thread<void (*)()>;
+
+constexpr size_t sleeper_stack_size = 0x4000;
+constexpr uint64_t sleeper_interval = 50000; // us
+constexpr unsigned switch_rounds = 1000;
+constexpr unsigned max_sleepers = 256;
+constexpr unsigned max_cpus = 64;
+constexpr unsigned fork_rounds = 16;
+constexpr unsigned fork_width = 16;
+constexpr unsigned spin_iterations = 200000;
+
+constexpr uint64_t balance_poll_interval = 100; // us
+constexpr uint64_t idle_measure_interval = 1000000; // us
+constexpr uint64_t max_idle_interrupt_rate = 100; // per second
+constexpr unsigned balance_max_polls = 10000;
+
+volatile bool sleepers_done = false;
+volatile bool spinners_done = false;
+
+void
+sleeper_proc()
+{
+    while (!sleepers_done)
+        j6_thread_sleep(sleeper_interval);
+}
+
+// Sleeping with a zero duration blocks with an already-passed
+// timeout, so each call is one full trip through the scheduler.
+uint64_t
+cycles_per_switch()
+{
+    uint64_t start = test::cycles();
+    for (unsigned i = 0; i < switch_rounds; ++i)
+        j6_thread_sleep(0);
+    return (test::cycles() - start) / switch_rounds;
+}
+
+void
+spinner_proc()
+{
+    for (volatile unsigned i = 0; i < spin_iterations; ++i);
+}
+
+void
+unbounded_spinner_proc()
+{
+    while (!spinners_done);
+}
+
+size_t
+get_run_queue_stats(j6_run_queue_stats *stats)
+{
+    size_t count = max_cpus;
+    j6_status_t s = j6_sched_stats(stats, &count);
+    return s == j6_status_ok ? count : 0;
+}
+
+} // namespace
+
+TEST_CASE( scheduler_tests, fork_placement )
+{
+    j6_run_queue_stats before[max_cpus];
+    j6_run_queue_stats after[max_cpus];
+
+    size_t cpus = get_run_queue_stats(before);
+    REQUIRE( cpus > 0, "Could not get run queue stats" );
+
+    uint64_t start = test::cycles();
+    for (unsigned round = 0; round < fork_rounds; ++round) {
+        test_thread *threads[fork_width];
+        for (unsigned i = 0; i < fork_width; ++i) {
+            threads[i] = new test_thread {spinner_proc, sleeper_stack_size};
+            CHECK( threads[i]->start() == j6_status_ok, "Could not start spinner thread" );
+        }
+
+        for (unsigned i = 0; i < fork_width; ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+    }
+    uint64_t cycles = test::cycles() - start;
+
+    REQUIRE( get_run_queue_stats(after) == cpus, "Could not get run queue stats" );
+
+    uint64_t added = 0;
+    unsigned used = 0;
+    for (size_t i = 0; i < cpus; ++i) {
+        uint64_t placed = after[i].added - before[i].added;
+        uint64_t migrated = after[i].migrated - before[i].migrated;
+        added += placed;
+        if (placed) ++used;
+
+        BENCH_REPORT("CPU%02d: %4lld placed, %4lld migrated, load %d.%02d",
+                i, placed, migrated, after[i].load >> 8, ((after[i].load & 0xff) * 100) >> 8);
+    }
+
+    BENCH_REPORT("%d threads in %lld cycles", fork_rounds * fork_width, cycles);
+
+    CHECK( added >= fork_rounds * fork_width, "Not all threads were placed" );
+    if (cpus > 1)
+        CHECK( used > 1, "All threads were placed on one CPU" );
+}
+
+TEST_CASE( scheduler_tests, time_to_balance )
+{
+    j6_run_queue_stats before[max_cpus];
+    j6_run_queue_stats stats[max_cpus];
+
+    size_t cpus = get_run_queue_stats(before);
+    REQUIRE( cpus > 0, "Could not get run queue stats" );
+
+    // Start a burst of CPU-bound threads faster than placement can
+    // see them run, then wait for every CPU to have work
+    const unsigned count = cpus * 2;
+    test_thread *threads[max_cpus * 2];
+
+    spinners_done = false;
+    uint64_t start = test::cycles();
+    for (unsigned i = 0; i < count; ++i) {
+        threads[i] = new test_thread {unbounded_spinner_proc, sleeper_stack_size};
+        CHECK( threads[i]->start() == j6_status_ok, "Could not start spinner thread" );
+    }
+
+    bool balanced = false;
+    for (unsigned poll = 0; poll < balance_max_polls && !balanced; ++poll) {
+        if (get_run_queue_stats(stats) != cpus)
+            break;
+
+        balanced = true;
+        for (size_t i = 0; i < cpus; ++i) {
+            if (!stats[i].busy && !stats[i].ready)
+                balanced = false;
+        }
+
+        if (!balanced)
+            j6_thread_sleep(balance_poll_interval);
+    }
+    uint64_t cycles = test::cycles() - start;
+
+    spinners_done = true;
+    for (unsigned i = 0; i < count; ++i) {
+        threads[i]->join();
+        delete threads[i];
+    }
+
+    uint64_t migrated = 0;
+    for (size_t i = 0; i < cpus; ++i)
+        migrated += stats[i].migrated - before[i].migrated;
+
+    BENCH_REPORT("%d threads on %d CPUs balanced in %lld cycles, %lld migrations",
+            count, cpus, cycles, migrated);
+
+    CHECK( balanced, "CPU-bound threads were never spread across all CPUs" );
+}
+
+TEST_CASE( scheduler_tests, idle_timer_interrupts )
+{
+    j6_run_queue_stats before[max_cpus];
+    j6_run_queue_stats after[max_cpus];
+
+    size_t cpus = get_run_queue_stats(before);
+    REQUIRE( cpus > 0, "Could not get run queue stats" );
+
+    // With nothing runnable, idle CPUs should take (almost) no
+    // timer interrupts while this thread sleeps
+    j6_thread_sleep(idle_measure_interval);
+
+    REQUIRE( get_run_queue_stats(after) == cpus, "Could not get run queue stats" );
+
+    // Every CPU except the one now running this thread should have
+    // been idle for the whole interval
+    uint64_t max_rate = 0;
+    for (size_t i = 0; i < cpus; ++i) {
+        uint64_t rate = (after[i].timer_interrupts - before[i].timer_interrupts)
+            * 1000000 / idle_measure_interval;
+        BENCH_REPORT("CPU%02d: %lld timer interrupts/s", i, rate);
+
+        if (!after[i].busy && rate > max_rate)
+            max_rate = rate;
+    }
+
+    CHECK( max_rate < max_idle_interrupt_rate, "Idle CPUs are still taking regular timer interrupts" );
+}
+
+TEST_CASE( scheduler_tests, switch_latency_vs_sleepers )
+{
+    test_thread *sleepers[max_sleepers];
+    unsigned count = 0;
+
+    sleepers_done = false;
+    for (unsigned target = 0; target <= max_sleepers; target = target ? target * 4 : 4) {
+        while (count < target) {
+            test_thread *t = new test_thread {sleeper_proc, sleeper_stack_size};
+            sleepers[count++] = t;
+            CHECK( t->start() == j6_status_ok, "Could not start sleeper thread" );
+        }
+
+        uint64_t cycles = cycles_per_switch();
+        BENCH_REPORT("%3d sleepers: %8lld cycles/switch", count, cycles);
+    }
+
+    sleepers_done = true;
+    for (unsigned i = 0; i < count; ++i) {
+        sleepers[i]->join();
+        delete sleepers[i];
+    }
+}
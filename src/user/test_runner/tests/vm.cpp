@@ -0,0 +1,868 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <j6/clock.h>
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/thread.hh>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+#include "test_rng.h"
+
+struct vm_tests :
+    public test::fixture
+{
+};
+
+namespace {
+
+using test_thread = j6::thread<void (*)()>;
+
+constexpr size_t page_size = 0x1000;
+constexpr size_t thread_stack_size = 0x4000;
+constexpr size_t fault_pages = 256;
+constexpr unsigned max_fault_threads = 8;
+constexpr unsigned max_cpus = 64;
+constexpr size_t random_region_size = 0x40000000; // 1 GiB
+constexpr size_t random_touches = 0x4000;
+constexpr size_t memset_region_size = 0x4000000; // 64 MiB
+constexpr size_t many_vmas = 1000;
+constexpr size_t many_vma_pages = 4;
+constexpr size_t unmap_region_size = 0x4000000; // 64 MiB
+constexpr uint64_t remap_timeout = 1000000000; // ns
+constexpr uint64_t reader_wait = 1000; // us
+constexpr size_t clone_pages = 16;
+constexpr size_t clone_region_size = 0x1000000; // 16 MiB
+constexpr unsigned clone_rounds = 64;
+constexpr unsigned clone_writers = 2;
+constexpr size_t protect_region_size = 0x4000000; // 64 MiB
+constexpr size_t sparse_region_size = 0x4000000; // 64 MiB
+constexpr size_t sparse_stride = 0x10000; // One fault-around window
+constexpr size_t table_region_size = 0x40000000; // 1 GiB
+constexpr size_t table_stride = 0x200000; // One page table
+constexpr size_t large_page_size = 0x200000; // 2 MiB
+constexpr size_t large_region_size = 0x4000000; // 64 MiB
+constexpr unsigned large_page_rounds = 8;
+constexpr uint64_t futex_timeout = 1000000000; // ns
+constexpr uint64_t futex_settle = 10000; // us
+
+volatile unsigned fault_errors = 0;
+
+// Create a new VMA and touch every page of it, so that every
+// touch is a page fault that allocates a new frame
+void
+fault_proc()
+{
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+
+    j6_status_t s = j6_vma_create_map(&vma, fault_pages * page_size, &addr, j6_vm_flag_write);
+    if (s != j6_status_ok) {
+        __atomic_add_fetch(&fault_errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+    for (size_t i = 0; i < fault_pages; ++i)
+        p[i * page_size] = 1;
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+}
+
+unsigned
+cpu_count()
+{
+    j6_run_queue_stats stats[max_cpus];
+    size_t count = max_cpus;
+    if (j6_sched_stats(stats, &count) != j6_status_ok)
+        return 1;
+    return count;
+}
+
+// Touch random pages of a new 1GiB VMA twice: once where most touches
+// fault in new pages, and once where every touch is already mapped and
+// the cost is dominated by TLB misses.
+bool
+random_touch(uint32_t flags, uint64_t &fault_cycles, uint64_t &touch_cycles)
+{
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+
+    j6_status_t s = j6_vma_create_map(&vma, random_region_size, &addr,
+            j6_vm_flag_write | flags);
+    if (s != j6_status_ok)
+        return false;
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+    constexpr size_t pages = random_region_size / page_size;
+
+    test::rng fault_rng {0x5eed};
+    uint64_t start = test::cycles();
+    for (size_t i = 0; i < random_touches; ++i)
+        p[(fault_rng() % pages) * page_size] = 1;
+    fault_cycles = test::cycles() - start;
+
+    test::rng touch_rng {0x5eed};
+    start = test::cycles();
+    for (size_t i = 0; i < random_touches; ++i)
+        p[(touch_rng() % pages) * page_size] += 1;
+    touch_cycles = test::cycles() - start;
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    return true;
+}
+
+bool
+space_stats(j6_vm_space_stats &stats)
+{
+    size_t size = sizeof(stats);
+    return j6_vm_stats(&stats, &size) == j6_status_ok;
+}
+
+uint64_t
+fault_count()
+{
+    j6_vm_space_stats stats;
+    if (!space_stats(stats))
+        return 0;
+    return stats.faults;
+}
+
+volatile uint64_t *volatile reader_addr = nullptr;
+volatile uint64_t reader_value = 0;
+volatile bool reader_stop = false;
+volatile bool reader_hold = false;
+volatile bool reader_held = false;
+
+// Read the value at reader_addr in a loop until told to stop, so
+// that its mapping stays live in this CPU's TLB. While held, stop
+// reading without leaving the CPU, so the address can be remapped
+// without the reader faulting on it.
+void
+reader_proc()
+{
+    while (!reader_stop) {
+        if (reader_hold) {
+            reader_held = true;
+            continue;
+        }
+
+        reader_held = false;
+        volatile uint64_t *p = reader_addr;
+        if (p) reader_value = *p;
+    }
+}
+
+// Wait for the reader thread to see the given value
+bool
+wait_for_reader(uint64_t value)
+{
+    uint64_t start = 0;
+    if (j6_clock_gettime(&start) != j6_status_ok)
+        start = 0;
+
+    while (reader_value != value) {
+        uint64_t now = 0;
+        if (j6_clock_gettime(&now) != j6_status_ok || now - start > remap_timeout)
+            return reader_value == value;
+        j6_thread_sleep(reader_wait);
+    }
+    return true;
+}
+
+volatile uint32_t *volatile futex_word = nullptr;
+volatile uint64_t futex_waited = 0;
+
+// Wait for futex_word to stop being 1, and record how long that took.
+// A lost wakeup shows up as a wait that lasts the whole timeout.
+void
+futex_waiter_proc()
+{
+    uint64_t start = 0, end = 0;
+    j6_clock_gettime(&start);
+
+    while (*futex_word == 1)
+        j6_futex_wait(const_cast<uint32_t*>(futex_word), 1, futex_timeout);
+
+    j6_clock_gettime(&end);
+    futex_waited = end - start;
+}
+
+volatile uint64_t *volatile writer_page = nullptr;
+volatile bool writers_stop = false;
+volatile unsigned writer_next = 0;
+volatile unsigned lost_writes = 0;
+
+// Keep counting up in this writer's own word of writer_page. If a copy
+// on write loses a write made through a stale TLB entry, the word goes
+// backwards.
+void
+writer_proc()
+{
+    unsigned index = __atomic_fetch_add(&writer_next, 1, __ATOMIC_RELAXED);
+    volatile uint64_t *word = writer_page + index;
+
+    uint64_t value = 0;
+    while (!writers_stop) {
+        *word = ++value;
+        if (*word < value)
+            __atomic_add_fetch(&lost_writes, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Map and touch a 64MiB region, and time unmapping it
+uint64_t
+unmap_cycles()
+{
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+
+    j6_status_t s = j6_vma_create_map(&vma, unmap_region_size, &addr, j6_vm_flag_write);
+    if (s != j6_status_ok)
+        return 0;
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+    for (size_t i = 0; i < unmap_region_size; i += page_size)
+        p[i] = 1;
+
+    uint64_t start = test::cycles();
+    j6_vma_unmap(vma, j6_handle_invalid);
+    return test::cycles() - start;
+}
+
+} // namespace
+
+TEST_CASE( vm_tests, unmap_while_reading )
+{
+    constexpr uint64_t old_value = 0x1111;
+    constexpr uint64_t new_value = 0x2222;
+
+    j6_handle_t old_vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t s = j6_vma_create_map(&old_vma, page_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    *reinterpret_cast<volatile uint64_t*>(addr) = old_value;
+
+    // Fill in the replacement VMA's page somewhere else first
+    j6_handle_t new_vma = j6_handle_invalid;
+    uintptr_t new_addr = 0;
+    s = j6_vma_create_map(&new_vma, page_size, &new_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    *reinterpret_cast<volatile uint64_t*>(new_addr) = new_value;
+    j6_vma_unmap(new_vma, j6_handle_invalid);
+
+    reader_stop = false;
+    reader_hold = false;
+    reader_held = false;
+    reader_value = 0;
+    reader_addr = reinterpret_cast<volatile uint64_t*>(addr);
+
+    test_thread reader {reader_proc, thread_stack_size};
+    s = reader.start();
+    REQUIRE( s == j6_status_ok, "Could not start reader thread" );
+
+    CHECK( wait_for_reader(old_value), "Reader never saw the original mapping" );
+
+    // Swap the mapping out from under the reader. If its CPU kept a
+    // stale TLB entry, it would keep reading the old page's frame.
+    reader_hold = true;
+    while (!reader_held)
+        j6_thread_sleep(reader_wait);
+
+    j6_vma_unmap(old_vma, j6_handle_invalid);
+    s = j6_vma_map(new_vma, j6_handle_invalid, &addr, j6_vm_flag_exact);
+    CHECK( s == j6_status_ok, "Could not map new VMA at the old address" );
+
+    if (s == j6_status_ok) {
+        reader_hold = false;
+        CHECK( wait_for_reader(new_value), "Reader still saw the unmapped page" );
+    }
+
+    reader_stop = true;
+    reader.join();
+    reader_addr = nullptr;
+
+    j6_vma_unmap(new_vma, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, unmap_latency )
+{
+    uint64_t alone = unmap_cycles();
+    CHECK( alone, "Could not create VMA" );
+
+    // Keep another thread in this address space running, so the
+    // unmap has to shoot down its TLB entries as well
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t s = j6_vma_create_map(&vma, page_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    reader_stop = false;
+    reader_hold = false;
+    reader_addr = reinterpret_cast<volatile uint64_t*>(addr);
+
+    test_thread reader {reader_proc, thread_stack_size};
+    s = reader.start();
+    REQUIRE( s == j6_status_ok, "Could not start reader thread" );
+
+    uint64_t shared = unmap_cycles();
+    CHECK( shared, "Could not create VMA" );
+
+    reader_stop = true;
+    reader.join();
+    reader_addr = nullptr;
+    j6_vma_unmap(vma, j6_handle_invalid);
+
+    constexpr size_t pages = unmap_region_size / page_size;
+    BENCH_REPORT("64MiB unmap: %lld cycles alone (%lld/page), %lld cycles with a reader (%lld/page), %d cpus",
+            alone, alone / pages, shared, shared / pages, cpu_count());
+}
+
+TEST_CASE( vm_tests, clone_copy_on_write )
+{
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t src_addr = 0;
+    j6_status_t s = j6_vma_create_map(&source, clone_pages * page_size, &src_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    volatile uint8_t *src = reinterpret_cast<volatile uint8_t*>(src_addr);
+    for (size_t i = 0; i < clone_pages; ++i)
+        src[i * page_size] = i + 1;
+
+    // Clone the second half of the source, plus as many pages again
+    // that are past the source's pages
+    constexpr size_t half = clone_pages / 2;
+    j6_handle_t clone = j6_handle_invalid;
+    s = j6_vma_clone(source, &clone, half * page_size, clone_pages * page_size, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not clone VMA" );
+
+    uintptr_t clone_addr = 0;
+    s = j6_vma_map(clone, j6_handle_invalid, &clone_addr, 0);
+    REQUIRE( s == j6_status_ok, "Could not map cloned VMA" );
+
+    volatile uint8_t *dst = reinterpret_cast<volatile uint8_t*>(clone_addr);
+    for (size_t i = 0; i < half; ++i)
+        CHECK( dst[i * page_size] == half + i + 1, "Clone does not see source's contents" );
+
+    // Writes on either side must not be seen by the other
+    dst[0] = 0xaa;
+    CHECK( src[half * page_size] == half + 1, "Source saw a write to the clone" );
+
+    src[(half + 1) * page_size] = 0xbb;
+    CHECK( dst[page_size] == half + 2, "Clone saw a write to the source" );
+    CHECK( dst[0] == 0xaa, "Clone lost its own write" );
+
+    // Pages past the shared range are the clone's own
+    dst[half * page_size] = 0xcc;
+    CHECK( dst[half * page_size] == 0xcc, "Could not write clone's unshared page" );
+
+    j6_vma_unmap(clone, j6_handle_invalid);
+    j6_vma_unmap(source, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, clone_last_share )
+{
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t src_addr = 0;
+    j6_status_t s = j6_vma_create_map(&source, clone_pages * page_size, &src_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    volatile uint8_t *src = reinterpret_cast<volatile uint8_t*>(src_addr);
+    for (size_t i = 0; i < clone_pages; ++i) {
+        src[i * page_size] = i + 1;
+        src[i * page_size + 1] = i + 2;
+    }
+
+    for (unsigned round = 0; round < clone_rounds; ++round) {
+        j6_handle_t clone = j6_handle_invalid;
+        s = j6_vma_clone(source, &clone, 0, clone_pages * page_size, j6_vm_flag_write);
+        REQUIRE( s == j6_status_ok, "Could not clone VMA" );
+
+        uintptr_t clone_addr = 0;
+        s = j6_vma_map(clone, j6_handle_invalid, &clone_addr, 0);
+        REQUIRE( s == j6_status_ok, "Could not map cloned VMA" );
+
+        // Writing the source gives it copies, leaving the clone as the
+        // last holder of the original pages. The clone's own writes then
+        // take them back, and must keep the rest of their contents.
+        for (size_t i = 0; i < clone_pages; ++i)
+            src[i * page_size] = i + 1;
+
+        volatile uint8_t *dst = reinterpret_cast<volatile uint8_t*>(clone_addr);
+        unsigned errors = 0;
+        for (size_t i = 0; i < clone_pages; ++i) {
+            dst[i * page_size] = 0xaa;
+            if (dst[i * page_size + 1] != i + 2 || src[i * page_size] != i + 1)
+                ++errors;
+        }
+
+        CHECK( errors == 0, "Pages changed when the last holder wrote them" );
+        j6_vma_unmap(clone, j6_handle_invalid);
+    }
+
+    j6_vma_unmap(source, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, clone_while_writing )
+{
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t src_addr = 0;
+    j6_status_t s = j6_vma_create_map(&source, page_size, &src_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    writer_page = reinterpret_cast<volatile uint64_t*>(src_addr);
+    writers_stop = false;
+    writer_next = 0;
+    lost_writes = 0;
+
+    test_thread *writers[clone_writers];
+    for (unsigned i = 0; i < clone_writers; ++i) {
+        writers[i] = new test_thread {writer_proc, thread_stack_size};
+        s = writers[i]->start();
+        REQUIRE( s == j6_status_ok, "Could not start writer thread" );
+    }
+
+    // Every clone takes away the source's writable mappings while the
+    // writers are using them, and their next writes copy the page
+    unsigned clone_errors = 0;
+    for (unsigned round = 0; round < clone_rounds; ++round) {
+        j6_handle_t clone = j6_handle_invalid;
+        if (j6_vma_clone(source, &clone, 0, page_size, j6_vm_flag_write) != j6_status_ok)
+            ++clone_errors;
+        j6_thread_sleep(reader_wait);
+    }
+
+    writers_stop = true;
+    for (unsigned i = 0; i < clone_writers; ++i) {
+        writers[i]->join();
+        delete writers[i];
+    }
+    writer_page = nullptr;
+
+    CHECK( clone_errors == 0, "Could not clone VMA" );
+    CHECK( lost_writes == 0, "Writes to the source were lost while cloning it" );
+
+    j6_vma_unmap(source, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, futex_on_shared_page )
+{
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t src_addr = 0;
+    j6_status_t s = j6_vma_create_map(&source, page_size, &src_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    volatile uint32_t *word = reinterpret_cast<volatile uint32_t*>(src_addr);
+    *word = 1;
+
+    // Cloning shares the word's page copy-on-write, so the write that
+    // releases the waiter moves the word to a new frame
+    j6_handle_t clone = j6_handle_invalid;
+    s = j6_vma_clone(source, &clone, 0, page_size, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not clone VMA" );
+
+    uintptr_t clone_addr = 0;
+    s = j6_vma_map(clone, j6_handle_invalid, &clone_addr, 0);
+    REQUIRE( s == j6_status_ok, "Could not map cloned VMA" );
+
+    futex_word = word;
+    futex_waited = 0;
+    test_thread waiter {futex_waiter_proc, thread_stack_size};
+    REQUIRE( waiter.start() == j6_status_ok, "Could not start waiter thread" );
+
+    j6_thread_sleep(futex_settle);
+    *word = 2;
+    j6_futex_wake(const_cast<uint32_t*>(word), 0);
+    waiter.join();
+
+    CHECK( futex_waited < futex_timeout, "Waking a futex on a copied page was lost" );
+
+    j6_vma_unmap(clone, j6_handle_invalid);
+    j6_vma_unmap(source, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, clone_vs_copy )
+{
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t src_addr = 0;
+    j6_status_t s = j6_vma_create_map(&source, clone_region_size, &src_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    memset(reinterpret_cast<void*>(src_addr), 0x5a, clone_region_size);
+
+    // Copying, like the loaders used to for every program segment
+    j6_handle_t copy = j6_handle_invalid;
+    uintptr_t copy_addr = 0;
+    uint64_t start = test::cycles();
+    s = j6_vma_create_map(&copy, clone_region_size, &copy_addr, j6_vm_flag_write);
+    if (s == j6_status_ok)
+        memcpy(reinterpret_cast<void*>(copy_addr), reinterpret_cast<void*>(src_addr), clone_region_size);
+    uint64_t copy_cycles = test::cycles() - start;
+    CHECK( s == j6_status_ok, "Could not create VMA" );
+
+    // Cloning, and then reading every page
+    j6_handle_t clone = j6_handle_invalid;
+    uintptr_t clone_addr = 0;
+    start = test::cycles();
+    s = j6_vma_clone(source, &clone, 0, clone_region_size, j6_vm_flag_write);
+    if (s == j6_status_ok)
+        s = j6_vma_map(clone, j6_handle_invalid, &clone_addr, 0);
+    uint64_t clone_cycles = test::cycles() - start;
+    REQUIRE( s == j6_status_ok, "Could not clone VMA" );
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(clone_addr);
+    uint8_t sum = 0;
+    start = test::cycles();
+    for (size_t i = 0; i < clone_region_size; i += page_size)
+        sum += p[i];
+    uint64_t read_cycles = test::cycles() - start;
+    CHECK( sum == uint8_t(0x5a * (clone_region_size / page_size)), "Clone did not share source's contents" );
+
+    BENCH_REPORT("16MiB: %lld cycles to copy, %lld cycles to clone, %lld cycles to read clone",
+            copy_cycles, clone_cycles, read_cycles);
+
+    j6_vma_unmap(clone, j6_handle_invalid);
+    j6_vma_unmap(copy, j6_handle_invalid);
+    j6_vma_unmap(source, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, protect_read_only )
+{
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t s = j6_vma_create_map(&vma, protect_region_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    memset(reinterpret_cast<void*>(addr), 0x3c, protect_region_size);
+
+    s = j6_vma_protect(vma, j6_vm_flag_write | j6_vm_flag_large_pages);
+    CHECK( s == j6_err_invalid_arg, "Protect accepted flags other than write and exec" );
+
+    // Writing to the region now would fault, so only read it
+    uint64_t start = test::cycles();
+    s = j6_vma_protect(vma, j6_vm_flag_none);
+    uint64_t ro_cycles = test::cycles() - start;
+    REQUIRE( s == j6_status_ok, "Could not make VMA read-only" );
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < protect_region_size; i += page_size)
+        sum += p[i];
+    CHECK( sum == uint8_t(0x3c * (protect_region_size / page_size)), "Read-only VMA lost its contents" );
+
+    // Pages made writable again are faulted back in on their next write
+    start = test::cycles();
+    s = j6_vma_protect(vma, j6_vm_flag_write);
+    uint64_t rw_cycles = test::cycles() - start;
+    REQUIRE( s == j6_status_ok, "Could not make VMA writable" );
+
+    p[0] = 0xc3;
+    p[protect_region_size - 1] = 0xc3;
+    CHECK( p[0] == 0xc3 && p[page_size] == 0x3c, "Could not write VMA after making it writable" );
+
+    BENCH_REPORT("64MiB: %lld cycles to make read-only, %lld cycles to make writable",
+            ro_cycles, rw_cycles);
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, zero_page_sharing )
+{
+    constexpr size_t touches = sparse_region_size / sparse_stride;
+
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t s = j6_vma_create_map(&vma, sparse_region_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+
+    // Reading maps the zero page without allocating anything
+    uint8_t bits = 0;
+    uint64_t faults = fault_count();
+    uint64_t start = test::cycles();
+    for (size_t i = 0; i < sparse_region_size; i += sparse_stride)
+        bits |= p[i];
+    uint64_t read_cycles = test::cycles() - start;
+    faults = fault_count() - faults;
+    CHECK( bits == 0, "New pages were not zeroed" );
+    CHECK( faults >= touches, "Reading new pages did not fault" );
+
+    // The first write to each page copies it off the zero page
+    start = test::cycles();
+    for (size_t i = 0; i < sparse_region_size; i += sparse_stride)
+        p[i] = 1;
+    uint64_t cow_cycles = test::cycles() - start;
+    CHECK( p[0] == 1 && p[page_size] == 0, "Writing a zero page changed its neighbours" );
+
+    // Writing new pages directly
+    j6_handle_t fresh = j6_handle_invalid;
+    uintptr_t fresh_addr = 0;
+    s = j6_vma_create_map(&fresh, sparse_region_size, &fresh_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+    volatile uint8_t *q = reinterpret_cast<volatile uint8_t*>(fresh_addr);
+
+    start = test::cycles();
+    for (size_t i = 0; i < sparse_region_size; i += sparse_stride)
+        q[i] = 1;
+    uint64_t write_cycles = test::cycles() - start;
+    CHECK( q[page_size] == 0, "New pages were not zeroed" );
+
+    BENCH_REPORT("%lld touches: %lld cycles/read fault, %lld cycles/copy of zero page, %lld cycles/write fault",
+            touches, read_cycles / touches, cow_cycles / touches, write_cycles / touches);
+
+    j6_vma_unmap(fresh, j6_handle_invalid);
+    j6_vma_unmap(vma, j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, table_reclaim )
+{
+    constexpr size_t touches = table_region_size / table_stride;
+
+    j6_vm_space_stats before, mapped, after;
+    REQUIRE( space_stats(before), "Could not get VM stats" );
+
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t addr = 0;
+    j6_status_t s = j6_vma_create_map(&vma, table_region_size, &addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create VMA" );
+
+    // Every touch needs a new page table
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(addr);
+    uint64_t start = test::cycles();
+    for (size_t i = 0; i < table_region_size; i += table_stride)
+        p[i] = 1;
+    uint64_t touch_cycles = test::cycles() - start;
+
+    CHECK( space_stats(mapped), "Could not get VM stats" );
+    uint64_t allocated = mapped.tables_allocated - before.tables_allocated;
+    CHECK( allocated >= touches, "Touching pages did not allocate page tables" );
+
+    // Unmapping the area leaves its tables empty, so they are freed
+    start = test::cycles();
+    j6_vma_unmap(vma, j6_handle_invalid);
+    uint64_t unmap_cycles = test::cycles() - start;
+
+    CHECK( space_stats(after), "Could not get VM stats" );
+    uint64_t freed = after.tables_freed - mapped.tables_freed;
+    CHECK( freed >= touches, "Unmapping did not free empty page tables" );
+
+    BENCH_REPORT("%lld tables allocated, %lld freed: %lld cycles/touch, %lld cycles to unmap",
+            allocated, freed, touch_cycles / touches, unmap_cycles);
+}
+
+TEST_CASE( vm_tests, fault_around_memset )
+{
+    struct {
+        const char *name;
+        uint32_t hint;
+    } variants[] = {
+        {"random", j6_vm_flag_random},
+        {"default", j6_vm_flag_none},
+        {"sequential", j6_vm_flag_sequential},
+    };
+
+    for (auto &v : variants) {
+        j6_handle_t vma = j6_handle_invalid;
+        uintptr_t addr = 0;
+
+        j6_status_t s = j6_vma_create_map(&vma, memset_region_size, &addr, j6_vm_flag_write);
+        CHECK( s == j6_status_ok, "Could not create VMA" );
+        if (s != j6_status_ok) continue;
+
+        s = j6_vma_advise(vma, v.hint, 0);
+        CHECK( s == j6_status_ok, "Could not set VMA access hint" );
+
+        uint64_t faults = fault_count();
+        uint64_t ns_start = 0, ns_end = 0;
+        bool have_ns = j6_clock_gettime(&ns_start) == j6_status_ok;
+        uint64_t start = test::cycles();
+
+        memset(reinterpret_cast<void*>(addr), 0xa5, memset_region_size);
+
+        uint64_t cycles = test::cycles() - start;
+        have_ns = have_ns && j6_clock_gettime(&ns_end) == j6_status_ok;
+        faults = fault_count() - faults;
+
+        uint8_t *p = reinterpret_cast<uint8_t*>(addr);
+        CHECK( p[0] == 0xa5 && p[memset_region_size - 1] == 0xa5, "Memset did not write memory" );
+
+        // Every page is faulted in with the random hint, more are
+        // mapped per fault otherwise
+        if (v.hint == j6_vm_flag_random)
+            CHECK( faults >= memset_region_size / page_size, "Random hint mapped more than one page per fault" );
+        else
+            CHECK( faults < memset_region_size / page_size, "Fault-around did not map extra pages" );
+
+        if (have_ns && ns_end > ns_start) {
+            BENCH_REPORT("%s hint: %lld faults, %lld us, %lld cycles",
+                    v.name, faults, (ns_end - ns_start) / 1000, cycles);
+        } else {
+            BENCH_REPORT("%s hint: %lld faults, %lld cycles", v.name, faults, cycles);
+        }
+
+        j6_vma_unmap(vma, j6_handle_invalid);
+    }
+}
+
+TEST_CASE( vm_tests, many_vma_fault_latency )
+{
+    static uintptr_t bases[many_vmas];
+    static j6_handle_t vmas[many_vmas];
+
+    size_t mapped = 0;
+    for (; mapped < many_vmas; ++mapped) {
+        vmas[mapped] = j6_handle_invalid;
+        bases[mapped] = 0;
+        j6_status_t s = j6_vma_create_map(&vmas[mapped], many_vma_pages * page_size,
+                &bases[mapped], j6_vm_flag_write | j6_vm_flag_random);
+        if (s != j6_status_ok)
+            break;
+    }
+    CHECK( mapped == many_vmas, "Could not create VMAs" );
+
+    // Touch every page once, in a scattered order so faults don't just
+    // hit the most recently added areas. The stride is prime, so it
+    // visits every page.
+    constexpr size_t stride = 2999;
+    size_t pages = mapped * many_vma_pages;
+    uint64_t faults = fault_count();
+
+    uint64_t start = test::cycles();
+    for (size_t n = 0; n < pages; ++n) {
+        size_t page = (n * stride) % pages;
+        volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(bases[page / many_vma_pages]);
+        p[(page % many_vma_pages) * page_size] = 1;
+    }
+    uint64_t cycles = test::cycles() - start;
+    faults = fault_count() - faults;
+
+    CHECK( faults >= pages, "Touching pages did not fault" );
+    if (faults)
+        BENCH_REPORT("%lld VMAs: %lld faults, %lld cycles/fault", mapped, faults, cycles / faults);
+
+    for (size_t i = 0; i < mapped; ++i)
+        j6_vma_unmap(vmas[i], j6_handle_invalid);
+}
+
+TEST_CASE( vm_tests, large_page_random_access )
+{
+    struct {
+        const char *name;
+        uint32_t flags;
+    } variants[] = {
+        {"4KiB", 0},
+        {"2MiB", j6_vm_flag_large_pages},
+        {"1GiB", j6_vm_flag_huge_pages},
+    };
+
+    for (auto &v : variants) {
+        uint64_t fault_cycles = 0, touch_cycles = 0;
+        bool ok = random_touch(v.flags, fault_cycles, touch_cycles);
+        CHECK( ok, "Could not create 1GiB VMA" );
+        if (!ok) continue;
+
+        BENCH_REPORT("%s pages: %lld cycles/first touch, %lld cycles/touch",
+                v.name, fault_cycles / random_touches, touch_cycles / random_touches);
+    }
+}
+
+TEST_CASE( vm_tests, large_page_reuse )
+{
+    constexpr size_t large_pages = large_region_size / large_page_size;
+    constexpr size_t pages = large_region_size / page_size;
+    constexpr size_t page_words = page_size / sizeof(uint64_t);
+
+    uint64_t fault_cycles = 0, unmap_cycles = 0;
+    unsigned short_faults = 0, unzeroed = 0, overlapped = 0;
+
+    // Each round needs 32 aligned runs of 512 free frames, and gives
+    // them back when unmapped, so later rounds reuse the same frames
+    for (unsigned round = 0; round < large_page_rounds; ++round) {
+        j6_handle_t vma = j6_handle_invalid;
+        uintptr_t addr = 0;
+        j6_status_t s = j6_vma_create_map(&vma, large_region_size, &addr,
+                j6_vm_flag_write | j6_vm_flag_large_pages);
+        REQUIRE( s == j6_status_ok, "Could not create VMA" );
+        volatile uint64_t *p = reinterpret_cast<volatile uint64_t*>(addr);
+
+        uint64_t faults = fault_count();
+        uint64_t start = test::cycles();
+        for (size_t i = 0; i < large_pages; ++i)
+            p[i * large_page_size / sizeof(uint64_t)] = 0;
+        fault_cycles += test::cycles() - start;
+
+        // Only one fault per large page if every one was backed by
+        // a contiguous run of frames
+        if (fault_count() - faults != large_pages)
+            ++short_faults;
+
+        // Stamp every page, then read the stamps back to find pages
+        // that share frames
+        for (size_t i = 0; i < pages; ++i) {
+            volatile uint64_t *page = p + i * page_words;
+            if (page[0] || page[page_words - 1])
+                ++unzeroed;
+            page[0] = page[page_words - 1] = (uint64_t(round) << 32) | i;
+        }
+        for (size_t i = 0; i < pages; ++i) {
+            volatile uint64_t *page = p + i * page_words;
+            uint64_t stamp = (uint64_t(round) << 32) | i;
+            if (page[0] != stamp || page[page_words - 1] != stamp)
+                ++overlapped;
+        }
+
+        start = test::cycles();
+        j6_vma_unmap(vma, j6_handle_invalid);
+        unmap_cycles += test::cycles() - start;
+    }
+
+    CHECK( short_faults == 0, "Large pages were not backed by contiguous frames" );
+    CHECK( unzeroed == 0, "Reused large pages were not zeroed" );
+    CHECK( overlapped == 0, "Large pages shared frames" );
+
+    BENCH_REPORT("%lld large pages: %lld cycles/first touch, %lld cycles/unmap",
+            large_pages, fault_cycles / (large_pages * large_page_rounds),
+            unmap_cycles / large_page_rounds);
+}
+
+TEST_CASE( vm_tests, page_fault_scaling )
+{
+    unsigned threads = cpu_count();
+    if (threads > max_fault_threads)
+        threads = max_fault_threads;
+
+    uint64_t ns_start = 0, ns_end = 0;
+    fault_errors = 0;
+
+    for (unsigned n = 1; n <= threads; ++n) {
+        test_thread *workers[max_fault_threads];
+
+        uint64_t start = test::cycles();
+        bool have_ns = j6_clock_gettime(&ns_start) == j6_status_ok;
+
+        for (unsigned i = 0; i < n; ++i) {
+            workers[i] = new test_thread {fault_proc, thread_stack_size};
+            CHECK( workers[i]->start() == j6_status_ok, "Could not start fault thread" );
+        }
+
+        for (unsigned i = 0; i < n; ++i) {
+            workers[i]->join();
+            delete workers[i];
+        }
+
+        uint64_t cycles = test::cycles() - start;
+        have_ns = have_ns && j6_clock_gettime(&ns_end) == j6_status_ok;
+
+        uint64_t faults = n * fault_pages;
+        if (have_ns && ns_end > ns_start) {
+            BENCH_REPORT("%d threads: %lld faults/s, %lld cycles/fault",
+                    n, faults * 1000000000 / (ns_end - ns_start), cycles / faults);
+        } else {
+            BENCH_REPORT("%d threads: %lld cycles/fault", n, cycles / faults);
+        }
+    }
+
+    CHECK( fault_errors == 0, "Fault threads could not create VMAs" );
+}